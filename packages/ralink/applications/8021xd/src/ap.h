@@ -1,6 +1,8 @@
 #ifndef AP_H
 #define AP_H
 
+#include "eapol_sm.h"
+
 /* STA flags */
 #define WLAN_STA_AUTH           BIT(0)
 #define WLAN_STA_ASSOC          BIT(1)
@@ -23,7 +25,11 @@
 struct sta_info
 {
     struct sta_info         *next; /* next entry in sta list */
-    struct sta_info         *hnext; /* next entry in hash table list */
+    struct sta_info         *prev;
+    struct sta_info         *bss_next; /* next entry in the list of this ApIdx */
+    struct sta_info         *bss_prev;
+    struct sta_info         *evict_next; /* next unauthorized entry, see Ap_sta_port_changed() */
+    struct sta_info         *evict_prev;
     u8                      addr[6];
     u16                     aid; /* STA's unique AID (1 .. 2007) or 0 if not yet assigned */
     u32                     flags;
@@ -34,17 +40,23 @@ struct sta_info
 
     enum { STA_NULLFUNC = 0, STA_DISASSOC, STA_DEAUTH } timeout_next;
 
+    struct eloop_timeout    *session_timeout;
+    eloop_time_t            session_deadline; /* 0 if no session timeout */
+
     /* IEEE 802.1X related data */
-    struct                  eapol_state_machine *eapol_sm;
-    int                     radius_identifier;
+    struct eapol_state_machine eapol_sm;
+    int                     radius_request; /* Radius_client_send() handle, -1 if none */
     /* TODO: check when the last messages can be released */
     struct radius_msg       *last_recv_radius;
     u8                      *last_eap_supp; /* last received EAP Response from Supplicant */
     size_t                  last_eap_supp_len;
+    size_t                  last_eap_supp_size; /* Pool_buf_alloc() size */
     u8                      *last_eap_radius; /* last received EAP Response from Authentication Server */
     size_t                  last_eap_radius_len;
+    size_t                  last_eap_radius_size;
     u8                      *identity;
     size_t                  identity_len;
+    size_t                  identity_size;
 
     /* Keys for encrypting and signing EAPOL-Key frames */
     u8                      *eapol_key_sign;
@@ -61,16 +73,21 @@ struct sta_info
 
     // From which raw socket
     int                     SockNum;
+
+    unsigned int            ckpt_slot; /* checkpoint record + 1, 0 if none */
 };
 
+/* Default station table capacity, see the -m option; when the table is full
+ * the least recently active unauthorized station makes room */
 #define MAX_STA_COUNT           1024
 
 /* Maximum number of AIDs to use for STAs; must be 2007 or lower
  * (8802.11 limitation) */
 #define MAX_AID_TABLE_SIZE      256
 
-#define STA_HASH_SIZE           256
-#define STA_HASH(sta)           (sta[5])
+/* Initial size of the open addressing station hash table; it doubles
+ * whenever it becomes half full and shrinks when it is mostly empty */
+#define STA_HASH_MIN_SIZE       16
 
 /* Default value for maximum station inactivity. After AP_MAX_INACTIVITY has
  * passed since last received frame from the station, a nullfunc data frame is
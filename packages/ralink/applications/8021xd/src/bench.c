@@ -0,0 +1,267 @@
+/* Standalone micro-benchmarks, built with "make bench". They link the
+ * daemon objects without rtdot1x.o; the driver ioctl is stubbed out. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "rtdot1x.h"
+#include "ieee802_1x.h"
+#include "eloop.h"
+#include "eapol_sm.h"
+#include "sta_info.h"
+#include "pool.h"
+
+u32 RTDebugLevel = RT_DEBUG_OFF;
+
+int RT_ioctl(int sid, int param, char *data, int data_len, char *prefix_name, unsigned char apidx, int flags)
+{
+    return 0;
+}
+
+u16 RTMPCompareMemory(void *pSrc1, void *pSrc2, u16 Length)
+{
+    return memcmp(pSrc1, pSrc2, Length) ? 1 : 0;
+}
+
+void dot1x_set_IdleTimeoutAction(rtapd *rtapd, struct sta_info *sta, u32 idle_timeout)
+{
+}
+
+static struct rtapd_config bench_conf;
+static rtapd bench_apd;
+
+static double bench_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static rtapd *bench_init(int num_sta)
+{
+    rtapd *rtapd = &bench_apd;
+    int i;
+
+    memset(rtapd, 0, sizeof(*rtapd));
+    bench_conf.SsidNum = 1;
+    bench_conf.quiet_interval = AUTH_PAE_DEFAULT_quietPeriod;
+    rtapd->conf = &bench_conf;
+    rtapd->prefix_wlan_name = "bench";
+    rtapd->max_sta = num_sta;
+    rtapd->eap_rto_min = EAP_RTO_DEFAULT_MIN;
+    rtapd->eap_rto_max = EAP_RTO_DEFAULT_MAX;
+    rtapd->sta_hash_seed = random();
+    for (i = 0; i < MAX_MBSSID_NUM; i++)
+    {
+        rtapd->wlan_sock[i] = -1;
+        rtapd->eth_sock[i] = -1;
+    }
+
+    return rtapd;
+}
+
+static void bench_mac(u8 *addr, u32 n)
+{
+    addr[0] = 0x00;
+    addr[1] = 0x0c;
+    addr[2] = 0x43;
+    addr[3] = n >> 16;
+    addr[4] = n >> 8;
+    addr[5] = n;
+}
+
+typedef void (*bench_stepper)(rtapd *rtapd, struct eapol_state_machine *sm);
+
+/* step() over num_sta authorized ports: with nothing pending, and with an
+ * EAPOL-Start on each, which restarts it to CONNECTING */
+static void bench_eapol_run(rtapd *rtapd, struct sta_info **stas, int num_sta, int rounds,
+                            const char *name, bench_stepper step)
+{
+    unsigned long steps, wrong = 0;
+    double start, idle = 0, restart = 0;
+    int i, r;
+
+    for (r = 0; r < rounds; r++)
+    {
+        start = bench_secs();
+        for (i = 0; i < num_sta; i++)
+            step(rtapd, &stas[i]->eapol_sm);
+        idle += bench_secs() - start;
+
+        start = bench_secs();
+        for (i = 0; i < num_sta; i++)
+        {
+            stas[i]->eapol_sm.auth_pae.eapStart = TRUE;
+            step(rtapd, &stas[i]->eapol_sm);
+        }
+        restart += bench_secs() - start;
+
+        for (i = 0; i < num_sta; i++)
+        {
+            wrong += stas[i]->eapol_sm.auth_pae.state != AUTH_PAE_CONNECTING;
+            eapol_sm_authenticated(rtapd, &stas[i]->eapol_sm, stas[i]->eapol_sm.reAuthWhen);
+        }
+    }
+
+    steps = (unsigned long) num_sta * rounds;
+    printf("  %-8s idle %10.0f steps/s, restart %10.0f steps/s%s\n",
+           name, steps / idle, steps / restart, wrong ? " (WRONG STATE)" : "");
+}
+
+/* The generated switches of eapol_sm_step() against the function pointer
+ * tables they replaced and against nested switches written by hand */
+static void bench_eapol(int num_sta, int rounds)
+{
+    rtapd *rtapd = bench_init(num_sta);
+    struct sta_info **stas;
+    u8 addr[ETH_ALEN], apidx = 0;
+    int i;
+
+    stas = (struct sta_info **) malloc(num_sta * sizeof(*stas));
+    if (stas == NULL)
+        return;
+
+    for (i = 0; i < num_sta; i++)
+    {
+        bench_mac(addr, i);
+        stas[i] = Ap_get_sta(rtapd, addr, &apidx, ETH_P_PAE, -1);
+        if (stas[i] == NULL)
+        {
+            printf("bench: cannot add station %d\n", i);
+            return;
+        }
+        stas[i]->eapol_sm.reauth_timer.reAuthEnabled = TRUE;
+        eapol_sm_authenticated(rtapd, &stas[i]->eapol_sm, 0);
+        eapol_sm_step(rtapd, &stas[i]->eapol_sm);
+    }
+
+    printf("eapol_sm_step, %d stations, %d rounds\n", num_sta, rounds);
+    bench_eapol_run(rtapd, stas, num_sta, rounds, "switch", eapol_sm_step);
+    bench_eapol_run(rtapd, stas, num_sta, rounds, "table", eapol_sm_step_table);
+    bench_eapol_run(rtapd, stas, num_sta, rounds, "nested", eapol_sm_step_nested);
+
+    Apd_free_stas(rtapd);
+    free(stas);
+}
+
+/* Linear probes Ap_find_sta() makes to reach addr */
+static unsigned int bench_sta_probes(rtapd *rtapd, const u8 *addr)
+{
+    unsigned int mask = rtapd->sta_hash_size - 1, i, probes = 1;
+
+    for (i = Ap_sta_hash(rtapd, addr) & mask;
+         memcmp(rtapd->sta_hash[i]->addr, addr, ETH_ALEN) != 0;
+         i = (i + 1) & mask)
+        probes++;
+
+    return probes;
+}
+
+/* Ap_sta_hash_add() and Ap_find_sta() with sequential addresses and with
+ * addresses that all share their last byte, the old 256 bucket chained
+ * hash on addr[5]. The old probe counts are the chain positions it would
+ * have walked. */
+static void bench_sta_run(int num_sta, int rounds, int colliding)
+{
+    rtapd *rtapd = bench_init(num_sta);
+    struct sta_info **stas;
+    unsigned int chain[256], probes, max_probes = 0, old_max = 0;
+    unsigned long total = 0, old_total = 0, found = 0;
+    double start, add, find;
+    u8 addr[ETH_ALEN];
+    int i, r;
+
+    stas = (struct sta_info **) malloc(num_sta * sizeof(*stas));
+    if (stas == NULL)
+        return;
+    memset(chain, 0, sizeof(chain));
+
+    for (i = 0; i < num_sta; i++)
+    {
+        bench_mac(addr, colliding ? i << 8 : i);
+        stas[i] = Pool_sta_alloc();
+        if (stas[i] == NULL)
+            return;
+        memcpy(stas[i]->addr, addr, ETH_ALEN);
+    }
+
+    start = bench_secs();
+    for (i = 0; i < num_sta; i++)
+        Ap_sta_hash_add(rtapd, stas[i]);
+    add = bench_secs() - start;
+
+    start = bench_secs();
+    for (r = 0; r < rounds; r++)
+    {
+        for (i = 0; i < num_sta; i++)
+            found += Ap_find_sta(rtapd, stas[i]->addr) == stas[i];
+    }
+    find = bench_secs() - start;
+
+    for (i = 0; i < num_sta; i++)
+    {
+        probes = bench_sta_probes(rtapd, stas[i]->addr);
+        total += probes;
+        if (probes > max_probes)
+            max_probes = probes;
+
+        /* new stations went to the head of their chain */
+        old_total += ++chain[stas[i]->addr[5]];
+        if (chain[stas[i]->addr[5]] > old_max)
+            old_max = chain[stas[i]->addr[5]];
+    }
+
+    printf("%s addresses, %d stations, table size %u\n",
+           colliding ? "colliding" : "sequential", num_sta, rtapd->sta_hash_size);
+    printf("  seeded hash: %6.2f probes avg, %4u max, %10.0f adds/s, %10.0f lookups/s%s\n",
+           (double) total / num_sta, max_probes, num_sta / add,
+           (double) num_sta * rounds / find, found == (unsigned long) num_sta * rounds ? "" : " (MISSES)");
+    printf("  addr[5] hash: %5.2f probes avg, %4u max\n",
+           (double) old_total / num_sta, old_max);
+
+    for (i = 0; i < num_sta; i++)
+        Pool_sta_free(stas[i]);
+    free(rtapd->sta_hash);
+    free(stas);
+}
+
+static void bench_sta(int num_sta, int rounds)
+{
+    bench_sta_run(num_sta, rounds, 0);
+    bench_sta_run(num_sta, rounds, 1);
+}
+
+static void usage(void)
+{
+    printf("usage: 8021xd_bench eapol|sta [stations] [rounds]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int num_sta, rounds;
+
+    if (argc < 2)
+        usage();
+    num_sta = argc > 2 ? atoi(argv[2]) : 1000;
+    rounds = argc > 3 ? atoi(argv[3]) : 1000;
+    if (num_sta < 1 || rounds < 1)
+        usage();
+
+    srandom(time(NULL));
+    eloop_init(NULL);
+
+    if (strcmp(argv[1], "eapol") == 0)
+        bench_eapol(num_sta, rounds);
+    else if (strcmp(argv[1], "sta") == 0)
+        bench_sta(num_sta, rounds);
+    else
+        usage();
+
+    eloop_destroy();
+    Pool_deinit();
+    return 0;
+}
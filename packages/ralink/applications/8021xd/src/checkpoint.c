@@ -0,0 +1,475 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "rtdot1x.h"
+#include "sta_info.h"
+#include "eapol_sm.h"
+#include "radius.h"
+#include "md5.h"
+#include "ieee802_1x.h"
+#include "pool.h"
+#include "checkpoint.h"
+#include "eloop.h"
+
+#if STA_CHECKPOINT
+
+#define CHECKPOINT_MAGIC        0x31583844  /* "D8X1" */
+#define CHECKPOINT_VERSION      1
+#define CHECKPOINT_BOOT_ID      "/proc/sys/kernel/random/boot_id"
+
+struct checkpoint_header
+{
+    u32 magic;
+    u16 version;
+    u16 rec_size;
+    u32 slots;
+    u32 reserved;
+    /* deadlines are on the monotonic clock, which restarts with the system */
+    u8 boot_id[40];
+    /* BSSID and authentication settings of every BSS */
+    u8 bss_digest[MAX_MBSSID_NUM][MD5_MAC_LEN];
+};
+
+struct checkpoint_sta
+{
+    u32 check; /* hash of the rest of the record, 0 for a free slot */
+    u32 reauth_period;
+    eloop_time_t reauth_when;
+    eloop_time_t session_deadline;
+    u16 ethertype;
+    u8 addr[ETH_ALEN];
+    u8 apidx;
+    u8 sock_idx; /* into wlan_sock[], or eth_sock[] for pre-auth */
+    u8 identity_len;
+    u8 key_sign_len;
+    u8 key_crypt_len;
+    u8 state_len;
+    u8 class_len;
+    u8 identity[CHECKPOINT_IDENTITY_MAX];
+    u8 key_sign[CHECKPOINT_KEY_MAX];
+    u8 key_crypt[CHECKPOINT_KEY_MAX];
+    u8 state[CHECKPOINT_ATTR_MAX];
+    u8 class[CHECKPOINT_ATTR_MAX];
+};
+
+/* records start after the header, aligned for the 64-bit deadlines */
+#define CHECKPOINT_REC_OFFSET   ((sizeof(struct checkpoint_header) + 7) & ~7)
+
+struct checkpoint
+{
+    struct checkpoint_header *hdr; /* the mapped file */
+    struct checkpoint_sta *recs;
+    size_t size;
+    u32 *free_slots;
+    u32 num_free;
+};
+
+static u32 Checkpoint_check(struct checkpoint_sta *rec)
+{
+    const u8 *pos = (const u8 *) rec + sizeof(rec->check);
+    u32 h = 0x811c9dc5;
+    size_t i;
+
+    for (i = 0; i < sizeof(*rec) - sizeof(rec->check); i++)
+    {
+        h ^= pos[i];
+        h *= 0x01000193;
+    }
+
+    return h ? h : 1;
+}
+
+static void Checkpoint_boot_id(u8 *id, size_t len)
+{
+    FILE *f;
+
+    memset(id, 0, len);
+    f = fopen(CHECKPOINT_BOOT_ID, "r");
+    if (f == NULL)
+        return;
+    if (fread(id, 1, len, f) == 0)
+        memset(id, 0, len);
+    fclose(f);
+}
+
+/* Stations of a BSS are only taken over if the driver still reports the
+ * same BSSID and the settings they authenticated with are unchanged */
+static void Checkpoint_bss_digest(rtapd *rtapd, int apidx, u8 *digest)
+{
+    struct rtapd_config *conf = rtapd->conf;
+    struct hostapd_radius_server *servs;
+    MD5_CTX ctx;
+    int num, i;
+
+#if MULTIPLE_RADIUS
+    servs = conf->mbss_auth_servers[apidx];
+    num = conf->mbss_num_auth_servers[apidx];
+#else
+    servs = conf->auth_servers;
+    num = conf->num_auth_servers;
+#endif
+
+    MD5Init(&ctx);
+    MD5Update(&ctx, rtapd->own_addr[apidx], ETH_ALEN);
+    MD5Update(&ctx, (u8 *) &conf->DefaultKeyID[apidx], sizeof(conf->DefaultKeyID[apidx]));
+    MD5Update(&ctx, (u8 *) &conf->individual_wep_key_len[apidx], sizeof(conf->individual_wep_key_len[apidx]));
+    MD5Update(&ctx, (u8 *) &conf->individual_wep_key_idx[apidx], sizeof(conf->individual_wep_key_idx[apidx]));
+    MD5Update(&ctx, conf->IEEE8021X_ikey[apidx], WEP8021X_KEY_LEN);
+    MD5Update(&ctx, conf->nasId[apidx], conf->nasId_len[apidx]);
+    for (i = 0; servs && i < num; i++)
+    {
+        MD5Update(&ctx, (u8 *) &servs[i].addr, sizeof(servs[i].addr));
+        MD5Update(&ctx, (u8 *) &servs[i].port, sizeof(servs[i].port));
+        MD5Update(&ctx, servs[i].shared_secret, servs[i].shared_secret_len);
+    }
+    MD5Final(digest, &ctx);
+}
+
+static int Checkpoint_sock_idx(rtapd *rtapd, struct sta_info *sta)
+{
+    int i;
+
+    for (i = 0; i < MAX_MBSSID_NUM; i++)
+    {
+        if (sta->ethertype == ETH_P_PRE_AUTH ? rtapd->eth_sock[i] == sta->SockNum :
+            rtapd->wlan_sock[i] == sta->SockNum)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Write the session of an authorized station to its record */
+void Checkpoint_sta_save(rtapd *rtapd, struct sta_info *sta)
+{
+    struct checkpoint *ckpt = rtapd->ckpt;
+    struct checkpoint_sta *rec;
+    int state_len = -1, class_len = -1, sock_idx;
+
+    if (ckpt == NULL)
+        return;
+
+    if (sta->last_recv_radius)
+    {
+        state_len = Radius_msg_get_attr(sta->last_recv_radius, RADIUS_ATTR_STATE, NULL, 0);
+        class_len = Radius_msg_get_attr(sta->last_recv_radius, RADIUS_ATTR_CLASS, NULL, 0);
+    }
+    sock_idx = Checkpoint_sock_idx(rtapd, sta);
+
+    /* a session that does not fit goes through RADIUS after a restart */
+    if (sta->identity_len > CHECKPOINT_IDENTITY_MAX ||
+        sta->eapol_key_sign_len > CHECKPOINT_KEY_MAX ||
+        sta->eapol_key_crypt_len > CHECKPOINT_KEY_MAX ||
+        state_len > CHECKPOINT_ATTR_MAX || class_len > CHECKPOINT_ATTR_MAX || sock_idx < 0)
+    {
+        DBGPRINT(RT_DEBUG_TRACE, "Checkpoint: cannot keep STA " MACSTR "\n", MAC2STR(sta->addr));
+        Checkpoint_sta_drop(rtapd, sta);
+        return;
+    }
+
+    if (sta->ckpt_slot == 0)
+    {
+        if (ckpt->num_free == 0)
+            return;
+        sta->ckpt_slot = ckpt->free_slots[--ckpt->num_free] + 1;
+    }
+
+    rec = &ckpt->recs[sta->ckpt_slot - 1];
+    rec->check = 0;
+    memset(rec, 0, sizeof(*rec));
+
+    rec->reauth_period = sta->eapol_sm.reauth_timer.reAuthPeriod;
+    rec->reauth_when = sta->eapol_sm.reAuthWhen;
+    rec->session_deadline = sta->session_deadline;
+    rec->ethertype = sta->ethertype;
+    memcpy(rec->addr, sta->addr, ETH_ALEN);
+    rec->apidx = sta->ApIdx;
+    rec->sock_idx = sock_idx;
+    if (sta->identity)
+    {
+        rec->identity_len = sta->identity_len;
+        memcpy(rec->identity, sta->identity, sta->identity_len);
+    }
+    if (sta->eapol_key_sign)
+    {
+        rec->key_sign_len = sta->eapol_key_sign_len;
+        memcpy(rec->key_sign, sta->eapol_key_sign, sta->eapol_key_sign_len);
+    }
+    if (sta->eapol_key_crypt)
+    {
+        rec->key_crypt_len = sta->eapol_key_crypt_len;
+        memcpy(rec->key_crypt, sta->eapol_key_crypt, sta->eapol_key_crypt_len);
+    }
+    if (state_len > 0)
+        rec->state_len = Radius_msg_get_attr(sta->last_recv_radius, RADIUS_ATTR_STATE, rec->state, state_len);
+    if (class_len > 0)
+        rec->class_len = Radius_msg_get_attr(sta->last_recv_radius, RADIUS_ATTR_CLASS, rec->class, class_len);
+
+    /* last, so that a record cut short by a crash does not validate */
+    rec->check = Checkpoint_check(rec);
+}
+
+void Checkpoint_sta_drop(rtapd *rtapd, struct sta_info *sta)
+{
+    struct checkpoint *ckpt = rtapd->ckpt;
+
+    if (ckpt == NULL || sta->ckpt_slot == 0)
+        return;
+
+    memset(&ckpt->recs[sta->ckpt_slot - 1], 0, sizeof(struct checkpoint_sta));
+    ckpt->free_slots[ckpt->num_free++] = sta->ckpt_slot - 1;
+    sta->ckpt_slot = 0;
+}
+
+static int Checkpoint_restore_sta(rtapd *rtapd, struct checkpoint_sta *rec)
+{
+    struct sta_info *sta;
+    struct radius_msg *msg;
+    eloop_time_t now = eloop_now();
+    u8 apidx = rec->apidx;
+    int sock;
+
+    sock = rec->ethertype == ETH_P_PRE_AUTH ? rtapd->eth_sock[rec->sock_idx] : rtapd->wlan_sock[rec->sock_idx];
+    if (sock < 0 || Ap_find_sta(rtapd, rec->addr))
+        return -1;
+
+    sta = Ap_get_sta(rtapd, rec->addr, &apidx, rec->ethertype, sock);
+    if (sta == NULL)
+        return -1;
+
+    if (rec->identity_len)
+    {
+        sta->identity = Pool_buf_alloc(rec->identity_len, &sta->identity_size);
+        if (sta->identity == NULL)
+            goto fail;
+        memcpy(sta->identity, rec->identity, rec->identity_len);
+        sta->identity_len = rec->identity_len;
+    }
+
+    if (rec->key_sign_len && rec->key_crypt_len)
+    {
+        sta->eapol_key_sign = malloc(rec->key_sign_len);
+        sta->eapol_key_crypt = malloc(rec->key_crypt_len);
+        if (sta->eapol_key_sign == NULL || sta->eapol_key_crypt == NULL)
+            goto fail;
+        memcpy(sta->eapol_key_sign, rec->key_sign, rec->key_sign_len);
+        sta->eapol_key_sign_len = rec->key_sign_len;
+        memcpy(sta->eapol_key_crypt, rec->key_crypt, rec->key_crypt_len);
+        sta->eapol_key_crypt_len = rec->key_crypt_len;
+    }
+
+    /* State and Class of the Access-Accept, for the next Access-Request */
+    if (rec->state_len || rec->class_len)
+    {
+        msg = Radius_msg_new(RADIUS_CODE_ACCESS_ACCEPT, 0);
+        if (msg == NULL)
+            goto fail;
+        sta->last_recv_radius = msg;
+        if ((rec->state_len && !Radius_msg_add_attr(msg, RADIUS_ATTR_STATE, rec->state, rec->state_len)) ||
+            (rec->class_len && !Radius_msg_add_attr(msg, RADIUS_ATTR_CLASS, rec->class, rec->class_len)))
+            goto fail;
+    }
+
+    sta->eapol_sm.reauth_timer.reAuthPeriod = rec->reauth_period;
+    if (rec->session_deadline)
+        Ap_sta_session_timeout(rtapd, sta, (rec->session_deadline - now + ELOOP_NSEC_PER_SEC - 1) / ELOOP_NSEC_PER_SEC);
+    if (ieee802_1x_reinstall_sta(rtapd, sta) == 0)
+        eapol_sm_authenticated(rtapd, &sta->eapol_sm, rec->reauth_when);
+    else
+    {
+        /* without the driver's port the record is no good; reauthenticate
+         * as soon as the reauthentication limiter lets it */
+        DBGPRINT(RT_DEBUG_WARN, "Checkpoint: driver refused STA " MACSTR ", reauthenticating\n", MAC2STR(sta->addr));
+        eapol_sm_authenticated(rtapd, &sta->eapol_sm, now);
+    }
+
+    Checkpoint_sta_save(rtapd, sta);
+    return 0;
+
+fail:
+    Ap_free_sta(rtapd, sta);
+    return -1;
+}
+
+static void Checkpoint_restore(rtapd *rtapd, struct checkpoint_header *old, size_t size)
+{
+    struct checkpoint_header *hdr = rtapd->ckpt->hdr;
+    struct checkpoint_sta *recs, *rec;
+    eloop_time_t now = eloop_update_time();
+    u32 i, num;
+    int restored = 0, dropped = 0;
+
+    if (old->magic != CHECKPOINT_MAGIC || old->version != CHECKPOINT_VERSION ||
+        old->rec_size != sizeof(struct checkpoint_sta) ||
+        memcmp(old->boot_id, hdr->boot_id, sizeof(hdr->boot_id)) != 0)
+    {
+        DBGPRINT(RT_DEBUG_WARN, "Checkpoint: ignoring the file of an older version or boot\n");
+        return;
+    }
+
+    num = old->slots;
+    if (num > (size - CHECKPOINT_REC_OFFSET) / sizeof(*rec))
+        num = (size - CHECKPOINT_REC_OFFSET) / sizeof(*rec);
+    recs = (struct checkpoint_sta *) ((u8 *) old + CHECKPOINT_REC_OFFSET);
+
+    for (i = 0; i < num; i++)
+    {
+        rec = &recs[i];
+        if (rec->check == 0)
+            continue;
+
+        if (rec->check != Checkpoint_check(rec) ||
+            rec->identity_len > CHECKPOINT_IDENTITY_MAX ||
+            rec->key_sign_len > CHECKPOINT_KEY_MAX || rec->key_crypt_len > CHECKPOINT_KEY_MAX ||
+            rec->state_len > CHECKPOINT_ATTR_MAX || rec->class_len > CHECKPOINT_ATTR_MAX ||
+            rec->sock_idx >= MAX_MBSSID_NUM ||
+            rec->apidx >= rtapd->conf->SsidNum ||
+            memcmp(old->bss_digest[rec->apidx], hdr->bss_digest[rec->apidx], MD5_MAC_LEN) != 0 ||
+            (rec->session_deadline && rec->session_deadline <= now) ||
+            Checkpoint_restore_sta(rtapd, rec))
+        {
+            dropped++;
+            continue;
+        }
+
+        DBGPRINT(RT_DEBUG_TRACE, "Checkpoint: restored STA " MACSTR " (in %s%d)\n",
+                 MAC2STR(rec->addr), rtapd->prefix_wlan_name, rec->apidx);
+        restored++;
+    }
+
+    DBGPRINT(RT_DEBUG_WARN, "Checkpoint: %d stations restored, %d discarded\n", restored, dropped);
+}
+
+/* Recompute the per-BSS digests, e.g. after the configuration changed */
+void Checkpoint_reconfig(rtapd *rtapd)
+{
+    struct checkpoint *ckpt = rtapd->ckpt;
+    int i;
+
+    if (ckpt == NULL)
+        return;
+
+    memset(ckpt->hdr->bss_digest, 0, sizeof(ckpt->hdr->bss_digest));
+    for (i = 0; i < rtapd->conf->SsidNum && i < MAX_MBSSID_NUM; i++)
+        Checkpoint_bss_digest(rtapd, i, ckpt->hdr->bss_digest[i]);
+}
+
+/* Map the checkpoint file, taking over the stations it holds. Called once
+ * the sockets are up and own_addr[] has been read from the driver. */
+int Checkpoint_open(rtapd *rtapd)
+{
+    struct checkpoint *ckpt;
+    struct checkpoint_header *old = NULL;
+    char path[IFNAMSIZ + 32];
+    struct stat st;
+    size_t old_size = 0;
+    u32 i;
+    int fd;
+
+    snprintf(path, sizeof(path), CHECKPOINT_PATH, rtapd->prefix_wlan_name);
+    fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+    if (fd < 0)
+    {
+        perror("open[checkpoint]");
+        return -1;
+    }
+
+    /* /tmp is shared: only use a plain file of our own that nobody else can
+     * read or has linked elsewhere, it gets truncated and holds keys */
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+        st.st_nlink != 1 || (st.st_mode & (S_IRWXG | S_IRWXO)))
+    {
+        DBGPRINT(RT_DEBUG_ERROR, "Checkpoint: refusing to use %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    /* the file is rewritten for this run, keep what the last one left */
+    if (st.st_size >= (off_t) CHECKPOINT_REC_OFFSET)
+    {
+        old = (struct checkpoint_header *) malloc(st.st_size);
+        if (old && read(fd, old, st.st_size) == st.st_size)
+            old_size = st.st_size;
+    }
+
+    ckpt = (struct checkpoint *) malloc(sizeof(*ckpt));
+    if (ckpt == NULL)
+        goto fail;
+    memset(ckpt, 0, sizeof(*ckpt));
+    ckpt->size = CHECKPOINT_REC_OFFSET + rtapd->max_sta * sizeof(struct checkpoint_sta);
+    ckpt->free_slots = (u32 *) malloc(rtapd->max_sta * sizeof(u32));
+    if (ckpt->free_slots == NULL)
+        goto fail;
+
+    if (ftruncate(fd, 0) || ftruncate(fd, ckpt->size))
+    {
+        perror("ftruncate[checkpoint]");
+        goto fail;
+    }
+    ckpt->hdr = mmap(NULL, ckpt->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ckpt->hdr == MAP_FAILED)
+    {
+        perror("mmap[checkpoint]");
+        goto fail;
+    }
+    close(fd);
+    fd = -1;
+
+    ckpt->recs = (struct checkpoint_sta *) ((u8 *) ckpt->hdr + CHECKPOINT_REC_OFFSET);
+    for (i = rtapd->max_sta; i > 0; i--)
+        ckpt->free_slots[ckpt->num_free++] = i - 1;
+
+    ckpt->hdr->magic = CHECKPOINT_MAGIC;
+    ckpt->hdr->version = CHECKPOINT_VERSION;
+    ckpt->hdr->rec_size = sizeof(struct checkpoint_sta);
+    ckpt->hdr->slots = rtapd->max_sta;
+    Checkpoint_boot_id(ckpt->hdr->boot_id, sizeof(ckpt->hdr->boot_id));
+    rtapd->ckpt = ckpt;
+    Checkpoint_reconfig(rtapd);
+
+    if (old_size)
+        Checkpoint_restore(rtapd, old, old_size);
+    free(old);
+    return 0;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    if (ckpt)
+        free(ckpt->free_slots);
+    free(ckpt);
+    free(old);
+    return -1;
+}
+
+/* Bring the records up to date and unmap the file; it is left in place for
+ * the next run, so the stations freed on exit stay in it */
+void Checkpoint_close(rtapd *rtapd)
+{
+    struct checkpoint *ckpt = rtapd->ckpt;
+    struct sta_info *sta;
+
+    if (ckpt == NULL)
+        return;
+
+    for (sta = rtapd->sta_list; sta; sta = sta->next)
+    {
+        if (sta->ckpt_slot)
+            Checkpoint_sta_save(rtapd, sta);
+    }
+
+    msync(ckpt->hdr, ckpt->size, MS_SYNC);
+    munmap(ckpt->hdr, ckpt->size);
+    free(ckpt->free_slots);
+    free(ckpt);
+    rtapd->ckpt = NULL;
+}
+
+#endif /* STA_CHECKPOINT */
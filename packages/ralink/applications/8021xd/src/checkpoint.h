@@ -0,0 +1,30 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+/* Authorized stations are kept in a file mapped from /tmp, so that a
+ * restarted daemon can take them over without sending every supplicant
+ * through EAP and RADIUS again. The file is left in place when the daemon
+ * exits; it is read back by Checkpoint_open() and then rewritten. */
+#define CHECKPOINT_PATH             "/tmp/%s8021xd.ckpt"    /* prefix_wlan_name */
+
+#define CHECKPOINT_IDENTITY_MAX     128
+#define CHECKPOINT_KEY_MAX          32
+#define CHECKPOINT_ATTR_MAX         64      /* RADIUS State and Class */
+
+struct sta_info;
+
+#if STA_CHECKPOINT
+int Checkpoint_open(rtapd *rtapd);
+void Checkpoint_close(rtapd *rtapd);
+void Checkpoint_reconfig(rtapd *rtapd);
+void Checkpoint_sta_save(rtapd *rtapd, struct sta_info *sta);
+void Checkpoint_sta_drop(rtapd *rtapd, struct sta_info *sta);
+#else
+#define Checkpoint_open(rtapd) 0
+#define Checkpoint_close(rtapd) do { } while (0)
+#define Checkpoint_reconfig(rtapd) do { } while (0)
+#define Checkpoint_sta_save(rtapd, sta) do { } while (0)
+#define Checkpoint_sta_drop(rtapd, sta) do { } while (0)
+#endif
+
+#endif /* CHECKPOINT_H */
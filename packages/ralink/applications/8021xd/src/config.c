@@ -498,6 +498,58 @@ static void Config_free_radius(struct hostapd_radius_server *servers, int num_se
     free(servers);
 }
 
+static int Config_radius_changed(struct hostapd_radius_server *a, int num_a,
+                                 struct hostapd_radius_server *b, int num_b)
+{
+    int i;
+
+    if (num_a != num_b || (a == NULL) != (b == NULL))
+        return 1;
+
+    for (i = 0; i < num_a; i++)
+    {
+        if (a[i].addr.s_addr != b[i].addr.s_addr || a[i].port != b[i].port ||
+            a[i].shared_secret_len != b[i].shared_secret_len ||
+            memcmp(a[i].shared_secret, b[i].shared_secret, a[i].shared_secret_len) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Whether the settings that stations and RADIUS requests of BSS apidx
+ * depend on differ between two configurations */
+int Config_bss_changed(struct rtapd_config *oconf, struct rtapd_config *nconf, int apidx)
+{
+    if ((apidx < oconf->SsidNum) != (apidx < nconf->SsidNum))
+        return 1;
+    if (apidx >= nconf->SsidNum)
+        return 0;
+
+    /* shared by all BSSs */
+    if (oconf->own_ip_addr.s_addr != nconf->own_ip_addr.s_addr ||
+        oconf->session_timeout_set != nconf->session_timeout_set ||
+        oconf->session_timeout_interval != nconf->session_timeout_interval ||
+        oconf->quiet_interval != nconf->quiet_interval)
+        return 1;
+#if !MULTIPLE_RADIUS
+    if (Config_radius_changed(oconf->auth_servers, oconf->num_auth_servers,
+                              nconf->auth_servers, nconf->num_auth_servers))
+        return 1;
+#else
+    if (Config_radius_changed(oconf->mbss_auth_servers[apidx], oconf->mbss_num_auth_servers[apidx],
+                              nconf->mbss_auth_servers[apidx], nconf->mbss_num_auth_servers[apidx]))
+        return 1;
+#endif
+
+    return oconf->DefaultKeyID[apidx] != nconf->DefaultKeyID[apidx] ||
+           oconf->individual_wep_key_len[apidx] != nconf->individual_wep_key_len[apidx] ||
+           oconf->individual_wep_key_idx[apidx] != nconf->individual_wep_key_idx[apidx] ||
+           memcmp(oconf->IEEE8021X_ikey[apidx], nconf->IEEE8021X_ikey[apidx], WEP8021X_KEY_LEN) != 0 ||
+           oconf->nasId_len[apidx] != nconf->nasId_len[apidx] ||
+           memcmp(oconf->nasId[apidx], nconf->nasId[apidx], nconf->nasId_len[apidx]) != 0;
+}
+
 void Config_free(struct rtapd_config *conf)
 {
 #if MULTIPLE_RADIUS
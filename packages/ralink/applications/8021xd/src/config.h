@@ -69,6 +69,7 @@ struct rtapd_config
 
 struct rtapd_config * Config_read(int ioctl_sock, char *prefix_name);
 void Config_free(struct rtapd_config *conf);
+int Config_bss_changed(struct rtapd_config *oconf, struct rtapd_config *nconf, int apidx);
 
 
 #endif /* CONFIG_H */
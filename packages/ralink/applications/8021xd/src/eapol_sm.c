@@ -1,5 +1,6 @@
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <netinet/in.h>
@@ -10,6 +11,7 @@
 #include "ieee802_1x.h"
 #include "eapol_sm.h"
 #include "eloop.h"
+#include "sta_info.h"
 
 /* TODO:
  * implement state machines: Controlled Directions and Key Receive
@@ -18,62 +20,309 @@
 
 /* EAPOL state machines are described in IEEE Std 802.1X-2001, Chap. 8.5 */
 
+/* the state machine is embedded in the station it belongs to */
+#define sm_sta(sm) \
+((struct sta_info *) ((char *) (sm) - offsetof(struct sta_info, eapol_sm)))
+
 #define setPortAuthorized() \
-ieee802_1x_set_sta_authorized(sm->rtapd, sm->sta, 1)
+ieee802_1x_set_sta_authorized(rtapd, sm_sta(sm), 1)
 #define setPortUnauthorized() \
-ieee802_1x_set_sta_authorized(sm->rtapd, sm->sta, 0)
+ieee802_1x_set_sta_authorized(rtapd, sm_sta(sm), 0)
 
 /* procedures */
-#define txCannedFail(x) ieee802_1x_tx_canned_eap(sm->rtapd, sm->sta, (x), 0)
-#define txCannedSuccess(x) ieee802_1x_tx_canned_eap(sm->rtapd, sm->sta, (x), 1)
+#define txCannedFail(x) ieee802_1x_tx_canned_eap(rtapd, sm_sta(sm), (x), 0)
+#define txCannedSuccess(x) ieee802_1x_tx_canned_eap(rtapd, sm_sta(sm), (x), 1)
 /* TODO: IEEE 802.1aa/D4 replaces txReqId(x) with txInitialMsg(x); value of
  * initialEAPMsg should be used to select which type of EAP packet is sent;
  * Currently, hostapd only supports EAP Request/Identity, so this can be
  * hardcoded. */
-#define txInitialMsg(x) ieee802_1x_request_identity(sm->rtapd, sm->sta, (x))
-#define txReq(x) ieee802_1x_tx_req(sm->rtapd, sm->sta, (x))
-#define sendRespToServer ieee802_1x_send_resp_to_server(sm->rtapd, sm->sta)
+#define txInitialMsg(x) ieee802_1x_request_identity(rtapd, sm_sta(sm), (x))
+#define txReq(x) ieee802_1x_tx_req(rtapd, sm_sta(sm), (x))
+#define sendRespToServer ieee802_1x_send_resp_to_server(rtapd, sm_sta(sm))
 /* TODO: check if abortAuth would be needed for something */
 #define abortAuth do { } while (0)
-#define txKey(x) ieee802_1x_tx_key(sm->rtapd, sm->sta, (x))
+#define txKey(x) ieee802_1x_tx_key(rtapd, sm_sta(sm), (x))
+
+/* port timers hold absolute deadlines on the eloop clock; a timer has
+ * reached zero once its deadline has passed */
+#define startTimer(timer, secs) eapol_port_timer_start(rtapd, sm, &sm->timer, (secs))
+#define stopTimer(timer) eapol_port_timer_stop(rtapd, sm, &sm->timer)
+#define timerExpired(timer) (sm->timer <= eloop_now())
 
 /* Definitions for clarifying state machine implementation */
 #define SM_STATE(machine, state) \
-static void sm_ ## machine ## _ ## state ## _Enter(struct eapol_state_machine \
-*sm)
+static void sm_ ## machine ## _ ## state ## _Enter(struct apd_data *rtapd, \
+struct eapol_state_machine *sm)
 
+#ifdef DBG
 #define SM_ENTRY(machine, _state, _data) \
 sm->_data.state = machine ## _ ## _state; \
-if (sm->rtapd->conf->debug >= HOSTAPD_DEBUG_MINIMAL) \
+if (rtapd->conf->debug >= HOSTAPD_DEBUG_MINIMAL) \
     DBGPRINT(RT_DEBUG_ERROR,"IEEE 802.1X: " MACSTR " " #machine " entering state " #_state \
-        "\n", MAC2STR(sm->sta->addr));
+        "\n", MAC2STR(sm_sta(sm)->addr));
+#else
+#define SM_ENTRY(machine, _state, _data) \
+sm->_data.state = machine ## _ ## _state;
+#endif
+
+/* Transition guards: small predicates on the state machine variables */
+#define SM_GUARD(name) \
+static int sm_ ## name ## _Guard(struct eapol_state_machine *sm)
+
+/* Each machine lists its transitions as T(machine, from, guard, to). In a
+ * step the first transition leaving the current state (or ANY state) whose
+ * guard holds is taken, so the order of the list is the priority; the ANY
+ * transitions come first in every list.
+ *
+ * SM_STEP() expands the list into sm_<machine>_Step(): the ANY transitions,
+ * then a switch on the state with one case per entry of <machine>_STATES.
+ * Each case expands the whole list again, but the from state is a constant
+ * there, so only that state's transitions are left and the guards are
+ * called directly and inline. */
+#define SM_ANY  (-1)
+#define AUTH_PAE_ANY        SM_ANY
+#define BE_AUTH_ANY         SM_ANY
+#define REAUTH_TIMER_ANY    SM_ANY
+#define AUTH_KEY_TX_ANY     SM_ANY
+
+#define SM_TRY(machine, from, guard, to) \
+    if (machine ## _ ## from == sm_from && sm_ ## guard ## _Guard(sm)) \
+    { \
+        sm_ ## machine ## _ ## to ## _Enter(rtapd, sm); \
+        return; \
+    }
+
+#define SM_CASE(machine, state) \
+    case machine ## _ ## state: \
+    { \
+        const int sm_from = machine ## _ ## state; \
+        machine ## _TRANSITIONS(SM_TRY) \
+        break; \
+    }
+
+#if EAPOL_SM_BENCH
+/* bench.c also runs the transitions through function pointer tables, which
+ * is how SM_STEP() used to expand them */
+struct sm_transition
+{
+    int from;
+    int (*guard)(struct eapol_state_machine *sm);
+    void (*enter)(struct apd_data *rtapd, struct eapol_state_machine *sm);
+};
+
+#define SM_TRANSITION(machine, from, guard, to) \
+    { machine ## _ ## from, sm_ ## guard ## _Guard, sm_ ## machine ## _ ## to ## _Enter },
+
+static void sm_step_table(struct apd_data *rtapd, struct eapol_state_machine *sm,
+                          int state, const struct sm_transition *table, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if ((table[i].from == SM_ANY || table[i].from == state) && table[i].guard(sm))
+        {
+            table[i].enter(rtapd, sm);
+            return;
+        }
+    }
+}
+
+#define SM_TABLE(machine, _data) \
+static const struct sm_transition sm_ ## machine ## _Table[] = \
+{ machine ## _TRANSITIONS(SM_TRANSITION) }; \
+static void sm_ ## machine ## _StepTable(struct apd_data *rtapd, struct eapol_state_machine *sm) \
+{ \
+    sm_step_table(rtapd, sm, sm->_data.state, sm_ ## machine ## _Table, \
+                  sizeof(sm_ ## machine ## _Table) / sizeof(sm_ ## machine ## _Table[0])); \
+}
+
+#define SM_STEP(machine, _data) \
+    SM_STEP_SWITCH(machine, _data) \
+    SM_TABLE(machine, _data)
+#else
+#define SM_STEP(machine, _data) SM_STEP_SWITCH(machine, _data)
+#endif
+
+#define SM_STEP_SWITCH(machine, _data) \
+static void sm_ ## machine ## _Step(struct apd_data *rtapd, struct eapol_state_machine *sm) \
+{ \
+    { \
+        const int sm_from = SM_ANY; \
+        machine ## _TRANSITIONS(SM_TRY) \
+    } \
+    switch (sm->_data.state) \
+    { \
+        machine ## _STATES(SM_CASE) \
+    } \
+}
+
+SM_GUARD(always)
+{
+    return 1;
+}
+
+/* Port Timers state machine - implemented as a single registered event loop
+ * timeout at the earliest running deadline, so that a station whose timers
+ * are all expired or far away costs no wakeups. Deadlines of all stations
+ * are aligned to whole seconds so that they expire together in one wakeup. */
+#define EAPOL_PORT_TIMER_SLACK_MS   1000
+
+static void eapol_port_timers_expire(void *eloop_ctx, void *timeout_ctx);
+
+static void eapol_port_timers_arm(struct apd_data *rtapd, struct eapol_state_machine *sm)
+{
+    eloop_time_t now = eloop_now(), next = 0, wait;
+    eloop_time_t *timers[4];
+    int i;
+
+    timers[0] = &sm->aWhile;
+    timers[1] = &sm->quietWhile;
+    timers[2] = &sm->reAuthWhen;
+    timers[3] = &sm->txWhen;
+
+    for (i = 0; i < 4; i++)
+    {
+        if (*timers[i] > now && (next == 0 || *timers[i] < next))
+            next = *timers[i];
+    }
+
+    if (next == 0)
+    {
+        eloop_cancel_timeout_ref(&sm->port_timeout);
+        return;
+    }
+
+    wait = next - now;
+    eloop_register_timeout_ref(wait / ELOOP_NSEC_PER_SEC, wait % ELOOP_NSEC_PER_SEC / ELOOP_NSEC_PER_USEC,
+                               EAPOL_PORT_TIMER_SLACK_MS, eapol_port_timers_expire, rtapd, sm,
+                               &sm->port_timeout);
+}
+
+static void eapol_port_timer_start(struct apd_data *rtapd, struct eapol_state_machine *sm,
+                                   eloop_time_t *timer, int secs)
+{
+    *timer = eloop_now() + (eloop_time_t) secs * ELOOP_NSEC_PER_SEC;
+    eapol_port_timers_arm(rtapd, sm);
+}
+
+static void eapol_port_timer_stop(struct apd_data *rtapd, struct eapol_state_machine *sm,
+                                  eloop_time_t *timer)
+{
+    if (*timer == 0)
+        return;
+    *timer = 0;
+    eapol_port_timers_arm(rtapd, sm);
+}
+
+static void eapol_port_timers_expire(void *eloop_ctx, void *timeout_ctx)
+{
+    struct eapol_state_machine *sm = timeout_ctx;
+
+    eapol_port_timers_arm(eloop_ctx, sm);
+    eapol_sm_schedule_step(sm);
+}
+
+static void eapol_sm_step_work(void *eloop_ctx, void *user_data)
+{
+    eapol_sm_step(eloop_ctx, user_data);
+}
+
+/* Reauthentication is spread out so that stations which authenticated
+ * together (e.g. after a reload) do not all return to the RADIUS server at
+ * once: every period is shortened by a random jitter of up to 1/JITTER of
+ * it, and reauthentications are admitted at no more than RATE per second
+ * after an initial BURST. A station over the rate gets a reserved later
+ * slot and is retried when that slot comes; a slot given up before then is
+ * handed back. */
+#define EAPOL_REAUTH_JITTER     10
+#define EAPOL_REAUTH_RATE       10
+#define EAPOL_REAUTH_BURST      20
+
+static eloop_time_t eapol_reauth_next;
+static unsigned long eapol_reauth_deferred;
+
+static int eapol_reauth_period(struct eapol_state_machine *sm)
+{
+    int period = sm->reauth_timer.reAuthPeriod;
+
+    if (period >= EAPOL_REAUTH_JITTER)
+        period -= random() % (period / EAPOL_REAUTH_JITTER + 1);
+
+    return period;
+}
+
+/* returns 0 if the reauthentication may start now, else the delay in s */
+static int eapol_reauth_admit(struct eapol_state_machine *sm)
+{
+    eloop_time_t now = eloop_now(), interval, slot;
+
+    if (sm->reauthSlot)
+    {
+        sm->reauthSlot = 0;
+        return 0;
+    }
+
+    interval = ELOOP_NSEC_PER_SEC / EAPOL_REAUTH_RATE;
+    if (eapol_reauth_next + EAPOL_REAUTH_BURST * interval < now)
+        eapol_reauth_next = now - EAPOL_REAUTH_BURST * interval;
 
-#define SM_ENTER(machine, state) sm_ ## machine ## _ ## state ## _Enter(sm)
+    slot = eapol_reauth_next;
+    eapol_reauth_next += interval;
+    if (slot <= now)
+        return 0;
+
+    sm->reauthSlot = 1;
+    eapol_reauth_deferred++;
+    return (slot - now + ELOOP_NSEC_PER_SEC - 1) / ELOOP_NSEC_PER_SEC;
+}
 
-#define SM_STEP(machine) \
-static void sm_ ## machine ## _Step(struct eapol_state_machine *sm)
+/* A reserved slot still lies ahead, so the schedule can always be pulled in
+ * by one interval. Stations holding later slots keep their times; at worst
+ * two of them now share an interval, while the number of outstanding
+ * reservations stays equal to the number of deferred stations. */
+static void eapol_reauth_release(struct eapol_state_machine *sm)
+{
+    if (!sm->reauthSlot)
+        return;
 
-#define SM_STEP_RUN(machine) sm_ ## machine ## _Step(sm)
+    sm->reauthSlot = 0;
+    eapol_reauth_next -= ELOOP_NSEC_PER_SEC / EAPOL_REAUTH_RATE;
+}
 
-/* Port Timers state machine - implemented as a function that will be called
- * once a second as a registered event loop timeout */
+unsigned long eapol_sm_reauth_deferred(void)
+{
+    return eapol_reauth_deferred;
+}
 
-static void eapol_port_timers_tick(void *eloop_ctx, void *timeout_ctx)
+/* Only txPeriod follows the retransmission timeout. suppTimeout keeps its
+ * default: with maxReq 2 it is all the time a supplicant gets to answer
+ * before the backend gives up on it. */
+static void eapol_sm_set_rto(struct eapol_state_machine *sm, unsigned int rto)
 {
-    struct eapol_state_machine *state = timeout_ctx;
+    if (rto < sm->rtoMin)
+        rto = sm->rtoMin;
+    if (rto > sm->rtoMax)
+        rto = sm->rtoMax;
 
-    if (state->aWhile > 0)
-        state->aWhile--;
-    if (state->quietWhile > 0)
-        state->quietWhile--;
-    if (state->reAuthWhen > 0)
-        state->reAuthWhen--;
-    if (state->txWhen > 0)
-        state->txWhen--;
+    sm->rto = rto;
+    sm->auth_pae.txPeriod = rto;
+}
 
-    eapol_sm_step(state);
+/* Called before an EAP-Request is (re)sent. The response to a retransmitted
+ * request cannot be matched to one transmission, so it is not sampled, and
+ * the timeout is backed off if the previous one expired (Karn). */
+static void eapol_sm_req_tx(struct eapol_state_machine *sm, int retransmit, int expired)
+{
+    if (!retransmit)
+    {
+        sm->reqSent = eloop_now();
+        return;
+    }
 
-    eloop_register_timeout(1, 0, eapol_port_timers_tick, eloop_ctx, state);
+    sm->reqSent = 0;
+    if (expired)
+        eapol_sm_set_rto(sm, sm->rto * 2);
 }
 
 
@@ -94,7 +343,7 @@ SM_STATE(AUTH_PAE, DISCONNECTED)
 
     if (sm->auth_pae.state == AUTH_PAE_CONNECTING &&
         sm->auth_pae.eapLogoff)
-        sm->auth_pae.authEapLogoffsWhileConnecting++;
+        EAPOL_SM_COUNT(sm, authEapLogoffsWhileConnecting);
 
     SM_ENTRY(AUTH_PAE, DISCONNECTED, auth_pae);
 
@@ -119,23 +368,26 @@ SM_STATE(AUTH_PAE, DISCONNECTED)
 SM_STATE(AUTH_PAE, CONNECTING)
 {
     if (sm->auth_pae.state != AUTH_PAE_CONNECTING)
-        sm->auth_pae.authEntersConnecting++;
+        EAPOL_SM_COUNT(sm, authEntersConnecting);
 
     if (sm->auth_pae.state == AUTH_PAE_AUTHENTICATED)
     {
         if (sm->reAuthenticate)
-            sm->auth_pae.authAuthReauthsWhileAuthenticated++;
+            EAPOL_SM_COUNT(sm, authAuthReauthsWhileAuthenticated);
         if (sm->auth_pae.eapStart)
-            sm->auth_pae.authAuthEapStartsWhileAuthenticated++;
+            EAPOL_SM_COUNT(sm, authAuthEapStartsWhileAuthenticated);
         if (sm->auth_pae.eapLogoff)
-            sm->auth_pae.authAuthEapLogoffWhileAuthenticated++;
+            EAPOL_SM_COUNT(sm, authAuthEapLogoffWhileAuthenticated);
     }
 
+    eapol_sm_req_tx(sm, sm->auth_pae.state == AUTH_PAE_CONNECTING,
+                    timerExpired(txWhen));
+
     SM_ENTRY(AUTH_PAE, CONNECTING, auth_pae);
 
     sm->auth_pae.eapStart = FALSE;
     sm->reAuthenticate = FALSE;
-    sm->txWhen = sm->auth_pae.txPeriod;
+    startTimer(txWhen, sm->auth_pae.txPeriod);
     sm->auth_pae.rxInitialRsp = FALSE;
     txInitialMsg(sm->currentId);
     sm->auth_pae.reAuthCount++;
@@ -145,13 +397,13 @@ SM_STATE(AUTH_PAE, CONNECTING)
 SM_STATE(AUTH_PAE, HELD)
 {
     if (sm->auth_pae.state == AUTH_PAE_AUTHENTICATING && sm->authFail)
-        sm->auth_pae.authAuthFailWhileAuthenticating++;
+        EAPOL_SM_COUNT(sm, authAuthFailWhileAuthenticating);
 
     SM_ENTRY(AUTH_PAE, HELD, auth_pae);
 
     sm->portStatus = Unauthorized;
     setPortUnauthorized();
-    sm->quietWhile = sm->auth_pae.quietPeriod;
+    startTimer(quietWhile, sm->auth_pae.quietPeriod);
     sm->auth_pae.eapLogoff = FALSE;
     sm->currentId++;
 
@@ -161,7 +413,7 @@ SM_STATE(AUTH_PAE, HELD)
 SM_STATE(AUTH_PAE, AUTHENTICATED)
 {
     if (sm->auth_pae.state == AUTH_PAE_AUTHENTICATING && sm->authSuccess)
-        sm->auth_pae.authAuthSuccessesWhileAuthenticating++;
+        EAPOL_SM_COUNT(sm, authAuthSuccessesWhileAuthenticating);
 
     SM_ENTRY(AUTH_PAE, AUTHENTICATED, auth_pae);
 
@@ -176,7 +428,7 @@ SM_STATE(AUTH_PAE, AUTHENTICATING)
 {
     if (sm->auth_pae.state == AUTH_PAE_CONNECTING &&
         sm->auth_pae.rxInitialRsp)
-        sm->auth_pae.authEntersAuthenticating++;
+        EAPOL_SM_COUNT(sm, authEntersAuthenticating);
 
     SM_ENTRY(AUTH_PAE, AUTHENTICATING, auth_pae);
 
@@ -192,13 +444,13 @@ SM_STATE(AUTH_PAE, ABORTING)
     if (sm->auth_pae.state == AUTH_PAE_AUTHENTICATING)
     {
         if (sm->authTimeout)
-            sm->auth_pae.authAuthTimeoutsWhileAuthenticating++;
+            EAPOL_SM_COUNT(sm, authAuthTimeoutsWhileAuthenticating);
         if (sm->reAuthenticate)
-            sm->auth_pae.authAuthReauthsWhileAuthenticating++;
+            EAPOL_SM_COUNT(sm, authAuthReauthsWhileAuthenticating);
         if (sm->auth_pae.eapStart)
-            sm->auth_pae.authAuthEapStartsWhileAuthenticating++;
+            EAPOL_SM_COUNT(sm, authAuthEapStartsWhileAuthenticating);
         if (sm->auth_pae.eapLogoff)
-            sm->auth_pae.authAuthEapLogoffWhileAuthenticating++;
+            EAPOL_SM_COUNT(sm, authAuthEapLogoffWhileAuthenticating);
     }
 
     SM_ENTRY(AUTH_PAE, ABORTING, auth_pae);
@@ -234,82 +486,113 @@ SM_STATE(AUTH_PAE, FORCE_UNAUTH)
 }
 
 
-SM_STEP(AUTH_PAE)
+SM_GUARD(pae_initialize)
 {
-    if ((sm->portControl == Auto &&
-         sm->auth_pae.portMode != sm->portControl) ||
-        sm->initialize || !sm->portEnabled)
-        SM_ENTER(AUTH_PAE, INITIALIZE);
-    else if (sm->portControl == ForceAuthorized &&
-             sm->auth_pae.portMode != sm->portControl &&
-             !(sm->initialize || !sm->portEnabled))
-        SM_ENTER(AUTH_PAE, FORCE_AUTH);
-    else if (sm->portControl == ForceUnauthorized &&
-             sm->auth_pae.portMode != sm->portControl &&
-             !(sm->initialize || !sm->portEnabled))
-        SM_ENTER(AUTH_PAE, FORCE_UNAUTH);
-    else
-    {
-        switch (sm->auth_pae.state)
-        {
-            case AUTH_PAE_INITIALIZE:
-                SM_ENTER(AUTH_PAE, DISCONNECTED);
-                break;
-            case AUTH_PAE_DISCONNECTED:
-                SM_ENTER(AUTH_PAE, CONNECTING);
-                break;
-            case AUTH_PAE_HELD:
-                if (sm->quietWhile == 0)
-                    SM_ENTER(AUTH_PAE, CONNECTING);
-                break;
-            case AUTH_PAE_CONNECTING:
-                if (sm->auth_pae.eapLogoff ||
-                    sm->auth_pae.reAuthCount > sm->auth_pae.reAuthMax)
-                    SM_ENTER(AUTH_PAE, DISCONNECTED);
-                else if (sm->auth_pae.rxInitialRsp &&
-                         sm->auth_pae.reAuthCount <=
-                         sm->auth_pae.reAuthMax)
-                    SM_ENTER(AUTH_PAE, AUTHENTICATING);
-                else if ((sm->txWhen == 0 || sm->auth_pae.eapStart ||
-                          sm->reAuthenticate) &&
-                         sm->auth_pae.reAuthCount <=
-                         sm->auth_pae.reAuthMax)
-                    SM_ENTER(AUTH_PAE, CONNECTING);
-                break;
-            case AUTH_PAE_AUTHENTICATED:
-                if (sm->auth_pae.eapStart || sm->reAuthenticate)
-                    SM_ENTER(AUTH_PAE, CONNECTING);
-                else if (sm->auth_pae.eapLogoff || !sm->portValid)
-                    SM_ENTER(AUTH_PAE, DISCONNECTED);
-                break;
-            case AUTH_PAE_AUTHENTICATING:
-                if (sm->authSuccess && sm->portValid)
-                    SM_ENTER(AUTH_PAE, AUTHENTICATED);
-                else if (sm->authFail)
-                    SM_ENTER(AUTH_PAE, HELD);
-                else if (sm->reAuthenticate || sm->auth_pae.eapStart ||
-                         sm->auth_pae.eapLogoff ||
-                         sm->authTimeout)
-                    SM_ENTER(AUTH_PAE, ABORTING);
-                break;
-            case AUTH_PAE_ABORTING:
-                if (sm->auth_pae.eapLogoff && !sm->authAbort)
-                    SM_ENTER(AUTH_PAE, DISCONNECTED);
-                else if (!sm->auth_pae.eapLogoff && !sm->authAbort)
-                    SM_ENTER(AUTH_PAE, CONNECTING);
-                break;
-            case AUTH_PAE_FORCE_AUTH:
-                if (sm->auth_pae.eapStart)
-                    SM_ENTER(AUTH_PAE, FORCE_AUTH);
-                break;
-            case AUTH_PAE_FORCE_UNAUTH:
-                if (sm->auth_pae.eapStart)
-                    SM_ENTER(AUTH_PAE, FORCE_UNAUTH);
-                break;
-        }
-    }
+    return (sm->portControl == Auto &&
+            sm->auth_pae.portMode != sm->portControl) ||
+           sm->initialize || !sm->portEnabled;
+}
+
+/* the force guards are only tried when pae_initialize does not hold */
+SM_GUARD(pae_force_auth)
+{
+    return sm->portControl == ForceAuthorized &&
+           sm->auth_pae.portMode != sm->portControl;
+}
+
+SM_GUARD(pae_force_unauth)
+{
+    return sm->portControl == ForceUnauthorized &&
+           sm->auth_pae.portMode != sm->portControl;
+}
+
+SM_GUARD(pae_quiet_expired)
+{
+    return timerExpired(quietWhile);
+}
+
+SM_GUARD(pae_give_up)
+{
+    return sm->auth_pae.eapLogoff ||
+           sm->auth_pae.reAuthCount > sm->auth_pae.reAuthMax;
+}
+
+SM_GUARD(pae_initial_rsp)
+{
+    return sm->auth_pae.rxInitialRsp &&
+           sm->auth_pae.reAuthCount <= sm->auth_pae.reAuthMax;
+}
+
+SM_GUARD(pae_retry)
+{
+    return (timerExpired(txWhen) || sm->auth_pae.eapStart ||
+            sm->reAuthenticate) &&
+           sm->auth_pae.reAuthCount <= sm->auth_pae.reAuthMax;
+}
+
+SM_GUARD(pae_restart)
+{
+    return sm->auth_pae.eapStart || sm->reAuthenticate;
+}
+
+SM_GUARD(pae_logoff)
+{
+    return sm->auth_pae.eapLogoff || !sm->portValid;
+}
+
+SM_GUARD(pae_success)
+{
+    return sm->authSuccess && sm->portValid;
+}
+
+SM_GUARD(pae_fail)
+{
+    return sm->authFail;
+}
+
+SM_GUARD(pae_abort)
+{
+    return sm->reAuthenticate || sm->auth_pae.eapStart ||
+           sm->auth_pae.eapLogoff || sm->authTimeout;
+}
+
+SM_GUARD(pae_aborted_logoff)
+{
+    return sm->auth_pae.eapLogoff && !sm->authAbort;
+}
+
+SM_GUARD(pae_aborted)
+{
+    return !sm->auth_pae.eapLogoff && !sm->authAbort;
+}
+
+SM_GUARD(pae_eap_start)
+{
+    return sm->auth_pae.eapStart;
 }
 
+#define AUTH_PAE_TRANSITIONS(T) \
+    T(AUTH_PAE, ANY, pae_initialize, INITIALIZE) \
+    T(AUTH_PAE, ANY, pae_force_auth, FORCE_AUTH) \
+    T(AUTH_PAE, ANY, pae_force_unauth, FORCE_UNAUTH) \
+    T(AUTH_PAE, INITIALIZE, always, DISCONNECTED) \
+    T(AUTH_PAE, DISCONNECTED, always, CONNECTING) \
+    T(AUTH_PAE, HELD, pae_quiet_expired, CONNECTING) \
+    T(AUTH_PAE, CONNECTING, pae_give_up, DISCONNECTED) \
+    T(AUTH_PAE, CONNECTING, pae_initial_rsp, AUTHENTICATING) \
+    T(AUTH_PAE, CONNECTING, pae_retry, CONNECTING) \
+    T(AUTH_PAE, AUTHENTICATED, pae_restart, CONNECTING) \
+    T(AUTH_PAE, AUTHENTICATED, pae_logoff, DISCONNECTED) \
+    T(AUTH_PAE, AUTHENTICATING, pae_success, AUTHENTICATED) \
+    T(AUTH_PAE, AUTHENTICATING, pae_fail, HELD) \
+    T(AUTH_PAE, AUTHENTICATING, pae_abort, ABORTING) \
+    T(AUTH_PAE, ABORTING, pae_aborted_logoff, DISCONNECTED) \
+    T(AUTH_PAE, ABORTING, pae_aborted, CONNECTING) \
+    T(AUTH_PAE, FORCE_AUTH, pae_eap_start, FORCE_AUTH) \
+    T(AUTH_PAE, FORCE_UNAUTH, pae_eap_start, FORCE_UNAUTH)
+
+SM_STEP(AUTH_PAE, auth_pae)
+
 
 
 /* Backend Authentication state machine */
@@ -325,12 +608,18 @@ SM_STATE(BE_AUTH, INITIALIZE)
 
 SM_STATE(BE_AUTH, REQUEST)
 {
+    if (sm->be_auth.state == BE_AUTH_RESPONSE)
+        EAPOL_SM_COUNT(sm, backendAccessChallenges);
+
+    eapol_sm_req_tx(sm, sm->be_auth.state == BE_AUTH_REQUEST,
+                    timerExpired(aWhile));
+
     SM_ENTRY(BE_AUTH, REQUEST, be_auth);
 
     sm->currentId = sm->be_auth.idFromServer;
     txReq(sm->currentId);
-    sm->be_auth.backendOtherRequestsToSupplicant++;
-    sm->aWhile = sm->be_auth.suppTimeout;
+    EAPOL_SM_COUNT(sm, backendOtherRequestsToSupplicant);
+    startTimer(aWhile, sm->be_auth.suppTimeout);
     sm->be_auth.reqCount++;
 }
 
@@ -343,15 +632,17 @@ SM_STATE(BE_AUTH, RESPONSE)
     sm->authTimeout = FALSE;
     sm->be_auth.rxResp = sm->be_auth.aFail = FALSE;
 
-    sm->aWhile = sm->be_auth.serverTimeout;
+    startTimer(aWhile, sm->be_auth.serverTimeout);
     sm->be_auth.reqCount = 0;
     sendRespToServer;
-    sm->be_auth.backendResponses++;
+    EAPOL_SM_COUNT(sm, backendResponses);
 }
 
 
 SM_STATE(BE_AUTH, SUCCESS)
 {
+    EAPOL_SM_COUNT(sm, backendAuthSuccesses);
+
     SM_ENTRY(BE_AUTH, SUCCESS, be_auth);
 
     sm->currentId = sm->be_auth.idFromServer;
@@ -362,6 +653,8 @@ SM_STATE(BE_AUTH, SUCCESS)
 
 SM_STATE(BE_AUTH, FAIL)
 {
+    EAPOL_SM_COUNT(sm, backendAuthFails);
+
     SM_ENTRY(BE_AUTH, FAIL, be_auth);
 
     sm->currentId = sm->be_auth.idFromServer;
@@ -389,105 +682,136 @@ SM_STATE(BE_AUTH, IDLE)
 }
 
 
-SM_STEP(BE_AUTH)
+SM_GUARD(be_initialize)
 {
-    if (sm->portControl != Auto || sm->initialize || sm->authAbort)
-    {
-        SM_ENTER(BE_AUTH, INITIALIZE);
-        return;
-    }
+    return sm->portControl != Auto || sm->initialize || sm->authAbort;
+}
 
-    switch (sm->be_auth.state)
-    {
-        case BE_AUTH_INITIALIZE:
-            SM_ENTER(BE_AUTH, IDLE);
-            break;
-        case BE_AUTH_REQUEST:
-            if (sm->aWhile == 0 &&
-                sm->be_auth.reqCount != sm->be_auth.maxReq)
-                SM_ENTER(BE_AUTH, REQUEST);
-            else if (sm->be_auth.rxResp)
-                SM_ENTER(BE_AUTH, RESPONSE);
-            else if (sm->aWhile == 0 &&
-                     sm->be_auth.reqCount >= sm->be_auth.maxReq)
-                SM_ENTER(BE_AUTH, TIMEOUT);
-            break;
-        case BE_AUTH_RESPONSE:
-            if (sm->be_auth.aReq)
-            {
-                sm->be_auth.backendAccessChallenges++;
-                SM_ENTER(BE_AUTH, REQUEST);
-            }
-            else if (sm->aWhile == 0)
-                SM_ENTER(BE_AUTH, TIMEOUT);
-            else if (sm->be_auth.aFail)
-            {
-                sm->be_auth.backendAuthFails++;
-                SM_ENTER(BE_AUTH, FAIL);
-            }
-            else if (sm->be_auth.aSuccess)
-            {
-                sm->be_auth.backendAuthSuccesses++;
-                SM_ENTER(BE_AUTH, SUCCESS);
-            }
-            break;
-        case BE_AUTH_SUCCESS:
-            SM_ENTER(BE_AUTH, IDLE);
-            break;
-        case BE_AUTH_FAIL:
-            SM_ENTER(BE_AUTH, IDLE);
-            break;
-        case BE_AUTH_TIMEOUT:
-            SM_ENTER(BE_AUTH, IDLE);
-            break;
-        case BE_AUTH_IDLE:
-            if (sm->authStart)
-                SM_ENTER(BE_AUTH, RESPONSE);
-            break;
-    }
+SM_GUARD(be_retry)
+{
+    return timerExpired(aWhile) && sm->be_auth.reqCount != sm->be_auth.maxReq;
 }
 
+SM_GUARD(be_rx_resp)
+{
+    return sm->be_auth.rxResp;
+}
+
+SM_GUARD(be_give_up)
+{
+    return timerExpired(aWhile) && sm->be_auth.reqCount >= sm->be_auth.maxReq;
+}
+
+SM_GUARD(be_a_req)
+{
+    return sm->be_auth.aReq;
+}
+
+SM_GUARD(be_timeout)
+{
+    return timerExpired(aWhile);
+}
+
+SM_GUARD(be_a_fail)
+{
+    return sm->be_auth.aFail;
+}
+
+SM_GUARD(be_a_success)
+{
+    return sm->be_auth.aSuccess;
+}
+
+SM_GUARD(be_auth_start)
+{
+    return sm->authStart;
+}
+
+#define BE_AUTH_TRANSITIONS(T) \
+    T(BE_AUTH, ANY, be_initialize, INITIALIZE) \
+    T(BE_AUTH, INITIALIZE, always, IDLE) \
+    T(BE_AUTH, REQUEST, be_retry, REQUEST) \
+    T(BE_AUTH, REQUEST, be_rx_resp, RESPONSE) \
+    T(BE_AUTH, REQUEST, be_give_up, TIMEOUT) \
+    T(BE_AUTH, RESPONSE, be_a_req, REQUEST) \
+    T(BE_AUTH, RESPONSE, be_timeout, TIMEOUT) \
+    T(BE_AUTH, RESPONSE, be_a_fail, FAIL) \
+    T(BE_AUTH, RESPONSE, be_a_success, SUCCESS) \
+    T(BE_AUTH, SUCCESS, always, IDLE) \
+    T(BE_AUTH, FAIL, always, IDLE) \
+    T(BE_AUTH, TIMEOUT, always, IDLE) \
+    T(BE_AUTH, IDLE, be_auth_start, RESPONSE)
+
+SM_STEP(BE_AUTH, be_auth)
+
 
 
 /* Reauthentication Timer state machine */
 
+/* The standard keeps re-entering INITIALIZE, restarting reAuthWhen, as long
+ * as this holds. Instead reAuthWhen is stopped (0) once and left alone
+ * until the port is authorized, and only then started. */
+static int eapol_reauth_held(struct eapol_state_machine *sm)
+{
+    return sm->portControl != Auto || sm->initialize ||
+           sm->portStatus == Unauthorized ||
+           !sm->reauth_timer.reAuthEnabled;
+}
+
 SM_STATE(REAUTH_TIMER, INITIALIZE)
 {
     SM_ENTRY(REAUTH_TIMER, INITIALIZE, reauth_timer);
 
-    sm->reAuthWhen = sm->reauth_timer.reAuthPeriod;
+    eapol_reauth_release(sm);
+    if (eapol_reauth_held(sm))
+        stopTimer(reAuthWhen);
+    else
+        startTimer(reAuthWhen, eapol_reauth_period(sm));
 }
 
 
 SM_STATE(REAUTH_TIMER, REAUTHENTICATE)
 {
+    int delay = eapol_reauth_admit(sm);
+
+    /* over the rate: stay in INITIALIZE until the reserved slot */
+    if (delay > 0)
+    {
+        DBGPRINT(RT_DEBUG_TRACE, "IEEE 802.1X: " MACSTR " reauthentication deferred by %d s\n",
+                 MAC2STR(sm_sta(sm)->addr), delay);
+        startTimer(reAuthWhen, delay);
+        return;
+    }
+
     SM_ENTRY(REAUTH_TIMER, REAUTHENTICATE, reauth_timer);
     sm->reAuthenticate = TRUE;
 }
 
 
-SM_STEP(REAUTH_TIMER)
+SM_GUARD(reauth_initialize)
 {
-    if (sm->portControl != Auto || sm->initialize ||
-        sm->portStatus == Unauthorized ||
-        !sm->reauth_timer.reAuthEnabled)
-    {
-        SM_ENTER(REAUTH_TIMER, INITIALIZE);
-        return;
-    }
+    return eapol_reauth_held(sm) &&
+           (sm->reauth_timer.state != REAUTH_TIMER_INITIALIZE || sm->reAuthWhen);
+}
 
-    switch (sm->reauth_timer.state)
-    {
-        case REAUTH_TIMER_INITIALIZE:
-            if ((sm->reAuthWhen == 0)  )
-                SM_ENTER(REAUTH_TIMER, REAUTHENTICATE);
-            break;
-        case REAUTH_TIMER_REAUTHENTICATE:
-            SM_ENTER(REAUTH_TIMER, INITIALIZE);
-            break;
-    }
+SM_GUARD(reauth_start)
+{
+    return !sm->reAuthWhen && !eapol_reauth_held(sm);
+}
+
+SM_GUARD(reauth_expired)
+{
+    return sm->reAuthWhen && timerExpired(reAuthWhen);
 }
 
+#define REAUTH_TIMER_TRANSITIONS(T) \
+    T(REAUTH_TIMER, ANY, reauth_initialize, INITIALIZE) \
+    T(REAUTH_TIMER, INITIALIZE, reauth_start, INITIALIZE) \
+    T(REAUTH_TIMER, INITIALIZE, reauth_expired, REAUTHENTICATE) \
+    T(REAUTH_TIMER, REAUTHENTICATE, always, INITIALIZE)
+
+SM_STEP(REAUTH_TIMER, reauth_timer)
+
 /* Authenticator Key Transmit state machine */
 SM_STATE(AUTH_KEY_TX, NO_KEY_TRANSMIT)
 {
@@ -504,65 +828,68 @@ SM_STATE(AUTH_KEY_TX, KEY_TRANSMIT)
     sm->keyAvailable = FALSE;
 }
 
-SM_STEP(AUTH_KEY_TX)
+SM_GUARD(key_tx_initialize)
 {
-    if (sm->initialize || sm->portControl != Auto)
-    {
-        SM_ENTER(AUTH_KEY_TX, NO_KEY_TRANSMIT);
-        return;
-    }
+    return sm->initialize || sm->portControl != Auto;
+}
 
-    switch (sm->auth_key_tx.state)
-    {
-        case AUTH_KEY_TX_NO_KEY_TRANSMIT:
-            /* NOTE! IEEE 802.1aa/D4 does has this requirement as
-             * keyTxEnabled && keyAvailable && authSuccess. However, this
-             * seems to be conflicting with BE_AUTH sm, since authSuccess
-             * is now set only if keyTxEnabled is true and there are no
-             * keys to be sent.. I think the purpose is to sent the keys
-             * first and report authSuccess only after this and adding OR
-             * be_auth.aSuccess does this. */
-            if (sm->keyTxEnabled && sm->keyAvailable &&
-                (sm->authSuccess /* || sm->be_auth.aSuccess */))
-                SM_ENTER(AUTH_KEY_TX, KEY_TRANSMIT);
-            break;
-        case AUTH_KEY_TX_KEY_TRANSMIT:
-            if (!sm->keyTxEnabled || sm->authFail ||
-                sm->auth_pae.eapLogoff)
-                SM_ENTER(AUTH_KEY_TX, NO_KEY_TRANSMIT);
-            else if (sm->keyAvailable)
-                SM_ENTER(AUTH_KEY_TX, KEY_TRANSMIT);
-            break;
-    }
+/* NOTE! IEEE 802.1aa/D4 does has this requirement as
+ * keyTxEnabled && keyAvailable && authSuccess. However, this
+ * seems to be conflicting with BE_AUTH sm, since authSuccess
+ * is now set only if keyTxEnabled is true and there are no
+ * keys to be sent.. I think the purpose is to sent the keys
+ * first and report authSuccess only after this and adding OR
+ * be_auth.aSuccess does this. */
+SM_GUARD(key_tx_start)
+{
+    return sm->keyTxEnabled && sm->keyAvailable &&
+           (sm->authSuccess /* || sm->be_auth.aSuccess */);
 }
 
-struct eapol_state_machine *
-eapol_sm_alloc(rtapd *rtapd, struct sta_info *sta)
+SM_GUARD(key_tx_stop)
 {
-    struct eapol_state_machine *sm;
-    sm = (struct eapol_state_machine *) malloc(sizeof(*sm));
-    if (sm == NULL)
-    {
-        DBGPRINT(RT_DEBUG_ERROR,"IEEE 802.1X port state allocation failed\n");
-        return NULL;
-    }
-    memset(sm, 0, sizeof(*sm));
+    return !sm->keyTxEnabled || sm->authFail || sm->auth_pae.eapLogoff;
+}
+
+SM_GUARD(key_available)
+{
+    return sm->keyAvailable;
+}
+
+#define AUTH_KEY_TX_TRANSITIONS(T) \
+    T(AUTH_KEY_TX, ANY, key_tx_initialize, NO_KEY_TRANSMIT) \
+    T(AUTH_KEY_TX, NO_KEY_TRANSMIT, key_tx_start, KEY_TRANSMIT) \
+    T(AUTH_KEY_TX, KEY_TRANSMIT, key_tx_stop, NO_KEY_TRANSMIT) \
+    T(AUTH_KEY_TX, KEY_TRANSMIT, key_available, KEY_TRANSMIT)
+
+SM_STEP(AUTH_KEY_TX, auth_key_tx)
+
+void eapol_sm_init(rtapd *rtapd, struct sta_info *sta)
+{
+    struct eapol_state_machine *sm = &sta->eapol_sm;
 
-    sm->rtapd = rtapd;
-    sm->sta = sta;
+    memset(sm, 0, sizeof(*sm));
+    sm->in_use = 1;
 
     /* Set default values for state machine constants */
     sm->auth_pae.state = AUTH_PAE_INITIALIZE;
     sm->auth_pae.quietPeriod = rtapd->conf->quiet_interval;
     sm->auth_pae.initialEAPMsg = AUTH_PAE_DEFAULT_initialEAPMsg;
     sm->auth_pae.reAuthMax = AUTH_PAE_DEFAULT_reAuthMax;
-    sm->auth_pae.txPeriod = AUTH_PAE_DEFAULT_txPeriod;
 
     sm->be_auth.state = BE_AUTH_INITIALIZE;
     sm->be_auth.suppTimeout = BE_AUTH_DEFAULT_suppTimeout;
     sm->be_auth.serverTimeout = BE_AUTH_DEFAULT_serverTimeout;
     sm->be_auth.maxReq = BE_AUTH_DEFAULT_maxReq;
 
+    sm->rtoMin = rtapd->eap_rto_min;
+    sm->rtoMax = rtapd->eap_rto_max;
+    if (sm->rtoMin < 1)
+        sm->rtoMin = 1;
+    if (sm->rtoMax < sm->rtoMin)
+        sm->rtoMax = sm->rtoMin;
+    eapol_sm_set_rto(sm, EAPOL_RTO_INITIAL);
+
     sm->reauth_timer.state = REAUTH_TIMER_INITIALIZE;
 
     sm->reauth_timer.reAuthEnabled = REAUTH_TIMER_DEFAULT_reAuthEnabled;
@@ -586,61 +913,305 @@ eapol_sm_alloc(rtapd *rtapd, struct sta_info *sta)
     sm->keyTxEnabled =TRUE ;
     sm->portValid = TRUE; /* TODO: should this be FALSE sometimes? */
 
-    eapol_sm_initialize(sm);
-
-    return sm;
+    eloop_deferred_init(&sm->step_work, eapol_sm_step_work, rtapd, sm);
+    eapol_sm_initialize(rtapd, sm);
 }
 
 
-void eapol_sm_free(struct eapol_state_machine *sm)
+void eapol_sm_deinit(struct eapol_state_machine *sm)
 {
-    if (sm == NULL)
+    if (!sm->in_use)
         return;
 
-    eloop_cancel_timeout(eapol_port_timers_tick, sm->rtapd, sm);
+    eloop_cancel_timeout_ref(&sm->port_timeout);
+    eloop_cancel_deferred(&sm->step_work);
+    eapol_reauth_release(sm);
+    sm->in_use = 0;
+}
+
 
-    free(sm);
+/* Run the four machines until none of them changes state */
+#define SM_STEP_ALL(Step) \
+do \
+{ \
+    int prev_auth_pae, prev_be_auth, prev_reauth_timer, prev_auth_key_tx; \
+    \
+    /* a pending deferred step would have nothing left to do */ \
+    eloop_cancel_deferred(&sm->step_work); \
+    \
+    do \
+    { \
+        prev_auth_pae = sm->auth_pae.state; \
+        prev_be_auth = sm->be_auth.state; \
+        prev_reauth_timer = sm->reauth_timer.state; \
+        prev_auth_key_tx = sm->auth_key_tx.state; \
+        \
+        sm_AUTH_PAE_ ## Step(rtapd, sm); \
+        sm_BE_AUTH_ ## Step(rtapd, sm); \
+        sm_REAUTH_TIMER_ ## Step(rtapd, sm); \
+        sm_AUTH_KEY_TX_ ## Step(rtapd, sm); \
+    } \
+    while (prev_auth_pae != sm->auth_pae.state || \
+           prev_be_auth != sm->be_auth.state || \
+           prev_reauth_timer != sm->reauth_timer.state || \
+           prev_auth_key_tx != sm->auth_key_tx.state); \
+} while (0)
+
+void eapol_sm_step(rtapd *rtapd, struct eapol_state_machine *sm)
+{
+    SM_STEP_ALL(Step);
 }
 
 
-void eapol_sm_step(struct eapol_state_machine *sm)
+#if EAPOL_SM_BENCH
+/* The machines written out as nested switches, the way this file did before
+ * the transition lists, for bench.c to compare SM_STEP() against */
+static void sm_AUTH_PAE_StepNested(struct apd_data *rtapd, struct eapol_state_machine *sm)
 {
-    int prev_auth_pae, prev_be_auth, prev_reauth_timer, prev_auth_key_tx;
+    if (sm_pae_initialize_Guard(sm))
+        sm_AUTH_PAE_INITIALIZE_Enter(rtapd, sm);
+    else if (sm_pae_force_auth_Guard(sm))
+        sm_AUTH_PAE_FORCE_AUTH_Enter(rtapd, sm);
+    else if (sm_pae_force_unauth_Guard(sm))
+        sm_AUTH_PAE_FORCE_UNAUTH_Enter(rtapd, sm);
+    else
+    {
+        switch (sm->auth_pae.state)
+        {
+            case AUTH_PAE_INITIALIZE:
+                sm_AUTH_PAE_DISCONNECTED_Enter(rtapd, sm);
+                break;
+            case AUTH_PAE_DISCONNECTED:
+                sm_AUTH_PAE_CONNECTING_Enter(rtapd, sm);
+                break;
+            case AUTH_PAE_HELD:
+                if (sm_pae_quiet_expired_Guard(sm))
+                    sm_AUTH_PAE_CONNECTING_Enter(rtapd, sm);
+                break;
+            case AUTH_PAE_CONNECTING:
+                if (sm_pae_give_up_Guard(sm))
+                    sm_AUTH_PAE_DISCONNECTED_Enter(rtapd, sm);
+                else if (sm_pae_initial_rsp_Guard(sm))
+                    sm_AUTH_PAE_AUTHENTICATING_Enter(rtapd, sm);
+                else if (sm_pae_retry_Guard(sm))
+                    sm_AUTH_PAE_CONNECTING_Enter(rtapd, sm);
+                break;
+            case AUTH_PAE_AUTHENTICATED:
+                if (sm_pae_restart_Guard(sm))
+                    sm_AUTH_PAE_CONNECTING_Enter(rtapd, sm);
+                else if (sm_pae_logoff_Guard(sm))
+                    sm_AUTH_PAE_DISCONNECTED_Enter(rtapd, sm);
+                break;
+            case AUTH_PAE_AUTHENTICATING:
+                if (sm_pae_success_Guard(sm))
+                    sm_AUTH_PAE_AUTHENTICATED_Enter(rtapd, sm);
+                else if (sm_pae_fail_Guard(sm))
+                    sm_AUTH_PAE_HELD_Enter(rtapd, sm);
+                else if (sm_pae_abort_Guard(sm))
+                    sm_AUTH_PAE_ABORTING_Enter(rtapd, sm);
+                break;
+            case AUTH_PAE_ABORTING:
+                if (sm_pae_aborted_logoff_Guard(sm))
+                    sm_AUTH_PAE_DISCONNECTED_Enter(rtapd, sm);
+                else if (sm_pae_aborted_Guard(sm))
+                    sm_AUTH_PAE_CONNECTING_Enter(rtapd, sm);
+                break;
+            case AUTH_PAE_FORCE_AUTH:
+                if (sm_pae_eap_start_Guard(sm))
+                    sm_AUTH_PAE_FORCE_AUTH_Enter(rtapd, sm);
+                break;
+            case AUTH_PAE_FORCE_UNAUTH:
+                if (sm_pae_eap_start_Guard(sm))
+                    sm_AUTH_PAE_FORCE_UNAUTH_Enter(rtapd, sm);
+                break;
+        }
+    }
+}
+
+static void sm_BE_AUTH_StepNested(struct apd_data *rtapd, struct eapol_state_machine *sm)
+{
+    if (sm_be_initialize_Guard(sm))
+        sm_BE_AUTH_INITIALIZE_Enter(rtapd, sm);
+    else
+    {
+        switch (sm->be_auth.state)
+        {
+            case BE_AUTH_INITIALIZE:
+                sm_BE_AUTH_IDLE_Enter(rtapd, sm);
+                break;
+            case BE_AUTH_REQUEST:
+                if (sm_be_retry_Guard(sm))
+                    sm_BE_AUTH_REQUEST_Enter(rtapd, sm);
+                else if (sm_be_rx_resp_Guard(sm))
+                    sm_BE_AUTH_RESPONSE_Enter(rtapd, sm);
+                else if (sm_be_give_up_Guard(sm))
+                    sm_BE_AUTH_TIMEOUT_Enter(rtapd, sm);
+                break;
+            case BE_AUTH_RESPONSE:
+                if (sm_be_a_req_Guard(sm))
+                    sm_BE_AUTH_REQUEST_Enter(rtapd, sm);
+                else if (sm_be_timeout_Guard(sm))
+                    sm_BE_AUTH_TIMEOUT_Enter(rtapd, sm);
+                else if (sm_be_a_fail_Guard(sm))
+                    sm_BE_AUTH_FAIL_Enter(rtapd, sm);
+                else if (sm_be_a_success_Guard(sm))
+                    sm_BE_AUTH_SUCCESS_Enter(rtapd, sm);
+                break;
+            case BE_AUTH_SUCCESS:
+            case BE_AUTH_FAIL:
+            case BE_AUTH_TIMEOUT:
+                sm_BE_AUTH_IDLE_Enter(rtapd, sm);
+                break;
+            case BE_AUTH_IDLE:
+                if (sm_be_auth_start_Guard(sm))
+                    sm_BE_AUTH_RESPONSE_Enter(rtapd, sm);
+                break;
+        }
+    }
+}
 
-    /* FIX: could re-run eapol_sm_step from registered timeout (after
-     * 0 sec) to make sure that other possible timeouts/events are
-     * processed */
+static void sm_REAUTH_TIMER_StepNested(struct apd_data *rtapd, struct eapol_state_machine *sm)
+{
+    if (sm_reauth_initialize_Guard(sm))
+        sm_REAUTH_TIMER_INITIALIZE_Enter(rtapd, sm);
+    else
+    {
+        switch (sm->reauth_timer.state)
+        {
+            case REAUTH_TIMER_INITIALIZE:
+                if (sm_reauth_start_Guard(sm))
+                    sm_REAUTH_TIMER_INITIALIZE_Enter(rtapd, sm);
+                else if (sm_reauth_expired_Guard(sm))
+                    sm_REAUTH_TIMER_REAUTHENTICATE_Enter(rtapd, sm);
+                break;
+            case REAUTH_TIMER_REAUTHENTICATE:
+                sm_REAUTH_TIMER_INITIALIZE_Enter(rtapd, sm);
+                break;
+        }
+    }
+}
 
-    do
+static void sm_AUTH_KEY_TX_StepNested(struct apd_data *rtapd, struct eapol_state_machine *sm)
+{
+    if (sm_key_tx_initialize_Guard(sm))
+        sm_AUTH_KEY_TX_NO_KEY_TRANSMIT_Enter(rtapd, sm);
+    else
     {
-        prev_auth_pae = sm->auth_pae.state;
-        prev_be_auth = sm->be_auth.state;
-        prev_reauth_timer = sm->reauth_timer.state;
-        prev_auth_key_tx = sm->auth_key_tx.state;
-
-        SM_STEP_RUN(AUTH_PAE);
-        SM_STEP_RUN(BE_AUTH);
-        SM_STEP_RUN(REAUTH_TIMER);
-        SM_STEP_RUN(AUTH_KEY_TX);
+        switch (sm->auth_key_tx.state)
+        {
+            case AUTH_KEY_TX_NO_KEY_TRANSMIT:
+                if (sm_key_tx_start_Guard(sm))
+                    sm_AUTH_KEY_TX_KEY_TRANSMIT_Enter(rtapd, sm);
+                break;
+            case AUTH_KEY_TX_KEY_TRANSMIT:
+                if (sm_key_tx_stop_Guard(sm))
+                    sm_AUTH_KEY_TX_NO_KEY_TRANSMIT_Enter(rtapd, sm);
+                else if (sm_key_available_Guard(sm))
+                    sm_AUTH_KEY_TX_KEY_TRANSMIT_Enter(rtapd, sm);
+                break;
+        }
     }
-    while (prev_auth_pae != sm->auth_pae.state ||
-           prev_be_auth != sm->be_auth.state ||
-           prev_reauth_timer != sm->reauth_timer.state ||
-           prev_auth_key_tx != sm->auth_key_tx.state);
 }
 
+void eapol_sm_step_nested(rtapd *rtapd, struct eapol_state_machine *sm)
+{
+    SM_STEP_ALL(StepNested);
+}
 
-void eapol_sm_initialize(struct eapol_state_machine *sm)
+void eapol_sm_step_table(rtapd *rtapd, struct eapol_state_machine *sm)
+{
+    SM_STEP_ALL(StepTable);
+}
+#endif /* EAPOL_SM_BENCH */
+
+
+/* Step the state machine once at the end of this event loop pass. Events
+ * for the same station within one pass are all handled by a single step. */
+void eapol_sm_schedule_step(struct eapol_state_machine *sm)
+{
+    eloop_schedule(&sm->step_work);
+}
+
+
+/* Put a new station straight into CONNECTING, as if it had sent an
+ * EAPOL-Start that was answered with the Request-Identity 'id'. Used for
+ * stations created by their Response-Identity to a stateless request. */
+void eapol_sm_connecting(rtapd *rtapd, struct eapol_state_machine *sm, u8 id)
+{
+    EAPOL_SM_COUNT(sm, authEntersConnecting);
+    SM_ENTRY(AUTH_PAE, CONNECTING, auth_pae);
+
+    sm->portEnabled = TRUE;
+    sm->currentId = id;
+    sm->reqSent = 0;
+    startTimer(txWhen, sm->auth_pae.txPeriod);
+    sm->auth_pae.rxInitialRsp = FALSE;
+    sm->auth_pae.reAuthCount = 1;
+}
+
+
+/* Put a station taken over from a checkpoint back into AUTHENTICATED
+ * without a word to the supplicant or the RADIUS server. Reauthentication
+ * is due at reAuthWhen; one that is overdue starts after the next step. */
+void eapol_sm_authenticated(rtapd *rtapd, struct eapol_state_machine *sm, eloop_time_t reAuthWhen)
+{
+    SM_ENTRY(AUTH_PAE, AUTHENTICATED, auth_pae);
+
+    sm->portEnabled = TRUE;
+    sm->portStatus = Authorized;
+    Ap_sta_port_changed(rtapd, sm_sta(sm));
+    sm->auth_pae.reAuthCount = 0;
+
+    if (reAuthWhen)
+    {
+        sm->reAuthWhen = reAuthWhen > eloop_now() ? reAuthWhen : eloop_now() + ELOOP_NSEC_PER_SEC;
+        eapol_port_timers_arm(rtapd, sm);
+    }
+    else
+        eapol_sm_schedule_step(sm); /* starts reAuthWhen if enabled */
+}
+
+
+/* Estimate the supplicant's response time from a response to the outstanding
+ * EAP-Request, like TCP does for its retransmission timeout (RFC 6298). */
+void eapol_sm_rtt_sample(struct eapol_state_machine *sm)
+{
+    unsigned int rtt, delta;
+
+    if (sm->reqSent == 0)
+        return;
+
+    rtt = (eloop_now() - sm->reqSent) / ELOOP_NSEC_PER_MSEC;
+    sm->reqSent = 0;
+    if (rtt == 0)
+        rtt = 1;
+
+    if (sm->srtt == 0)
+    {
+        sm->srtt = rtt;
+        sm->rttvar = rtt / 2;
+    }
+    else
+    {
+        delta = rtt > sm->srtt ? rtt - sm->srtt : sm->srtt - rtt;
+        sm->rttvar = (3 * sm->rttvar + delta) / 4;
+        sm->srtt = (7 * sm->srtt + rtt) / 8;
+    }
+
+    /* timers run in whole seconds */
+    eapol_sm_set_rto(sm, (sm->srtt + 4 * sm->rttvar + 999) / 1000);
+    DBGPRINT(RT_DEBUG_INFO, "EAP rtt %u ms, srtt %u ms, rttvar %u ms, rto %d s\n",
+             rtt, sm->srtt, sm->rttvar, sm->rto);
+}
+
+
+void eapol_sm_initialize(rtapd *rtapd, struct eapol_state_machine *sm)
 {
     /* Initialize the state machines by asserting initialize and then
      * deasserting it after one step */
     sm->initialize = TRUE;
-    eapol_sm_step(sm);
+    eapol_sm_step(rtapd, sm);
     sm->initialize = FALSE;
-    eapol_sm_step(sm);
-
-    /* Start one second tick for port timers state machine */
-    eloop_cancel_timeout(eapol_port_timers_tick, sm->rtapd, sm);
-    eloop_register_timeout(1, 0, eapol_port_timers_tick, sm->rtapd, sm);
+    eapol_sm_step(rtapd, sm);
 }
 
@@ -1,6 +1,8 @@
 #ifndef EAPOL_SM_H
 #define EAPOL_SM_H
 
+#include "eloop.h"
+
 /* IEEE Std 802.1X-2001, 8.5 */
 
 typedef enum { ForceUnauthorized, ForceAuthorized, Auto } PortTypes;
@@ -8,145 +10,205 @@ typedef enum { Unauthorized, Authorized } PortState;
 typedef enum { EAPRequestIdentity } EAPMsgType;
 typedef unsigned int Counter;
 
+/* Each machine lists its states as S(machine, state); the list gives the
+ * state enum here and the cases of the step switch in eapol_sm.c */
+#define SM_STATE_ENUM(machine, state) machine ## _ ## state,
+
 
 /* Authenticator PAE state machine */
+#define AUTH_PAE_STATES(S) \
+    S(AUTH_PAE, INITIALIZE) S(AUTH_PAE, DISCONNECTED) S(AUTH_PAE, CONNECTING) \
+    S(AUTH_PAE, AUTHENTICATING) S(AUTH_PAE, AUTHENTICATED) \
+    S(AUTH_PAE, ABORTING) S(AUTH_PAE, HELD) S(AUTH_PAE, FORCE_AUTH) \
+    S(AUTH_PAE, FORCE_UNAUTH)
+
+enum { AUTH_PAE_STATES(SM_STATE_ENUM) };
+
 struct eapol_auth_pae_sm
 {
+    u8 state;
+
     /* variables */
-    Boolean eapLogoff;
-    Boolean eapStart;
-    PortTypes portMode;
-    unsigned int reAuthCount;
-    Boolean rxInitialRsp;
+    unsigned int eapLogoff:1;
+    unsigned int eapStart:1;
+    unsigned int rxInitialRsp:1;
+    u8 portMode; /* PortTypes */
+    u8 reAuthCount;
 
     /* constants */
-    unsigned int quietPeriod; /* default 60; 0..65535 */
-
-    EAPMsgType initialEAPMsg; /* IEEE 802.1aa/D4 */
-#define AUTH_PAE_DEFAULT_initialEAPMsg EAPRequestIdentity
-    unsigned int reAuthMax; /* default 2 */
+    u8 reAuthMax; /* default 2 */
 #define AUTH_PAE_DEFAULT_reAuthMax 2
-    unsigned int txPeriod; /* default 30; 1..65535 */
+    u8 initialEAPMsg; /* EAPMsgType; IEEE 802.1aa/D4 */
+#define AUTH_PAE_DEFAULT_initialEAPMsg EAPRequestIdentity
+    u16 quietPeriod; /* default 60; 0..65535 */
+    u16 txPeriod; /* default 30; 1..65535 */
 #define AUTH_PAE_DEFAULT_txPeriod 30
-
-    /* counters */
-    Counter authEntersConnecting;
-    Counter authEapLogoffsWhileConnecting;
-    Counter authEntersAuthenticating;
-    Counter authAuthSuccessesWhileAuthenticating;
-    Counter authAuthTimeoutsWhileAuthenticating;
-    Counter authAuthFailWhileAuthenticating;
-    Counter authAuthReauthsWhileAuthenticating;
-    Counter authAuthEapStartsWhileAuthenticating;
-    Counter authAuthEapLogoffWhileAuthenticating;
-    Counter authAuthReauthsWhileAuthenticated;
-    Counter authAuthEapStartsWhileAuthenticated;
-    Counter authAuthEapLogoffWhileAuthenticated;
-
-    enum { AUTH_PAE_INITIALIZE, AUTH_PAE_DISCONNECTED, AUTH_PAE_CONNECTING,
-           AUTH_PAE_AUTHENTICATING, AUTH_PAE_AUTHENTICATED,
-           AUTH_PAE_ABORTING, AUTH_PAE_HELD, AUTH_PAE_FORCE_AUTH,
-           AUTH_PAE_FORCE_UNAUTH
-         } state;
 };
 
 
 /* Backend Authentication state machine */
+#define BE_AUTH_STATES(S) \
+    S(BE_AUTH, REQUEST) S(BE_AUTH, RESPONSE) S(BE_AUTH, SUCCESS) \
+    S(BE_AUTH, FAIL) S(BE_AUTH, TIMEOUT) S(BE_AUTH, IDLE) S(BE_AUTH, INITIALIZE)
+
+enum { BE_AUTH_STATES(SM_STATE_ENUM) };
+
 struct eapol_backend_auth_sm
 {
+    u8 state;
+
     /* variables */
-    unsigned int reqCount;
-    Boolean rxResp;
-    Boolean aSuccess;
-    Boolean aFail;
-    Boolean aReq;
+    unsigned int rxResp:1;
+    unsigned int aSuccess:1;
+    unsigned int aFail:1;
+    unsigned int aReq:1;
+    u8 reqCount;
     u8 idFromServer;
 
     /* constants */
+    u8 maxReq; /* default 2; 1..10 */
+#define BE_AUTH_DEFAULT_maxReq 2
     unsigned int suppTimeout; /* default 30; 1..X */
 #define BE_AUTH_DEFAULT_suppTimeout 30
     unsigned int serverTimeout; /* default 30; 1..X */
 #define BE_AUTH_DEFAULT_serverTimeout 30
-    unsigned int maxReq; /* default 2; 1..10 */
-#define BE_AUTH_DEFAULT_maxReq 2
-
-    /* counters */
-    Counter backendResponses;
-    Counter backendAccessChallenges;
-    Counter backendOtherRequestsToSupplicant;
-    Counter backendNonNakResponsesFromSupplicant;
-    Counter backendAuthSuccesses;
-    Counter backendAuthFails;
-
-    enum { BE_AUTH_REQUEST, BE_AUTH_RESPONSE, BE_AUTH_SUCCESS,
-           BE_AUTH_FAIL, BE_AUTH_TIMEOUT, BE_AUTH_IDLE, BE_AUTH_INITIALIZE
-         } state;
+#define EAPOL_RTO_INITIAL 3 /* s, until the first response time sample */
 };
 
 
 /* Reauthentication Timer state machine */
+#define REAUTH_TIMER_STATES(S) \
+    S(REAUTH_TIMER, INITIALIZE) S(REAUTH_TIMER, REAUTHENTICATE)
+
+enum { REAUTH_TIMER_STATES(SM_STATE_ENUM) };
+
 struct eapol_reauth_timer_sm
 {
+    u8 state;
+
     /* constants */
+    unsigned int reAuthEnabled:1;
     unsigned int reAuthPeriod; /* default 3600 s */
-    Boolean reAuthEnabled;
-
-    enum { REAUTH_TIMER_INITIALIZE, REAUTH_TIMER_REAUTHENTICATE } state;
 };
 
 
 /* Authenticator Key Transmit state machine */
+#define AUTH_KEY_TX_STATES(S) \
+    S(AUTH_KEY_TX, NO_KEY_TRANSMIT) S(AUTH_KEY_TX, KEY_TRANSMIT)
+
+enum { AUTH_KEY_TX_STATES(SM_STATE_ENUM) };
+
 struct eapol_auth_key_tx
 {
-    enum { AUTH_KEY_TX_NO_KEY_TRANSMIT, AUTH_KEY_TX_KEY_TRANSMIT } state;
+    u8 state;
 };
 
 
-struct eapol_state_machine
+#if EAPOL_SM_STATS
+/* IEEE 802.1X MIB counters, only kept with EAPOL_SM_STATS=1 */
+struct eapol_sm_stats
 {
-    /* timers */
-    int aWhile;
-    int quietWhile;
-    int reAuthWhen;
-    int txWhen;
+    /* Authenticator PAE */
+    Counter authEntersConnecting;
+    Counter authEapLogoffsWhileConnecting;
+    Counter authEntersAuthenticating;
+    Counter authAuthSuccessesWhileAuthenticating;
+    Counter authAuthTimeoutsWhileAuthenticating;
+    Counter authAuthFailWhileAuthenticating;
+    Counter authAuthReauthsWhileAuthenticating;
+    Counter authAuthEapStartsWhileAuthenticating;
+    Counter authAuthEapLogoffWhileAuthenticating;
+    Counter authAuthReauthsWhileAuthenticated;
+    Counter authAuthEapStartsWhileAuthenticated;
+    Counter authAuthEapLogoffWhileAuthenticated;
 
-    /* global variables */
-    Boolean authAbort;
-    Boolean authFail;
-    Boolean authStart;
-    Boolean authTimeout;
-    Boolean authSuccess;
-    u8 currentId;
-    Boolean initialize;
-    Boolean keyAvailable; /* 802.1aa; was in Auth Key Transmit sm in .1x */
-    Boolean keyTxEnabled; /* 802.1aa; was in Auth Key Transmit sm in .1x
-                   * stace machines do not change this */
-    PortTypes portControl;
-    Boolean portEnabled;
-    PortState portStatus;
-    Boolean portValid; /* 802.1aa */
-    Boolean reAuthenticate;
+    /* Backend Authentication */
+    Counter backendResponses;
+    Counter backendAccessChallenges;
+    Counter backendOtherRequestsToSupplicant;
+    Counter backendNonNakResponsesFromSupplicant;
+    Counter backendAuthSuccesses;
+    Counter backendAuthFails;
+};
 
+#define EAPOL_SM_COUNT(sm, counter) ((sm)->stats.counter++)
+#else
+#define EAPOL_SM_COUNT(sm, counter) do { } while (0)
+#endif
 
-    /* Port Timers state machine */
-    /* 'Boolean tick' implicitly handled as registered timeout */
+
+/* Embedded in struct sta_info. Everything read by a step comes first so
+ * that it shares a cache line; the timer bookkeeping and the counters are
+ * only touched on events. */
+struct eapol_state_machine
+{
+    /* global variables */
+    unsigned int authAbort:1;
+    unsigned int authFail:1;
+    unsigned int authStart:1;
+    unsigned int authTimeout:1;
+    unsigned int authSuccess:1;
+    unsigned int initialize:1;
+    unsigned int keyAvailable:1; /* 802.1aa; was in Auth Key Transmit sm in .1x */
+    unsigned int keyTxEnabled:1; /* 802.1aa; was in Auth Key Transmit sm in .1x
+                   * stace machines do not change this */
+    unsigned int portEnabled:1;
+    unsigned int portValid:1; /* 802.1aa */
+    unsigned int reAuthenticate:1;
+    unsigned int in_use:1; /* set up by eapol_sm_init() */
+    unsigned int reauthSlot:1; /* reauthentication slot reserved */
+    u8 portControl; /* PortTypes */
+    u8 portStatus; /* PortState */
+    u8 currentId;
 
     struct eapol_auth_pae_sm auth_pae;
     struct eapol_backend_auth_sm be_auth;
     struct eapol_reauth_timer_sm reauth_timer;
     struct eapol_auth_key_tx auth_key_tx;
 
-    /* Somewhat nasty pointers to global hostapd and STA data to avoid
-     * passing these to every function */
-    rtapd *rtapd;
-    struct sta_info *sta;
+    /* timers, as deadlines on the eloop clock (0 = expired) */
+    eloop_time_t aWhile;
+    eloop_time_t quietWhile;
+    eloop_time_t reAuthWhen;
+    eloop_time_t txWhen;
+
+    /* txPeriod, adapted by eapol_sm_rtt_sample() */
+    eloop_time_t reqSent; /* 0 if not sampled */
+    unsigned int srtt; /* ms, 0 before the first sample */
+    unsigned int rttvar; /* ms */
+    u16 rto; /* s */
+    u16 rtoMin;
+    u16 rtoMax;
+
+    /* Port Timers state machine */
+    /* 'Boolean tick' implicitly handled as a registered timeout at the
+     * earliest running timer deadline */
+    struct eloop_timeout *port_timeout;
+
+    /* pending eapol_sm_step(), see eapol_sm_schedule_step() */
+    struct eloop_deferred step_work;
+
+#if EAPOL_SM_STATS
+    struct eapol_sm_stats stats;
+#endif
 };
 
 
-struct eapol_state_machine *eapol_sm_alloc(rtapd *rtapd,
-        struct sta_info *sta);
-void eapol_sm_free(struct eapol_state_machine *sm);
-void eapol_sm_step(struct eapol_state_machine *sm);
-void eapol_sm_initialize(struct eapol_state_machine *sm);
+struct apd_data;
+struct sta_info;
+
+void eapol_sm_init(struct apd_data *rtapd, struct sta_info *sta);
+void eapol_sm_deinit(struct eapol_state_machine *sm);
+void eapol_sm_step(struct apd_data *rtapd, struct eapol_state_machine *sm);
+#if EAPOL_SM_BENCH
+void eapol_sm_step_nested(struct apd_data *rtapd, struct eapol_state_machine *sm);
+void eapol_sm_step_table(struct apd_data *rtapd, struct eapol_state_machine *sm);
+#endif
+void eapol_sm_schedule_step(struct eapol_state_machine *sm);
+void eapol_sm_initialize(struct apd_data *rtapd, struct eapol_state_machine *sm);
+void eapol_sm_connecting(struct apd_data *rtapd, struct eapol_state_machine *sm, u8 id);
+void eapol_sm_authenticated(struct apd_data *rtapd, struct eapol_state_machine *sm, eloop_time_t reAuthWhen);
+void eapol_sm_rtt_sample(struct eapol_state_machine *sm);
+unsigned long eapol_sm_reauth_deferred(void);
 
 #endif /* EAPOL_SM_H */
@@ -3,29 +3,96 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <poll.h>
+#if !ELOOP_SELECT
+#include <sys/epoll.h>
+#endif
+#if !ELOOP_SIGNAL_PIPE
+#include <sys/signalfd.h>
+#endif
 
+#include "common.h"
 #include "eloop.h"
+#include "pool.h"
+
+/* Default number of expired timeouts handled per loop pass */
+#define ELOOP_TIMEOUT_BUDGET    64
+
+#if !ELOOP_SELECT
+/* Size hint for epoll_create(); ignored by recent kernels */
+#define ELOOP_EPOLL_SIZE_HINT   16
+#endif
+
+/* Extra reads per loop pass for still readable sockets of a class, see
+ * eloop_set_read_budget() */
+#define ELOOP_READ_BUDGET_HIGH      32
+#define ELOOP_READ_BUDGET_NORMAL    0
+
+/* Packets held per socket by eloop_send() while the socket is not writable */
+#define ELOOP_SEND_QUEUE_LEN    32
+
+#if ELOOP_PROFILE
+/* Time a handler call and account it to the handler's profile entry */
+#define ELOOP_PROFILE_CALL(type, func, call)                        \
+    do                                                              \
+    {                                                               \
+        void *prof_func = (void *) (func);                          \
+        eloop_time_t prof_start = eloop_clock();                    \
+        call;                                                       \
+        eloop_profile_handler(type, prof_func, prof_start);         \
+    } while (0)
+#else
+#define ELOOP_PROFILE_CALL(type, func, call) call
+#endif
 
 
 struct eloop_sock
 {
     int sock;
+    int prio; /* ELOOP_PRIO_*, readers only */
     void *eloop_data;
     void *user_data;
     void (*handler)(int sock, void *eloop_ctx, void *sock_ctx);
 };
 
+#if !ELOOP_SELECT
+/* epoll interest of one descriptor */
+struct eloop_fd
+{
+    int reader; /* index into readers[], or -1 */
+    int writer; /* index into writers[], or -1 */
+    unsigned int events; /* events currently in the epoll set */
+};
+#endif
+
+struct eloop_send_queue
+{
+    int sock;
+    int head, count; /* ring of pending packets */
+    struct
+    {
+        u8 *buf;
+        size_t len, size; /* size of the pool buffer */
+    } pkts[ELOOP_SEND_QUEUE_LEN];
+};
+
 struct eloop_timeout
 {
-    struct timeval time;
+    eloop_time_t time;
+    eloop_time_t deadline; /* requested expiry, before slack rounding */
+    unsigned int seq; /* registration order; keeps equal deadlines FIFO */
+    int index; /* position in eloop.timeouts[] heap */
+    struct eloop_timeout **ref; /* caller's handle, reset when released */
     void *eloop_data;
     void *user_data;
     void (*handler)(void *eloop_ctx, void *sock_ctx);
-    struct eloop_timeout *next;
 };
 
 struct eloop_signal
@@ -39,43 +106,277 @@ struct eloop_data
 {
     void *user_data;
 
-    int max_sock, reader_count;
+    int max_sock, reader_count, writer_count;
     struct eloop_sock *readers;
+    struct eloop_sock *writers;
 
-    struct eloop_timeout *timeout;
+    /* sockets with pending input in this pass, served by priority class;
+     * only ever grows, a handler may register readers while it is used */
+    int *ready;
+    int ready_size;
+    int read_budget[ELOOP_PRIO_CLASSES];
+
+#if ELOOP_SELECT
+    fd_set rfds, wfds;
+#else
+    /* a descriptor is in the epoll interest set while it has a reader or a
+     * writer; epoll_event.data.fd indexes fds[] */
+    int epoll_fd;
+    struct epoll_event *epoll_events; /* only grows, like ready[] */
+    int epoll_count, epoll_size;
+    struct eloop_fd *fds;
+    int fd_size;
+#endif
+
+    int send_queue_count;
+    struct eloop_send_queue **send_queues;
+
+    /* circular list of scheduled eloop_deferred work */
+    struct eloop_deferred deferred;
+
+    /* pending timeouts as a binary min-heap ordered by (time, seq) */
+    struct eloop_timeout **timeouts;
+    int timeout_count, timeout_size;
+    unsigned int timeout_seq;
+    int timeout_budget;
+
+    eloop_time_t now; /* loop clock, read once per loop pass */
+    eloop_time_t start;
+
+    struct eloop_stats stats;
+#if ELOOP_PROFILE
+    struct eloop_loop_profile loop_profile;
+    int handler_profile_count;
+    struct eloop_handler_profile handler_profile[ELOOP_PROFILE_HANDLERS];
+#endif
 
     int signal_count;
     struct eloop_signal *signals;
+    /* signals are read from this descriptor as a normal reader, so signal
+     * handlers never interrupt another handler */
+    int signal_fd;
+#if ELOOP_SIGNAL_PIPE
+    int signal_pipe[2];
+#else
+    sigset_t signal_mask;
+#endif
 
     int terminate;
     int reload;
+    void (*reload_handler)(void *eloop_ctx, void *user_data);
+    void *reload_data;
 };
 
 static struct eloop_data eloop;
 
 
+static eloop_time_t eloop_clock(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return eloop.now;
+    return (eloop_time_t) ts.tv_sec * ELOOP_NSEC_PER_SEC + ts.tv_nsec;
+}
+
+#if ELOOP_PROFILE
+static int eloop_log2_bucket(unsigned long value, int buckets)
+{
+    int bucket = 0;
+
+    while (value > 0 && bucket < buckets - 1)
+    {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void eloop_profile_handler(const char *type, void *handler, eloop_time_t start)
+{
+    struct eloop_handler_profile *prof;
+    unsigned long us;
+    int i;
+
+    us = (eloop_clock() - start) / ELOOP_NSEC_PER_USEC;
+
+    for (i = 0; i < eloop.handler_profile_count; i++)
+    {
+        if (eloop.handler_profile[i].handler == handler && eloop.handler_profile[i].type == type)
+            break;
+    }
+    prof = &eloop.handler_profile[i];
+    if (i == eloop.handler_profile_count)
+    {
+        /* table full: the last entry collects everything else */
+        if (i == ELOOP_PROFILE_HANDLERS)
+        {
+            prof--;
+            handler = NULL;
+            type = "other";
+        }
+        else
+            eloop.handler_profile_count++;
+        prof->handler = handler;
+        prof->type = type;
+    }
+
+    prof->calls++;
+    prof->total_us += us;
+    if (us > prof->max_us)
+        prof->max_us = us;
+    prof->hist[eloop_log2_bucket(us, ELOOP_PROFILE_BUCKETS)]++;
+}
+#endif
+
+
 void eloop_init(void *user_data)
 {
     memset(&eloop, 0, sizeof(eloop));
     eloop.user_data = user_data;
+    eloop.timeout_budget = ELOOP_TIMEOUT_BUDGET;
+    eloop.read_budget[ELOOP_PRIO_HIGH] = ELOOP_READ_BUDGET_HIGH;
+    eloop.read_budget[ELOOP_PRIO_NORMAL] = ELOOP_READ_BUDGET_NORMAL;
+    eloop.start = eloop_update_time();
+    eloop.signal_fd = -1;
+    eloop.deferred.next = eloop.deferred.prev = &eloop.deferred;
+
+#if !ELOOP_SELECT
+    eloop.epoll_fd = epoll_create(ELOOP_EPOLL_SIZE_HINT);
+    if (eloop.epoll_fd < 0)
+        perror("epoll_create");
+#endif
 }
 
 
-int eloop_register_read_sock(int sock, void (*handler)(int sock, void *eloop_ctx, void *sock_ctx),
-                             void *eloop_data, void *user_data)
+#if !ELOOP_SELECT
+static struct eloop_fd *eloop_get_fd(int sock)
+{
+    struct eloop_fd *tmp;
+    int i, size;
+
+    if (sock < 0)
+        return NULL;
+
+    if (sock >= eloop.fd_size)
+    {
+        size = eloop.fd_size ? eloop.fd_size : 16;
+        while (size <= sock)
+            size *= 2;
+        tmp = (struct eloop_fd *) realloc(eloop.fds, size * sizeof(struct eloop_fd));
+        if (tmp == NULL)
+            return NULL;
+        for (i = eloop.fd_size; i < size; i++)
+        {
+            tmp[i].reader = -1;
+            tmp[i].writer = -1;
+            tmp[i].events = 0;
+        }
+        eloop.fds = tmp;
+        eloop.fd_size = size;
+    }
+
+    return &eloop.fds[sock];
+}
+
+/* Bring the epoll interest set in line with the reader/writer of sock */
+static int eloop_epoll_update(int sock)
+{
+    struct eloop_fd *fd = &eloop.fds[sock];
+    struct epoll_event ev, *events;
+    int op;
+
+    memset(&ev, 0, sizeof(ev));
+    if (fd->reader >= 0)
+        ev.events |= EPOLLIN;
+    if (fd->writer >= 0)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = sock;
+
+    if (ev.events == fd->events)
+        return 0;
+
+    if (fd->events == 0)
+    {
+        if (eloop.epoll_count == eloop.epoll_size)
+        {
+            int size = eloop.epoll_size ? eloop.epoll_size * 2 : 16;
+
+            events = (struct epoll_event *) realloc(eloop.epoll_events, size * sizeof(struct epoll_event));
+            if (events == NULL)
+                return -1;
+            eloop.epoll_events = events;
+            eloop.epoll_size = size;
+        }
+        op = EPOLL_CTL_ADD;
+    }
+    else if (ev.events == 0)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+
+    if (epoll_ctl(eloop.epoll_fd, op, sock, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    if (op == EPOLL_CTL_ADD)
+        eloop.epoll_count++;
+    else if (op == EPOLL_CTL_DEL)
+        eloop.epoll_count--;
+    fd->events = ev.events;
+
+    return 0;
+}
+#endif
+
+int eloop_register_read_sock_prio(int sock, int prio,
+                                  void (*handler)(int sock, void *eloop_ctx, void *sock_ctx),
+                                  void *eloop_data, void *user_data)
 {
     struct eloop_sock *tmp;
+    int *ready;
+
+    if (prio < 0 || prio >= ELOOP_PRIO_CLASSES)
+        return -1;
+
+#if !ELOOP_SELECT
+    if (eloop.epoll_fd < 0 || eloop_get_fd(sock) == NULL)
+        return -1;
+#endif
+
+    if (eloop.reader_count == eloop.ready_size)
+    {
+        int size = eloop.ready_size ? eloop.ready_size * 2 : 16;
+
+        ready = (int *) realloc(eloop.ready, size * sizeof(int));
+        if (ready == NULL)
+            return -1;
+        eloop.ready = ready;
+        eloop.ready_size = size;
+    }
 
     tmp = (struct eloop_sock *) realloc(eloop.readers, (eloop.reader_count + 1) * sizeof(struct eloop_sock));
     if (tmp == NULL)
         return -1;
+    eloop.readers = tmp;
+
+#if !ELOOP_SELECT
+    eloop.fds[sock].reader = eloop.reader_count;
+    if (eloop_epoll_update(sock))
+    {
+        eloop.fds[sock].reader = -1;
+        return -1;
+    }
+#endif
 
     tmp[eloop.reader_count].sock = sock;
+    tmp[eloop.reader_count].prio = prio;
     tmp[eloop.reader_count].eloop_data = eloop_data;
     tmp[eloop.reader_count].user_data = user_data;
     tmp[eloop.reader_count].handler = handler;
     eloop.reader_count++;
-    eloop.readers = tmp;
 
     if (sock > eloop.max_sock)
         eloop.max_sock = sock;
@@ -83,108 +384,659 @@ int eloop_register_read_sock(int sock, void (*handler)(int sock, void *eloop_ctx
     return 0;
 }
 
-int eloop_register_timeout(unsigned int secs, unsigned int usecs,
-                           void (*handler)(void *eloop_ctx, void *timeout_ctx),
-                           void *eloop_data, void *user_data)
+int eloop_register_read_sock(int sock, void (*handler)(int sock, void *eloop_ctx, void *sock_ctx),
+                             void *eloop_data, void *user_data)
 {
-    struct eloop_timeout *timeout, *tmp, *prev;
+    return eloop_register_read_sock_prio(sock, ELOOP_PRIO_NORMAL, handler, eloop_data, user_data);
+}
 
-    timeout = (struct eloop_timeout *) malloc(sizeof(*timeout));
-    if (timeout == NULL)
+static void eloop_send_discard(int sock);
+
+void eloop_unregister_read_sock(int sock)
+{
+    int i;
+
+    for (i = 0; i < eloop.reader_count; i++)
+    {
+        if (eloop.readers[i].sock == sock)
+            break;
+    }
+    if (i < eloop.reader_count)
+    {
+        /* move the last reader into the freed slot */
+        eloop.reader_count--;
+        if (i < eloop.reader_count)
+        {
+            eloop.readers[i] = eloop.readers[eloop.reader_count];
+#if !ELOOP_SELECT
+            eloop.fds[eloop.readers[i].sock].reader = i;
+#endif
+        }
+
+#if !ELOOP_SELECT
+        eloop.fds[sock].reader = -1;
+        eloop_epoll_update(sock);
+#endif
+    }
+
+    eloop_send_discard(sock);
+}
+
+void eloop_set_read_budget(int prio, int budget)
+{
+    if (prio >= 0 && prio < ELOOP_PRIO_CLASSES)
+        eloop.read_budget[prio] = budget;
+}
+
+static struct eloop_sock *eloop_find_reader(int sock)
+{
+#if ELOOP_SELECT
+    int i;
+
+    for (i = 0; i < eloop.reader_count; i++)
+    {
+        if (eloop.readers[i].sock == sock)
+            return &eloop.readers[i];
+    }
+#else
+    if (sock >= 0 && sock < eloop.fd_size && eloop.fds[sock].reader >= 0)
+        return &eloop.readers[eloop.fds[sock].reader];
+#endif
+    return NULL;
+}
+
+static int eloop_readable(int sock)
+{
+    struct pollfd pfd;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+/* Serve the count sockets in eloop.ready[], higher priority classes first.
+ * Every ready socket is served once; then sockets of the class that are
+ * still readable are served again, round robin, until the class budget is
+ * spent. Readers are looked up by socket before every call since handlers
+ * may change the registrations, and eloop.ready is read again after each
+ * call since registering a reader may move it. */
+static void eloop_dispatch_readers(int count)
+{
+    struct eloop_sock *reader;
+    int prio, budget, again, i;
+
+    for (prio = 0; prio < ELOOP_PRIO_CLASSES; prio++)
+    {
+        for (i = 0; i < count; i++)
+        {
+            reader = eloop_find_reader(eloop.ready[i]);
+            if (reader == NULL || reader->prio != prio)
+                continue;
+            eloop.stats.prio_reads[prio]++;
+            ELOOP_PROFILE_CALL("read", reader->handler,
+                               reader->handler(reader->sock, reader->eloop_data, reader->user_data));
+        }
+
+        budget = eloop.read_budget[prio];
+        again = 1;
+        while (budget > 0 && again)
+        {
+            again = 0;
+            for (i = 0; i < count && budget > 0; i++)
+            {
+                reader = eloop_find_reader(eloop.ready[i]);
+                if (reader == NULL || reader->prio != prio || !eloop_readable(eloop.ready[i]))
+                    continue;
+                eloop.stats.prio_reads[prio]++;
+                ELOOP_PROFILE_CALL("read", reader->handler,
+                                   reader->handler(reader->sock, reader->eloop_data, reader->user_data));
+                budget--;
+                again = 1;
+            }
+        }
+        if (eloop.read_budget[prio] > 0 && budget == 0)
+            eloop.stats.prio_budget_hits[prio]++;
+    }
+}
+
+int eloop_register_write_sock(int sock, void (*handler)(int sock, void *eloop_ctx, void *sock_ctx),
+                              void *eloop_data, void *user_data)
+{
+    struct eloop_sock *tmp;
+
+#if !ELOOP_SELECT
+    if (eloop.epoll_fd < 0 || eloop_get_fd(sock) == NULL)
         return -1;
+#endif
 
-    gettimeofday(&timeout->time, NULL);
-    timeout->time.tv_sec += secs;
-    timeout->time.tv_usec += usecs;
+    tmp = (struct eloop_sock *) realloc(eloop.writers, (eloop.writer_count + 1) * sizeof(struct eloop_sock));
+    if (tmp == NULL)
+        return -1;
+    eloop.writers = tmp;
 
-    while (timeout->time.tv_usec >= 1000000)
+#if !ELOOP_SELECT
+    eloop.fds[sock].writer = eloop.writer_count;
+    if (eloop_epoll_update(sock))
     {
-        timeout->time.tv_sec++;
-        timeout->time.tv_usec -= 1000000;
+        eloop.fds[sock].writer = -1;
+        return -1;
     }
-    timeout->eloop_data = eloop_data;
-    timeout->user_data = user_data;
-    timeout->handler = handler;
-    timeout->next = NULL;
+#endif
+
+    tmp[eloop.writer_count].sock = sock;
+    tmp[eloop.writer_count].eloop_data = eloop_data;
+    tmp[eloop.writer_count].user_data = user_data;
+    tmp[eloop.writer_count].handler = handler;
+    eloop.writer_count++;
+
+    if (sock > eloop.max_sock)
+        eloop.max_sock = sock;
+
+    return 0;
+}
+
+void eloop_unregister_write_sock(int sock)
+{
+    int i;
 
-    if (eloop.timeout == NULL)
+    for (i = 0; i < eloop.writer_count; i++)
     {
-        eloop.timeout = timeout;
-        return 0;
+        if (eloop.writers[i].sock == sock)
+            break;
     }
+    if (i == eloop.writer_count)
+        return;
 
-    prev = NULL;
-    tmp = eloop.timeout;
-    while (tmp != NULL)
+    /* move the last writer into the freed slot */
+    eloop.writer_count--;
+    if (i < eloop.writer_count)
     {
-        if (timercmp(&timeout->time, &tmp->time, <))
+        eloop.writers[i] = eloop.writers[eloop.writer_count];
+#if !ELOOP_SELECT
+        eloop.fds[eloop.writers[i].sock].writer = i;
+#endif
+    }
+
+#if !ELOOP_SELECT
+    eloop.fds[sock].writer = -1;
+    eloop_epoll_update(sock);
+#endif
+}
+
+static int eloop_would_block(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static void eloop_send_flush(int sock, void *eloop_ctx, void *sock_ctx)
+{
+    struct eloop_send_queue *queue = sock_ctx;
+
+    while (queue->count > 0)
+    {
+        if (send(sock, queue->pkts[queue->head].buf, queue->pkts[queue->head].len, MSG_DONTWAIT) < 0)
+        {
+            if (eloop_would_block())
+                return;
+            perror("send");
+            eloop.stats.send_errors++;
+        }
+
+        Pool_buf_free(queue->pkts[queue->head].buf, queue->pkts[queue->head].size);
+        queue->head = (queue->head + 1) % ELOOP_SEND_QUEUE_LEN;
+        queue->count--;
+    }
+
+    eloop_unregister_write_sock(sock);
+}
+
+/* Drop the send queue of sock along with the packets still in it */
+static void eloop_send_discard(int sock)
+{
+    struct eloop_send_queue *queue;
+    int i;
+
+    for (i = 0; i < eloop.send_queue_count; i++)
+    {
+        if (eloop.send_queues[i]->sock == sock)
             break;
-        prev = tmp;
-        tmp = tmp->next;
     }
+    if (i == eloop.send_queue_count)
+        return;
+
+    queue = eloop.send_queues[i];
+    eloop.send_queues[i] = eloop.send_queues[--eloop.send_queue_count];
 
-    if (prev == NULL)
+    if (queue->count > 0)
+        eloop_unregister_write_sock(sock);
+    while (queue->count > 0)
     {
-        timeout->next = eloop.timeout;
-        eloop.timeout = timeout;
+        Pool_buf_free(queue->pkts[queue->head].buf, queue->pkts[queue->head].size);
+        queue->head = (queue->head + 1) % ELOOP_SEND_QUEUE_LEN;
+        queue->count--;
+        eloop.stats.send_drops++;
     }
-    else
+    free(queue);
+}
+
+static struct eloop_send_queue *eloop_get_send_queue(int sock, int create)
+{
+    struct eloop_send_queue *queue, **tmp;
+    int i;
+
+    for (i = 0; i < eloop.send_queue_count; i++)
     {
-        timeout->next = prev->next;
-        prev->next = timeout;
+        if (eloop.send_queues[i]->sock == sock)
+            return eloop.send_queues[i];
     }
+    if (!create)
+        return NULL;
+
+    tmp = (struct eloop_send_queue **) realloc(eloop.send_queues, (eloop.send_queue_count + 1) * sizeof(struct eloop_send_queue *));
+    if (tmp == NULL)
+        return NULL;
+    eloop.send_queues = tmp;
+
+    queue = (struct eloop_send_queue *) malloc(sizeof(*queue));
+    if (queue == NULL)
+        return NULL;
+    memset(queue, 0, sizeof(*queue));
+    queue->sock = sock;
+    eloop.send_queues[eloop.send_queue_count++] = queue;
+
+    return queue;
+}
+
+int eloop_send(int sock, const void *buf, size_t len)
+{
+    struct eloop_send_queue *queue;
+    u8 *copy;
+    size_t size;
+    int res, tail;
+
+    queue = eloop_get_send_queue(sock, 0);
+
+    /* send directly unless earlier packets are still waiting */
+    if (queue == NULL || queue->count == 0)
+    {
+        res = send(sock, buf, len, MSG_DONTWAIT);
+        if (res >= 0)
+            return res;
+        if (!eloop_would_block())
+        {
+            eloop.stats.send_errors++;
+            return -1;
+        }
+    }
+
+    if (queue == NULL)
+        queue = eloop_get_send_queue(sock, 1);
+    if (queue == NULL || queue->count >= ELOOP_SEND_QUEUE_LEN)
+        goto drop;
+
+    copy = Pool_buf_alloc(len, &size);
+    if (copy == NULL)
+        goto drop;
+    memcpy(copy, buf, len);
+
+    if (queue->count == 0 && eloop_register_write_sock(sock, eloop_send_flush, NULL, queue))
+    {
+        Pool_buf_free(copy, size);
+        goto drop;
+    }
+
+    tail = (queue->head + queue->count) % ELOOP_SEND_QUEUE_LEN;
+    queue->pkts[tail].buf = copy;
+    queue->pkts[tail].len = len;
+    queue->pkts[tail].size = size;
+    queue->count++;
+
+    eloop.stats.send_queued++;
+    if (queue->count > eloop.stats.send_queue_max)
+        eloop.stats.send_queue_max = queue->count;
+
+    return len;
+
+drop:
+    eloop.stats.send_drops++;
+    errno = ENOBUFS;
+    return -1;
+}
+
+static int eloop_timeout_before(struct eloop_timeout *a, struct eloop_timeout *b)
+{
+    if (a->time != b->time)
+        return a->time < b->time;
+    return (int) (a->seq - b->seq) < 0;
+}
+
+static void eloop_timeout_set(int index, struct eloop_timeout *timeout)
+{
+    eloop.timeouts[index] = timeout;
+    timeout->index = index;
+}
+
+static void eloop_timeout_sift_up(int index)
+{
+    struct eloop_timeout *timeout = eloop.timeouts[index];
+    int parent;
+
+    while (index > 0)
+    {
+        parent = (index - 1) / 2;
+        if (!eloop_timeout_before(timeout, eloop.timeouts[parent]))
+            break;
+        eloop_timeout_set(index, eloop.timeouts[parent]);
+        index = parent;
+    }
+    eloop_timeout_set(index, timeout);
+}
+
+static void eloop_timeout_sift_down(int index)
+{
+    struct eloop_timeout *timeout = eloop.timeouts[index];
+    int child;
+
+    for (;;)
+    {
+        child = 2 * index + 1;
+        if (child >= eloop.timeout_count)
+            break;
+        if (child + 1 < eloop.timeout_count &&
+            eloop_timeout_before(eloop.timeouts[child + 1], eloop.timeouts[child]))
+            child++;
+        if (!eloop_timeout_before(eloop.timeouts[child], timeout))
+            break;
+        eloop_timeout_set(index, eloop.timeouts[child]);
+        index = child;
+    }
+    eloop_timeout_set(index, timeout);
+}
+
+/* Unlink timeout from the heap; O(log n) */
+static void eloop_timeout_unlink(struct eloop_timeout *timeout)
+{
+    int index = timeout->index;
+    struct eloop_timeout *last;
+
+    last = eloop.timeouts[--eloop.timeout_count];
+    if (last != timeout)
+    {
+        eloop_timeout_set(index, last);
+        if (index > 0 && eloop_timeout_before(last, eloop.timeouts[(index - 1) / 2]))
+            eloop_timeout_sift_up(index);
+        else
+            eloop_timeout_sift_down(index);
+    }
+}
+
+/* Unlink timeout from the heap and give it back to the pool */
+static void eloop_timeout_remove(struct eloop_timeout *timeout)
+{
+    eloop_timeout_unlink(timeout);
+    if (timeout->ref)
+        *timeout->ref = NULL;
+    Pool_timeout_free(timeout);
+}
+
+int eloop_register_timeout_ref(unsigned int secs, unsigned int usecs,
+                               unsigned int slack_ms,
+                               void (*handler)(void *eloop_ctx, void *timeout_ctx),
+                               void *eloop_data, void *user_data,
+                               struct eloop_timeout **ref)
+{
+    struct eloop_timeout *timeout = NULL, **tmp;
+
+    /* re-arming a handle moves the timeout it refers to */
+    if (ref && *ref)
+    {
+        timeout = *ref;
+        eloop_timeout_unlink(timeout);
+    }
+
+    if (eloop.timeout_count == eloop.timeout_size)
+    {
+        int size = eloop.timeout_size ? eloop.timeout_size * 2 : 16;
+
+        tmp = (struct eloop_timeout **) realloc(eloop.timeouts, size * sizeof(*tmp));
+        if (tmp == NULL)
+            return -1;
+        eloop.timeouts = tmp;
+        eloop.timeout_size = size;
+    }
+
+    if (timeout == NULL)
+        timeout = (struct eloop_timeout *) Pool_timeout_alloc(sizeof(*timeout));
+    if (timeout == NULL)
+        return -1;
+
+    timeout->deadline = eloop.now + secs * ELOOP_NSEC_PER_SEC + usecs * ELOOP_NSEC_PER_USEC;
+    timeout->time = timeout->deadline;
+    if (slack_ms)
+    {
+        eloop_time_t slack = slack_ms * ELOOP_NSEC_PER_MSEC;
+
+        timeout->time = (timeout->deadline + slack - 1) / slack * slack;
+    }
+    timeout->seq = eloop.timeout_seq++;
+    timeout->eloop_data = eloop_data;
+    timeout->user_data = user_data;
+    timeout->handler = handler;
+    timeout->ref = ref;
+    if (ref)
+        *ref = timeout;
+
+    eloop_timeout_set(eloop.timeout_count++, timeout);
+    eloop_timeout_sift_up(timeout->index);
 
     return 0;
 }
 
+int eloop_register_timeout(unsigned int secs, unsigned int usecs,
+                           unsigned int slack_ms,
+                           void (*handler)(void *eloop_ctx, void *timeout_ctx),
+                           void *eloop_data, void *user_data)
+{
+    return eloop_register_timeout_ref(secs, usecs, slack_ms, handler, eloop_data, user_data, NULL);
+}
+
+int eloop_cancel_timeout_ref(struct eloop_timeout **ref)
+{
+    if (ref == NULL || *ref == NULL)
+        return 0;
+
+    eloop_timeout_remove(*ref);
+    return 1;
+}
+
 int eloop_cancel_timeout(void (*handler)(void *eloop_ctx, void *sock_ctx),
                          void *eloop_data, void *user_data)
 {
-    struct eloop_timeout *timeout, *prev, *next;
-    int removed = 0;
+    struct eloop_timeout *timeout;
+    int i, count = 0, removed = 0;
 
-    prev = NULL;
-    timeout = eloop.timeout;
-    while (timeout != NULL)
+    /* compact the heap array in place, then rebuild the heap once */
+    for (i = 0; i < eloop.timeout_count; i++)
     {
-        next = timeout->next;
+        timeout = eloop.timeouts[i];
 
         if (timeout->handler == handler && (timeout->eloop_data == eloop_data || eloop_data == ELOOP_ALL_CTX)
             && (timeout->user_data == user_data || user_data == ELOOP_ALL_CTX))
         {
-            if (prev == NULL)
-                eloop.timeout = next;
-            else
-                prev->next = next;
-            free(timeout);
+            if (timeout->ref)
+                *timeout->ref = NULL;
+            Pool_timeout_free(timeout);
             removed++;
         }
         else
-            prev = timeout;
+            eloop_timeout_set(count++, timeout);
+    }
 
-        timeout = next;
+    if (removed)
+    {
+        eloop.timeout_count = count;
+        for (i = count / 2 - 1; i >= 0; i--)
+            eloop_timeout_sift_down(i);
     }
 
     return removed;
 }
 
-static void eloop_handle_signal(int sig)
+void eloop_set_timeout_budget(int budget)
+{
+    eloop.timeout_budget = budget;
+}
+
+void eloop_deferred_init(struct eloop_deferred *work,
+                         void (*handler)(void *eloop_ctx, void *user_data),
+                         void *eloop_data, void *user_data)
+{
+    work->next = work->prev = NULL;
+    work->handler = handler;
+    work->eloop_data = eloop_data;
+    work->user_data = user_data;
+}
+
+void eloop_schedule(struct eloop_deferred *work)
+{
+    if (work->next)
+    {
+        eloop.stats.deferred_merged++;
+        return;
+    }
+
+    work->prev = eloop.deferred.prev;
+    work->next = &eloop.deferred;
+    eloop.deferred.prev->next = work;
+    eloop.deferred.prev = work;
+}
+
+void eloop_cancel_deferred(struct eloop_deferred *work)
+{
+    if (work->next == NULL)
+        return;
+
+    work->prev->next = work->next;
+    work->next->prev = work->prev;
+    work->next = work->prev = NULL;
+}
+
+static void eloop_run_deferred(void)
+{
+    struct eloop_deferred batch, *work;
+
+    if (eloop.deferred.next == &eloop.deferred)
+        return;
+
+    /* take the current queue; work scheduled by the handlers runs in the
+     * next pass. Cancelling work still in the batch unlinks it from here. */
+    batch.next = eloop.deferred.next;
+    batch.prev = eloop.deferred.prev;
+    batch.next->prev = &batch;
+    batch.prev->next = &batch;
+    eloop.deferred.next = eloop.deferred.prev = &eloop.deferred;
+
+    while (batch.next != &batch)
+    {
+        work = batch.next;
+        eloop_cancel_deferred(work);
+        eloop.stats.deferred_run++;
+        ELOOP_PROFILE_CALL("deferred", work->handler,
+                           work->handler(work->eloop_data, work->user_data));
+    }
+}
+
+static void eloop_dispatch_signal(int sig)
 {
     int i;
     for (i = 0; i < eloop.signal_count; i++)
     {
         if (eloop.signals[i].sig == sig)
         {
-            eloop.signals[i].handler(eloop.signals[i].sig, eloop.user_data, eloop.signals[i].user_data);
+            ELOOP_PROFILE_CALL("signal", eloop.signals[i].handler,
+                               eloop.signals[i].handler(eloop.signals[i].sig, eloop.user_data, eloop.signals[i].user_data));
             break;
         }
     }
 }
 
+#if ELOOP_SIGNAL_PIPE
+static void eloop_handle_signal(int sig)
+{
+    unsigned char c = sig;
+    int saved_errno = errno;
+
+    /* async signal context: only queue the signal number */
+    write(eloop.signal_pipe[1], &c, 1);
+    errno = saved_errno;
+}
+
+static void eloop_read_signals(int sock, void *eloop_ctx, void *sock_ctx)
+{
+    unsigned char buf[32];
+    int len, i;
+
+    while ((len = read(sock, buf, sizeof(buf))) > 0)
+    {
+        for (i = 0; i < len; i++)
+            eloop_dispatch_signal(buf[i]);
+    }
+}
+#else
+static void eloop_read_signals(int sock, void *eloop_ctx, void *sock_ctx)
+{
+    struct signalfd_siginfo info;
+
+    while (read(sock, &info, sizeof(info)) == sizeof(info))
+        eloop_dispatch_signal(info.ssi_signo);
+}
+#endif
+
+static int eloop_init_signals(void)
+{
+    int fd;
+
+#if ELOOP_SIGNAL_PIPE
+    if (pipe(eloop.signal_pipe) < 0)
+    {
+        perror("pipe");
+        return -1;
+    }
+    fcntl(eloop.signal_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(eloop.signal_pipe[1], F_SETFL, O_NONBLOCK);
+    fd = eloop.signal_pipe[0];
+#else
+    sigemptyset(&eloop.signal_mask);
+    fd = signalfd(-1, &eloop.signal_mask, 0);
+    if (fd < 0)
+    {
+        perror("signalfd");
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+#endif
+
+    if (eloop_register_read_sock(fd, eloop_read_signals, NULL, NULL))
+    {
+        close(fd);
+#if ELOOP_SIGNAL_PIPE
+        close(eloop.signal_pipe[1]);
+#endif
+        return -1;
+    }
+    eloop.signal_fd = fd;
+
+    return 0;
+}
+
 int eloop_register_signal(int sig, void (*handler)(int sig, void *eloop_ctx, void *signal_ctx), void *user_data)
 {
     struct eloop_signal *tmp;
 
+    if (eloop.signal_fd < 0 && eloop_init_signals())
+        return -1;
+
     tmp = (struct eloop_signal *) realloc(eloop.signals, (eloop.signal_count + 1) * sizeof(struct eloop_signal));
     if (tmp == NULL)
         return -1;
@@ -194,65 +1046,255 @@ int eloop_register_signal(int sig, void (*handler)(int sig, void *eloop_ctx, voi
     tmp[eloop.signal_count].handler = handler;
     eloop.signal_count++;
     eloop.signals = tmp;
+
+#if ELOOP_SIGNAL_PIPE
     signal(sig, eloop_handle_signal);
+#else
+    /* block normal delivery; the signal stays pending for the signalfd */
+    sigaddset(&eloop.signal_mask, sig);
+    if (sigprocmask(SIG_BLOCK, &eloop.signal_mask, NULL) < 0 ||
+        signalfd(eloop.signal_fd, &eloop.signal_mask, 0) < 0)
+    {
+        perror("signalfd");
+        return -1;
+    }
+#endif
 
     return 0;
 }
 
+void eloop_register_reload(void (*handler)(void *eloop_ctx, void *user_data), void *user_data)
+{
+    eloop.reload_handler = handler;
+    eloop.reload_data = user_data;
+}
+
+static void eloop_timeout_account_lag(eloop_time_t deadline)
+{
+    unsigned long lag_us;
+    int bucket;
+
+    lag_us = (eloop.now - deadline) / ELOOP_NSEC_PER_USEC;
+
+    eloop.stats.timeouts_fired++;
+    eloop.stats.timeout_lag_total_us += lag_us;
+    if (lag_us > eloop.stats.timeout_lag_max_us)
+        eloop.stats.timeout_lag_max_us = lag_us;
+
+    for (bucket = 0; bucket < ELOOP_LAG_BUCKETS - 1 && lag_us >= 1000; bucket++)
+        lag_us /= 10;
+    eloop.stats.timeout_lag_hist[bucket]++;
+}
+
+/* Run every timeout that is due at the time of this pass, up to the budget.
+ * Timeouts registered by the handlers themselves are left for the next
+ * pass, even when they are already due (a zero delay re-arm), so that a
+ * handler re-arming itself cannot keep the loop away from the sockets. */
+static void eloop_run_timeout(void)
+{
+    struct eloop_timeout *tmp;
+    void (*handler)(void *eloop_ctx, void *sock_ctx);
+    void *eloop_data, *user_data;
+    unsigned int pass_seq = eloop.timeout_seq;
+    int fired = 0;
+
+    if (eloop.timeout_count == 0)
+        return;
+
+    while (eloop.timeout_count > 0 && !eloop.terminate)
+    {
+        tmp = eloop.timeouts[0];
+        if (tmp->time > eloop.now)
+            break;
+
+        /* in (time, seq) order everything after it is new as well */
+        if ((int) (tmp->seq - pass_seq) >= 0)
+            break;
+
+        if (eloop.timeout_budget > 0 && fired >= eloop.timeout_budget)
+        {
+            eloop.stats.timeout_budget_hits++;
+            break;
+        }
+
+        /* lag includes the slack rounding, it is what the caller sees */
+        eloop_timeout_account_lag(tmp->deadline);
+
+        /* an upper bound on wakeups saved: without the slack this one may
+         * still have fallen into the same pass */
+        if (fired > 0 && tmp->deadline != tmp->time)
+            eloop.stats.timeouts_slack_shared++;
+
+        /* release before calling, the handler may re-arm the same handle */
+        handler = tmp->handler;
+        eloop_data = tmp->eloop_data;
+        user_data = tmp->user_data;
+        eloop_timeout_remove(tmp);
+        ELOOP_PROFILE_CALL("timeout", handler, handler(eloop_data, user_data));
+        fired++;
+    }
+
+    if (fired)
+    {
+        eloop.stats.timeout_batches++;
+        if (fired > eloop.stats.timeout_batch_max)
+            eloop.stats.timeout_batch_max = fired;
+    }
+}
+
+#if ELOOP_SELECT
+static int eloop_poll(eloop_time_t *wait)
+{
+    struct timeval tv;
+    int i;
+
+    FD_ZERO(&eloop.rfds);
+    for (i = 0; i < eloop.reader_count; i++)
+        FD_SET(eloop.readers[i].sock, &eloop.rfds);
+    FD_ZERO(&eloop.wfds);
+    for (i = 0; i < eloop.writer_count; i++)
+        FD_SET(eloop.writers[i].sock, &eloop.wfds);
+    if (wait)
+    {
+        tv.tv_sec = *wait / ELOOP_NSEC_PER_SEC;
+        tv.tv_usec = (*wait % ELOOP_NSEC_PER_SEC + ELOOP_NSEC_PER_USEC - 1) / ELOOP_NSEC_PER_USEC;
+    }
+    return select(eloop.max_sock + 1, &eloop.rfds, &eloop.wfds, NULL, wait ? &tv : NULL);
+}
+
+static void eloop_dispatch(int res)
+{
+    int i, count = 0;
+
+    for (i = 0; i < eloop.reader_count; i++)
+    {
+        if (FD_ISSET(eloop.readers[i].sock, &eloop.rfds))
+            eloop.ready[count++] = eloop.readers[i].sock;
+    }
+    eloop_dispatch_readers(count);
+
+    /* backwards, a writer may unregister itself from its handler */
+    for (i = eloop.writer_count - 1; i >= 0; i--)
+    {
+        if (i < eloop.writer_count && FD_ISSET(eloop.writers[i].sock, &eloop.wfds))
+        {
+            ELOOP_PROFILE_CALL("write", eloop.writers[i].handler,
+                               eloop.writers[i].handler(eloop.writers[i].sock, eloop.writers[i].eloop_data, eloop.writers[i].user_data));
+        }
+    }
+}
+#else
+static int eloop_poll(eloop_time_t *wait)
+{
+    int timeout_ms = -1;
+
+    /* round up so that we never wake up before the first timeout */
+    if (wait)
+        timeout_ms = (*wait + ELOOP_NSEC_PER_MSEC - 1) / ELOOP_NSEC_PER_MSEC;
+
+    return epoll_wait(eloop.epoll_fd, eloop.epoll_events,
+                      eloop.epoll_count > 0 ? eloop.epoll_count : 1, timeout_ms);
+}
+
+static void eloop_dispatch(int res)
+{
+    struct eloop_sock *handler;
+    unsigned int events;
+    int i, sock, count = 0;
+
+    /* only the descriptors reported ready are visited; errors and hangups
+     * are reported to the reader */
+    for (i = 0; i < res; i++)
+    {
+        sock = eloop.epoll_events[i].data.fd;
+        if ((eloop.epoll_events[i].events & ~EPOLLOUT) && eloop_find_reader(sock))
+            eloop.ready[count++] = sock;
+    }
+    eloop_dispatch_readers(count);
+
+    /* look the writers up again each time, a handler may change the
+     * registrations */
+    for (i = 0; i < res; i++)
+    {
+        sock = eloop.epoll_events[i].data.fd;
+        events = eloop.epoll_events[i].events;
+        if (sock < 0 || sock >= eloop.fd_size)
+            continue;
+
+        if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && eloop.fds[sock].writer >= 0)
+        {
+            handler = &eloop.writers[eloop.fds[sock].writer];
+            ELOOP_PROFILE_CALL("write", handler->handler,
+                               handler->handler(handler->sock, handler->eloop_data, handler->user_data));
+        }
+    }
+}
+#endif
+
 void eloop_run(void)
 {
-    fd_set rfds;
-    int i, res;
-    struct timeval tv, now;
+    int res;
+    eloop_time_t wait = 0;
+#if ELOOP_PROFILE
+    eloop_time_t poll_start;
+#endif
+
+    eloop_update_time();
 
-    while (!eloop.terminate && (eloop.timeout || eloop.reader_count > 0))
+    while (!eloop.terminate && (eloop.timeout_count > 0 || eloop.reader_count > 0))
     {
-        if (eloop.timeout)
+        if (eloop.timeout_count > 0)
         {
-            gettimeofday(&now, NULL);
-            if (timercmp(&now, &eloop.timeout->time, >=))
-                tv.tv_sec = tv.tv_usec = 0;
+            if (eloop.timeouts[0]->time <= eloop.now)
+                wait = 0;
             else
-                timersub(&eloop.timeout->time, &now, &tv);
+                wait = eloop.timeouts[0]->time - eloop.now;
         }
+        /* do not sleep while deferred work is pending */
+        if (eloop.deferred.next != &eloop.deferred)
+            wait = 0;
 
-        FD_ZERO(&rfds);
-        for (i = 0; i < eloop.reader_count; i++)
-            FD_SET(eloop.readers[i].sock, &rfds);
-        res = select(eloop.max_sock + 1, &rfds, NULL, NULL,
-                     eloop.timeout ? &tv : NULL);
+#if ELOOP_PROFILE
+        poll_start = eloop_clock();
+#endif
+        res = eloop_poll(eloop.timeout_count > 0 || eloop.deferred.next != &eloop.deferred ? &wait : NULL);
         if (res < 0 && errno != EINTR)
         {
+#if ELOOP_SELECT
             perror("select");
+#else
+            perror("epoll_wait");
+#endif
             return ;
         }
 
-        /* check if some registered timeouts have occurred */
-        if (eloop.timeout)
-        {
-            struct eloop_timeout *tmp;
+        eloop_update_time();
+#if ELOOP_PROFILE
+        eloop.loop_profile.iterations++;
+        eloop.loop_profile.idle_us += (eloop.now - poll_start) / ELOOP_NSEC_PER_USEC;
+        eloop.loop_profile.ready_hist[eloop_log2_bucket(res > 0 ? res : 0, ELOOP_PROFILE_READY_BUCKETS)]++;
+#endif
 
-            gettimeofday(&now, NULL);
-            if (timercmp(&now, &eloop.timeout->time, >=))
-            {
-                tmp = eloop.timeout;
-                eloop.timeout = eloop.timeout->next;
-                tmp->handler(tmp->eloop_data, tmp->user_data);
-                free(tmp);
-            }
+        /* check if some registered timeouts have occurred */
+        eloop_run_timeout();
 
-        }
+        if (res > 0)
+            eloop_dispatch(res);
 
-        if (res <= 0)
-            continue;
+        eloop_run_deferred();
 
-        for (i = 0; i < eloop.reader_count; i++)
+        /* run a requested reload only after all handlers of this pass */
+        if (eloop.reload && !eloop.terminate)
         {
-            if (FD_ISSET(eloop.readers[i].sock, &rfds))
-            {
-                eloop.readers[i].handler(eloop.readers[i].sock, eloop.readers[i].eloop_data, eloop.readers[i].user_data);
-            }
+            eloop.reload = 0;
+            if (eloop.reload_handler)
+                ELOOP_PROFILE_CALL("reload", eloop.reload_handler,
+                                   eloop.reload_handler(eloop.user_data, eloop.reload_data));
         }
+
+#if ELOOP_PROFILE
+        eloop.loop_profile.busy_us += (eloop_clock() - eloop.now) / ELOOP_NSEC_PER_USEC;
+#endif
     }
 }
 
@@ -268,20 +1310,84 @@ void eloop_reload(void)
 
 void eloop_destroy(void)
 {
-    struct eloop_timeout *timeout, *prev;
+    int i;
 
-    timeout = eloop.timeout;
-    while (timeout != NULL)
+    for (i = 0; i < eloop.timeout_count; i++)
     {
-        prev = timeout;
-        timeout = timeout->next;
-        free(prev);
+        if (eloop.timeouts[i]->ref)
+            *eloop.timeouts[i]->ref = NULL;
+        Pool_timeout_free(eloop.timeouts[i]);
     }
+    free(eloop.timeouts);
     free(eloop.readers);
+    free(eloop.ready);
+    free(eloop.writers);
+    for (i = 0; i < eloop.send_queue_count; i++)
+    {
+        while (eloop.send_queues[i]->count > 0)
+        {
+            Pool_buf_free(eloop.send_queues[i]->pkts[eloop.send_queues[i]->head].buf,
+                          eloop.send_queues[i]->pkts[eloop.send_queues[i]->head].size);
+            eloop.send_queues[i]->head = (eloop.send_queues[i]->head + 1) % ELOOP_SEND_QUEUE_LEN;
+            eloop.send_queues[i]->count--;
+        }
+        free(eloop.send_queues[i]);
+    }
+    free(eloop.send_queues);
     free(eloop.signals);
+    if (eloop.signal_fd >= 0)
+    {
+        close(eloop.signal_fd);
+#if ELOOP_SIGNAL_PIPE
+        close(eloop.signal_pipe[1]);
+#else
+        sigprocmask(SIG_UNBLOCK, &eloop.signal_mask, NULL);
+#endif
+    }
+#if !ELOOP_SELECT
+    free(eloop.epoll_events);
+    free(eloop.fds);
+    if (eloop.epoll_fd >= 0)
+        close(eloop.epoll_fd);
+#endif
 }
 
 int eloop_terminated(void)
 {
     return eloop.terminate;
 }
+
+eloop_time_t eloop_update_time(void)
+{
+    eloop.now = eloop_clock();
+    return eloop.now;
+}
+
+eloop_time_t eloop_now(void)
+{
+    return eloop.now;
+}
+
+void eloop_get_stats(struct eloop_stats *stats)
+{
+    int i;
+
+    memcpy(stats, &eloop.stats, sizeof(*stats));
+    for (i = 0; i < eloop.send_queue_count; i++)
+        stats->send_queue_depth += eloop.send_queues[i]->count;
+    stats->uptime_secs = (eloop.now - eloop.start) / ELOOP_NSEC_PER_SEC;
+}
+
+#if ELOOP_PROFILE
+const struct eloop_loop_profile *eloop_get_loop_profile(void)
+{
+    return &eloop.loop_profile;
+}
+
+const struct eloop_handler_profile *eloop_get_handler_profile(int n)
+{
+    if (n < 0 || n >= eloop.handler_profile_count)
+        return NULL;
+    return &eloop.handler_profile[n];
+}
+#endif
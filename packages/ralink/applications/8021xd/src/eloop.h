@@ -4,6 +4,87 @@
 /* Magic number for eloop_cancel_timeout() */
 #define ELOOP_ALL_CTX (void *) -1
 
+struct eloop_timeout;
+
+/* Zero-delay work item, embedded in the object it works on. Scheduled work
+ * runs once after the socket handlers of the current loop pass, no matter
+ * how many times it was scheduled. Initialize with eloop_deferred_init(). */
+struct eloop_deferred
+{
+    struct eloop_deferred *next, *prev; /* NULL while not scheduled */
+    void (*handler)(void *eloop_ctx, void *user_data);
+    void *eloop_data;
+    void *user_data;
+};
+
+/* Event loop clock: CLOCK_MONOTONIC in nanoseconds. It does not jump when the
+ * wall clock is set (e.g. by NTP at boot). */
+typedef unsigned long long eloop_time_t;
+
+#define ELOOP_NSEC_PER_USEC     1000ULL
+#define ELOOP_NSEC_PER_MSEC     1000000ULL
+#define ELOOP_NSEC_PER_SEC      1000000000ULL
+
+/* Read socket priority classes. In each loop pass the ready sockets of a
+ * higher class (lower value) are served before those of a lower class. */
+#define ELOOP_PRIO_HIGH     0
+#define ELOOP_PRIO_NORMAL   1
+#define ELOOP_PRIO_CLASSES  2
+
+/* Timer lag histogram buckets: <1ms, <10ms, <100ms, <1s, >=1s */
+#define ELOOP_LAG_BUCKETS   5
+
+/* Event loop counters, see eloop_get_stats() */
+struct eloop_stats
+{
+    unsigned long timeouts_fired;
+    unsigned long timeout_batches; /* loop passes that fired timeouts */
+    unsigned long timeout_budget_hits; /* passes stopped by the budget */
+    unsigned long timeout_batch_max;
+    unsigned long long timeout_lag_total_us; /* sum of (fired - requested deadline) */
+    unsigned long timeout_lag_max_us;
+    unsigned long timeout_lag_hist[ELOOP_LAG_BUCKETS];
+    unsigned long timeouts_slack_shared; /* slack-rounded, fired in a pass after another */
+    unsigned long uptime_secs; /* since eloop_init() */
+    unsigned long send_queued; /* eloop_send() packets that had to wait */
+    unsigned long send_drops; /* dropped, outbound queue full */
+    unsigned long send_errors;
+    unsigned long send_queue_depth; /* packets waiting now, all sockets */
+    unsigned long send_queue_max; /* deepest single queue seen */
+    unsigned long deferred_run;
+    unsigned long deferred_merged; /* scheduled while already pending */
+    unsigned long prio_reads[ELOOP_PRIO_CLASSES]; /* read handler calls */
+    unsigned long prio_budget_hits[ELOOP_PRIO_CLASSES];
+};
+
+#if ELOOP_PROFILE
+/* Handler run time histogram: bucket 0 is < 1 us, bucket i >= 1 is
+ * [2^(i-1), 2^i) us, the last bucket is open-ended */
+#define ELOOP_PROFILE_BUCKETS   21
+/* Ready descriptors per wakeup: 0, 1, 2-3, 4-7, >= 8 */
+#define ELOOP_PROFILE_READY_BUCKETS 5
+/* Distinct handlers tracked; the last entry collects the rest */
+#define ELOOP_PROFILE_HANDLERS  32
+
+struct eloop_handler_profile
+{
+    void *handler;
+    const char *type; /* "read", "write", "timeout", "signal", ... */
+    unsigned long calls;
+    unsigned long long total_us;
+    unsigned long max_us;
+    unsigned long hist[ELOOP_PROFILE_BUCKETS];
+};
+
+struct eloop_loop_profile
+{
+    unsigned long iterations;
+    unsigned long long idle_us; /* blocked in select()/epoll_wait() */
+    unsigned long long busy_us; /* running handlers and bookkeeping */
+    unsigned long ready_hist[ELOOP_PROFILE_READY_BUCKETS];
+};
+#endif
+
 /* Initialize global event loop data - must be called before any other eloop_*
  * function. user_data is a pointer to global data structure and will be passed
  * as eloop_ctx to signal handlers. */
@@ -15,21 +96,87 @@ int eloop_register_read_sock(int sock,
                                      void *sock_ctx),
                              void *eloop_data, void *user_data);
 
-/* Register timeout */
+/* Register handler for read event with priority class prio (ELOOP_PRIO_*);
+ * eloop_register_read_sock() uses ELOOP_PRIO_NORMAL. */
+int eloop_register_read_sock_prio(int sock, int prio,
+                                  void (*handler)(int sock, void *eloop_ctx,
+                                          void *sock_ctx),
+                                  void *eloop_data, void *user_data);
+
+/* Unregister the read handler of sock and discard any packets eloop_send()
+ * still holds for it; call before closing the socket. */
+void eloop_unregister_read_sock(int sock);
+
+/* After every ready socket of class prio has been served once in a loop
+ * pass, sockets of the class that are still readable are served again until
+ * budget more handler calls have been made. 0 disables the extra reads. */
+void eloop_set_read_budget(int prio, int budget);
+
+/* Register handler for write event. The handler is called as long as the
+ * socket is writable, so unregister it once there is nothing left to send. */
+int eloop_register_write_sock(int sock,
+                              void (*handler)(int sock, void *eloop_ctx,
+                                      void *sock_ctx),
+                              void *eloop_data, void *user_data);
+void eloop_unregister_write_sock(int sock);
+
+/* Send a packet on a connected socket without blocking the event loop. If
+ * the socket buffer is full, a copy is queued (bounded per socket) and sent
+ * in order once the socket becomes writable. Returns -1 if the packet could
+ * be neither sent nor queued. */
+int eloop_send(int sock, const void *buf, size_t len);
+
+/* Register timeout.
+ * slack_ms allows the timeout to fire up to slack_ms milliseconds late; the
+ * deadline is rounded up to a multiple of slack_ms on the loop clock, so that
+ * timeouts with the same slack expire together in one wakeup. Use 0 for an
+ * exact deadline. */
 int eloop_register_timeout(unsigned int secs, unsigned int usecs,
+                           unsigned int slack_ms,
                            void (*handler)(void *eloop_ctx, void *timeout_ctx),
                            void *eloop_data, void *user_data);
 
+/* Register timeout and return a handle to it in *ref. eloop resets *ref to
+ * NULL when the timeout fires or is cancelled, so the handle can be kept in
+ * the caller's data structure. Registering with a handle that still refers to
+ * a pending timeout replaces that timeout. */
+int eloop_register_timeout_ref(unsigned int secs, unsigned int usecs,
+                               unsigned int slack_ms,
+                               void (*handler)(void *eloop_ctx, void *timeout_ctx),
+                               void *eloop_data, void *user_data,
+                               struct eloop_timeout **ref);
+
+/* Cancel the timeout referred to by *ref, if it is still pending; O(log n).
+ * Returns the number of cancelled timeouts (0 or 1). */
+int eloop_cancel_timeout_ref(struct eloop_timeout **ref);
+
 /* Cancel timeouts matching <handler,eloop_data,user_data>.
  * ELOOP_ALL_CTX can be used as a wildcard for cancelling all timeouts
  * regardless of eloop_data/user_data. */
 int eloop_cancel_timeout(void (*handler)(void *eloop_ctx, void *sock_ctx),
                          void *eloop_data, void *user_data);
 
+/* Limit the number of expired timeouts handled in one loop pass before
+ * sockets are polled again; 0 means no limit. */
+void eloop_set_timeout_budget(int budget);
+
+void eloop_deferred_init(struct eloop_deferred *work,
+                         void (*handler)(void *eloop_ctx, void *user_data),
+                         void *eloop_data, void *user_data);
+
+/* Schedule work for the end of the current loop pass; no-op if pending. */
+void eloop_schedule(struct eloop_deferred *work);
+
+/* Remove work from the run queue if it is pending. */
+void eloop_cancel_deferred(struct eloop_deferred *work);
+
 /* Register handler for signal.
  * Note: signals are 'global' events and there is no local eloop_data pointer
  * like with other handlers. The (global) pointer given to eloop_init() will be
- * used as eloop_ctx for signal handlers. */
+ * used as eloop_ctx for signal handlers.
+ * Signals are received through a signalfd (or a self-pipe when built with
+ * ELOOP_SIGNAL_PIPE=1), so the handler is called from eloop_run() like any
+ * socket handler and not in async signal context. */
 int eloop_register_signal(int sock,
                           void (*handler)(int sig, void *eloop_ctx,
                                   void *signal_ctx),
@@ -41,7 +188,12 @@ void eloop_run(void);
 
 /* Terminate event loop even if there are registered events. */
 void eloop_terminate(void);
+
+/* Request a reload. The handler registered with eloop_register_reload() is
+ * called once, after all handlers of the current loop pass have returned. */
 void eloop_reload(void);
+void eloop_register_reload(void (*handler)(void *eloop_ctx, void *user_data),
+                           void *user_data);
 
 /* Free any reserved resources. After calling eloop_destoy(), other eloop_*
  * functions must not be called before re-running eloop_init(). */
@@ -50,4 +202,21 @@ void eloop_destroy(void);
 /* Check whether event loop has been terminated. */
 int eloop_terminated(void);
 
+/* Loop clock cached at the start of the current loop pass; timeouts are
+ * relative to it. */
+eloop_time_t eloop_now(void);
+
+/* Re-read the monotonic clock into the cached loop clock and return it. */
+eloop_time_t eloop_update_time(void);
+
+/* Copy the current event loop counters to *stats. */
+void eloop_get_stats(struct eloop_stats *stats);
+
+#if ELOOP_PROFILE
+/* Profiling data, only with ELOOP_PROFILE=1. eloop_get_handler_profile()
+ * returns the n-th handler entry or NULL past the last one. */
+const struct eloop_loop_profile *eloop_get_loop_profile(void);
+const struct eloop_handler_profile *eloop_get_handler_profile(int n);
+#endif
+
 #endif /* ELOOP_H */
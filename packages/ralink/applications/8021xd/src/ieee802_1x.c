@@ -22,8 +22,11 @@
 #include "md5.h"
 #include "eloop.h"
 #include "sta_info.h"
+#include "pool.h"
+#include "checkpoint.h"
 
-static void ieee802_1x_send(rtapd *rtapd, struct sta_info *sta, u8 type, u8 *data, size_t datalen)
+static void ieee802_1x_send_raw(rtapd *rtapd, u8 *addr, u8 apidx, u16 ethertype, int sock,
+                                u8 type, u8 *data, size_t datalen)
 {
     char *buf;
     struct ieee8023_hdr *hdr3;
@@ -38,20 +41,20 @@ static void ieee802_1x_send(rtapd *rtapd, struct sta_info *sta, u8 type, u8 *dat
         DBGPRINT(RT_DEBUG_ERROR,"malloc() failed for ieee802_1x_send(len=%d)\n", len);
         return;
     }
-    DBGPRINT(RT_DEBUG_TRACE,"Send to Sta(%s%d) with Identifier %d\n", rtapd->prefix_wlan_name, sta->ApIdx,*(data+1));
+    DBGPRINT(RT_DEBUG_TRACE,"Send to Sta(%s%d) with Identifier %d\n", rtapd->prefix_wlan_name, apidx, *(data+1));
     memset(buf, 0, len);
     hdr3 = (struct ieee8023_hdr *) buf;
-    memcpy(hdr3->dAddr, sta->addr, ETH_ALEN);
-    memcpy(hdr3->sAddr, rtapd->own_addr[sta->ApIdx], ETH_ALEN);
+    memcpy(hdr3->dAddr, addr, ETH_ALEN);
+    memcpy(hdr3->sAddr, rtapd->own_addr[apidx], ETH_ALEN);
 
-    if (sta->ethertype == ETH_P_PRE_AUTH)
+    if (ethertype == ETH_P_PRE_AUTH)
         (hdr3->eth_type) = htons(ETH_P_PRE_AUTH);
     else
         (hdr3->eth_type) = htons(ETH_P_PAE);
 
     pos = (u8 *) (hdr3 + 1);
     xhdr = (struct ieee802_1x_hdr *) pos;
-    if (sta->ethertype == ETH_P_PRE_AUTH)
+    if (ethertype == ETH_P_PRE_AUTH)
         xhdr->version = EAPOL_VERSION_2;
     else
         xhdr->version = EAPOL_VERSION;
@@ -62,9 +65,9 @@ static void ieee802_1x_send(rtapd *rtapd, struct sta_info *sta, u8 type, u8 *dat
         memcpy(pos + LENGTH_8021X_HDR, data, datalen);
 
     //If (ethertype==ETH_P_PRE_AUTH), this means the packet is to or from ehternet socket(WPA2, pre-auth)
-    if (sta->ethertype == ETH_P_PRE_AUTH)
+    if (ethertype == ETH_P_PRE_AUTH)
     {
-        if (send(sta->SockNum/*rtapd->eth_sock*/, buf, len, 0) < 0)
+        if (eloop_send(sock/*rtapd->eth_sock*/, buf, len) < 0)
             perror("send[WPA2 pre-auth]");
         DBGPRINT(RT_DEBUG_INFO,"ieee802_1x_send::WPA2, pre-auth, len=%d\n", len);
     }
@@ -72,7 +75,7 @@ static void ieee802_1x_send(rtapd *rtapd, struct sta_info *sta, u8 type, u8 *dat
     {
         if (RT_ioctl(rtapd->ioctl_sock,
                      RT_PRIV_IOCTL, buf, len,
-                     rtapd->prefix_wlan_name, sta->ApIdx,
+                     rtapd->prefix_wlan_name, apidx,
                      RT_OID_802_DOT1X_RADIUS_DATA))
             DBGPRINT(RT_DEBUG_ERROR,"ioctl failed for ieee802_1x_send(len=%d)\n", len);
     }
@@ -80,48 +83,73 @@ static void ieee802_1x_send(rtapd *rtapd, struct sta_info *sta, u8 type, u8 *dat
     free(buf);
 }
 
+static void ieee802_1x_send(rtapd *rtapd, struct sta_info *sta, u8 type, u8 *data, size_t datalen)
+{
+    ieee802_1x_send_raw(rtapd, sta->addr, sta->ApIdx, sta->ethertype, sta->SockNum, type, data, datalen);
+}
+
+static int ieee802_1x_static_wep_copy(rtapd *rtapd, struct sta_info *sta)
+{
+    UCHAR   MacAddr[MAC_ADDR_LEN];
+
+    memcpy(MacAddr, sta->addr, MAC_ADDR_LEN);
+    if (RT_ioctl(rtapd->ioctl_sock,
+                 RT_PRIV_IOCTL,
+                 (char *)&MacAddr, sizeof(MacAddr),
+                 rtapd->prefix_wlan_name, sta->ApIdx,
+                 RT_OID_802_DOT1X_STATIC_WEP_COPY))
+    {
+        DBGPRINT(RT_DEBUG_ERROR,"Failed to RT_OID_802_DOT1X_STATIC_WEP_COPY\n");
+        return -1;
+    }
+
+    return 0;
+}
+
 void ieee802_1x_set_sta_authorized(rtapd *rtapd, struct sta_info *sta, int authorized)
 {
+    Ap_sta_port_changed(rtapd, sta);
+
     switch(authorized)
     {
         case 0:
             DBGPRINT(RT_DEBUG_TRACE,"IEEE802_1X_Set_Sta_Authorized FAILED \n");
+            Checkpoint_sta_drop(rtapd, sta);
 //            Ap_free_sta(rtapd, sta);
             break;
 
         case 1:
             DBGPRINT(RT_DEBUG_TRACE,"IEEE802_1X_Set_Sta_Authorized SUCCESSED  \n");
+            Checkpoint_sta_save(rtapd, sta);
 
             // This connection completed without transmitting EAPoL-Key
             // Notify driver to set-up pairwise key based on its shared key
-            if( sta->eapol_sm->authSuccess && sta->eapol_key_sign_len == 0 && sta->eapol_key_crypt_len == 0 )
-            {
-                UCHAR   MacAddr[MAC_ADDR_LEN];
-
-                memcpy(MacAddr, sta->addr, MAC_ADDR_LEN);
-                if (RT_ioctl(rtapd->ioctl_sock,
-                             RT_PRIV_IOCTL,
-                             (char *)&MacAddr, sizeof(MacAddr),
-                             rtapd->prefix_wlan_name, sta->ApIdx,
-                             RT_OID_802_DOT1X_STATIC_WEP_COPY))
-                {
-                    DBGPRINT(RT_DEBUG_ERROR,"Failed to RT_OID_802_DOT1X_STATIC_WEP_COPY\n");
-                    return;
-                }
-            }
+            if( sta->eapol_sm.authSuccess && sta->eapol_key_sign_len == 0 && sta->eapol_key_crypt_len == 0 )
+                ieee802_1x_static_wep_copy(rtapd, sta);
             break;
     }
 }
 
-void ieee802_1x_request_identity(rtapd *rtapd, struct sta_info *sta, u8 id)
+/* Hand the port of a station taken over from the checkpoint back to the
+ * driver, which lost it with the restart: the same ioctls as after a
+ * successful authentication. A station with keys gets a new EAPOL-Key pair,
+ * signed and encrypted with the keys it still holds. */
+int ieee802_1x_reinstall_sta(rtapd *rtapd, struct sta_info *sta)
+{
+    if (sta->eapol_key_sign && sta->eapol_key_crypt)
+        return ieee802_1x_tx_key(rtapd, sta, sta->eapol_sm.currentId);
+
+    return ieee802_1x_static_wep_copy(rtapd, sta);
+}
+
+static void ieee802_1x_send_identity_request(rtapd *rtapd, u8 *addr, u8 apidx, u16 ethertype,
+                                             int sock, u8 id)
 {
     u8 *buf;
     struct eap_hdr *eap;
     int tlen;
     u8 *pos;
 
-    ieee802_1x_new_auth_session(rtapd, sta);
-
     tlen = sizeof(*eap) + 1 ;
 
     buf = (u8 *) malloc(tlen);
@@ -141,10 +169,16 @@ void ieee802_1x_request_identity(rtapd *rtapd, struct sta_info *sta, u8 id)
     *pos++ = EAP_TYPE_IDENTITY;
 
     DBGPRINT(RT_DEBUG_INFO, "IEEE802_1X_Request_Identity %d bytes: \n",tlen);
-    ieee802_1x_send(rtapd, sta, IEEE802_1X_TYPE_EAP_PACKET, buf, tlen);
+    ieee802_1x_send_raw(rtapd, addr, apidx, ethertype, sock, IEEE802_1X_TYPE_EAP_PACKET, buf, tlen);
     free(buf);
 }
 
+void ieee802_1x_request_identity(rtapd *rtapd, struct sta_info *sta, u8 id)
+{
+    ieee802_1x_new_auth_session(rtapd, sta);
+    ieee802_1x_send_identity_request(rtapd, sta->addr, sta->ApIdx, sta->ethertype, sta->SockNum, id);
+}
+
 void ieee802_1x_tx_canned_eap(rtapd *rtapd, struct sta_info *sta, u8 id, int success)
 {
     struct eap_hdr eap;
@@ -257,13 +291,13 @@ static void ieee802_1x_tx_key_one(rtapd *hapd, struct sta_info *sta,
     free(buf);
 }
 
-void ieee802_1x_tx_key(rtapd *rtapd, struct sta_info *sta, u8 id)
+int ieee802_1x_tx_key(rtapd *rtapd, struct sta_info *sta, u8 id)
 {
     NDIS_802_11_KEY     WepKey, *pWepKey;
     char individual_wep_key[WEP8021X_KEY_LEN];
 
     if (!sta->eapol_key_sign || !sta->eapol_key_crypt)
-        return;
+        return 0;
 
     memset(&WepKey, 0, sizeof(NDIS_802_11_KEY));
     pWepKey = &WepKey;
@@ -288,7 +322,7 @@ void ieee802_1x_tx_key(rtapd *rtapd, struct sta_info *sta, u8 id)
                      RT_OID_802_DOT1X_PMKID_CACHE))
         {
             DBGPRINT(RT_DEBUG_ERROR, "ieee802_1x_tx_key:RT_OID_802_DOT1X_PMKID_CACHE\n");
-            return;
+            return -1;
         }
     }
     else
@@ -302,7 +336,7 @@ void ieee802_1x_tx_key(rtapd *rtapd, struct sta_info *sta, u8 id)
                      RT_OID_802_DOT1X_WPA_KEY))
         {
             DBGPRINT(RT_DEBUG_ERROR,"ieee802_1x_tx_key:RT_OID_802_DOT1X_WPA_KEY\n");
-            return;
+            return -1;
         }
     }
 
@@ -327,7 +361,7 @@ void ieee802_1x_tx_key(rtapd *rtapd, struct sta_info *sta, u8 id)
                      RT_OID_802_DOT1X_PMKID_CACHE))
         {
             DBGPRINT(RT_DEBUG_ERROR,"ieee802_1x_tx_key:RT_OID_802_DOT1X_PMKID_CACHE\n");
-            return;
+            return -1;
         }
     }
     else
@@ -341,19 +375,24 @@ void ieee802_1x_tx_key(rtapd *rtapd, struct sta_info *sta, u8 id)
                      RT_OID_802_DOT1X_WPA_KEY))
         {
             DBGPRINT(RT_DEBUG_ERROR,"ieee802_1x_tx_key:RT_OID_802_DOT1X_WPA_KEY\n");
-            return;
+            return -1;
         }
     }
+
+    return 0;
 }
 
 static void ieee802_1x_encapsulate_radius(rtapd *rtapd, struct sta_info *sta, u8 *eap, size_t len)
 {
     struct radius_msg *msg;
     u8 buf[128];
-    int res;
 
-    sta->radius_identifier = Radius_client_get_id(rtapd);
-    msg = Radius_msg_new(RADIUS_CODE_ACCESS_REQUEST, sta->radius_identifier);
+    /* a reply to the previous request is of no use any more */
+    if (sta->radius_request >= 0)
+        Radius_client_release(rtapd, sta->radius_request, sta);
+    sta->radius_request = -1;
+    /* the identifier is picked by Radius_client_send() */
+    msg = Radius_msg_new(RADIUS_CODE_ACCESS_REQUEST, 0);
     if (msg == NULL)
     {
         DBGPRINT(RT_DEBUG_ERROR, "Could not create net RADIUS packet\n");
@@ -443,8 +482,8 @@ static void ieee802_1x_encapsulate_radius(rtapd *rtapd, struct sta_info *sta, u8
         }
     }
 
-    res = Radius_client_send(rtapd, msg, RADIUS_AUTH, sta->ApIdx);
-    DBGPRINT(RT_DEBUG_TRACE, "Finish Radius_client_send..(%d)\n", res);
+    Radius_client_send(rtapd, msg, RADIUS_AUTH, sta->ApIdx, sta, &sta->radius_request);
+    DBGPRINT(RT_DEBUG_TRACE, "Finish Radius_client_send..(%d)\n", sta->radius_request);
 
     return;
 
@@ -457,31 +496,33 @@ static void handle_eap_response(struct sta_info *sta, struct eap_hdr *eap, u8 *d
 {
     u8 type;
 
-    assert(sta->eapol_sm != NULL);
+    assert(sta->eapol_sm.in_use);
 
-    if (eap->identifier != sta->eapol_sm->currentId)
+    if (eap->identifier != sta->eapol_sm.currentId)
     {
         DBGPRINT(RT_DEBUG_INFO,"EAP Identifier of the Response-Identity from " MACSTR
                  " does not match (was %d, expected %d)\n",
                  MAC2STR(sta->addr), eap->identifier,
-                 sta->eapol_sm->currentId);
+                 sta->eapol_sm.currentId);
         // didn't check identifier..  reasonable ?
         return;
     }
 
+    eapol_sm_rtt_sample(&sta->eapol_sm);
+
     if (len < 1)
     {
         DBGPRINT(RT_DEBUG_WARN,"too short response data\n");
         return;
     }
 
-    if (sta->last_eap_supp != NULL)
-        free(sta->last_eap_supp);
     sta->last_eap_supp_len = sizeof(*eap) + len;
-    sta->last_eap_supp = (u8 *) malloc(sta->last_eap_supp_len);
+    sta->last_eap_supp = Pool_buf_resize(sta->last_eap_supp, &sta->last_eap_supp_size,
+                                         sta->last_eap_supp_len);
     if (sta->last_eap_supp == NULL)
     {
         DBGPRINT(RT_DEBUG_ERROR,"Could not alloc memory for last EAP Response\n");
+        sta->last_eap_supp_len = 0;
         return;
     }
 
@@ -518,23 +559,19 @@ static void handle_eap_response(struct sta_info *sta, struct eap_hdr *eap, u8 *d
             free(buf);
         }
 
-        sta->eapol_sm->auth_pae.rxInitialRsp = TRUE;
+        sta->eapol_sm.auth_pae.rxInitialRsp = TRUE;
 
         /* Save station identity for future RADIUS packets */
+        sta->identity = Pool_buf_resize(sta->identity, &sta->identity_size, len);
+        sta->identity_len = sta->identity ? len : 0;
         if (sta->identity)
-            free(sta->identity);
-        sta->identity = (u8 *) malloc(len);
-        if (sta->identity)
-        {
             memcpy(sta->identity, data, len);
-            sta->identity_len = len;
-        }
     }
     else
     {
         if (type != EAP_TYPE_NAK)
-            sta->eapol_sm->be_auth.backendNonNakResponsesFromSupplicant++;
-        sta->eapol_sm->be_auth.rxResp = TRUE;
+            EAPOL_SM_COUNT(&sta->eapol_sm, backendNonNakResponsesFromSupplicant);
+        sta->eapol_sm.be_auth.rxResp = TRUE;
     }
 }
 
@@ -592,6 +629,100 @@ static void handle_eap(struct sta_info *sta, u8 *buf, size_t len)
     }
 }
 
+static int admit_take(struct admit_bucket *b, unsigned int rate, unsigned int burst)
+{
+    eloop_time_t now = eloop_now(), interval = ELOOP_NSEC_PER_SEC / rate;
+    eloop_time_t refill;
+
+    if (now - b->stamp >= burst * interval)
+    {
+        b->tokens = burst;
+        b->stamp = now;
+    }
+    else
+    {
+        refill = (now - b->stamp) / interval;
+        b->tokens += refill;
+        b->stamp += refill * interval;
+        if (b->tokens >= burst)
+        {
+            b->tokens = burst;
+            b->stamp = now;
+        }
+    }
+
+    if (b->tokens == 0)
+        return 0;
+    b->tokens--;
+    return 1;
+}
+
+/* Admission control against EAPOL floods, before any station is allocated.
+ * Only frames that create a station or restart its authentication are
+ * charged, so an authentication in progress is never throttled. */
+static int ieee802_1x_admit(rtapd *rtapd, struct sta_info *sta, u8 *sa, u8 apidx, u8 type)
+{
+    if (sta && type != IEEE802_1X_TYPE_EAPOL_START)
+        return 1;
+
+    /* keyed, so that a flood cannot pick addresses that share a bucket
+     * with a victim station */
+    if (!admit_take(&rtapd->admit_mac[Ap_sta_hash(rtapd, sa) % ADMIT_MAC_BUCKETS],
+                    ADMIT_MAC_RATE, ADMIT_MAC_BURST))
+    {
+        rtapd->admit_mac_drops++;
+        DBGPRINT(RT_DEBUG_INFO, "Drop EAPOL type %d from " MACSTR ": over per-MAC rate\n", type, MAC2STR(sa));
+        return 0;
+    }
+
+    if (apidx >= MAX_MBSSID_NUM ||
+        !admit_take(&rtapd->admit_bss[apidx], ADMIT_BSS_RATE, ADMIT_BSS_BURST))
+    {
+        rtapd->admit_bss_drops++;
+        DBGPRINT(RT_DEBUG_INFO, "Drop EAPOL type %d from " MACSTR ": over per-BSS rate\n", type, MAC2STR(sa));
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Stations that are not known yet are answered statelessly: the identifier
+ * of their Request-Identity is a keyed hash of their address and the current
+ * period, and only a Response-Identity carrying it creates the station. */
+static u8 ieee802_1x_cookie(rtapd *rtapd, u8 *sa, u8 apidx, u32 period)
+{
+    u8 data[ETH_ALEN + 1 + sizeof(period)], mac[16];
+
+    memcpy(data, sa, ETH_ALEN);
+    data[ETH_ALEN] = apidx;
+    memcpy(data + ETH_ALEN + 1, &period, sizeof(period));
+    hmac_md5(rtapd->cookie_secret, sizeof(rtapd->cookie_secret), data, sizeof(data), mac);
+
+    return mac[0];
+}
+
+static u32 ieee802_1x_cookie_period(void)
+{
+    return eloop_now() / (COOKIE_PERIOD * ELOOP_NSEC_PER_SEC);
+}
+
+/* returns the identifier of a valid Response-Identity, or -1 */
+static int ieee802_1x_cookie_check(rtapd *rtapd, u8 *sa, u8 apidx, u8 *buf, size_t len)
+{
+    struct eap_hdr *eap = (struct eap_hdr *) buf;
+    u32 period = ieee802_1x_cookie_period();
+
+    if (len < sizeof(*eap) + 1 || eap->code != EAP_CODE_RESPONSE ||
+        buf[sizeof(*eap)] != EAP_TYPE_IDENTITY)
+        return -1;
+
+    if (eap->identifier != ieee802_1x_cookie(rtapd, sa, apidx, period) &&
+        eap->identifier != ieee802_1x_cookie(rtapd, sa, apidx, period - 1))
+        return -1;
+
+    return eap->identifier;
+}
+
 /* called from handle_read(). Process the EAPOL frames from the Supplicant */
 void ieee802_1x_receive(
     rtapd *rtapd,
@@ -606,12 +737,13 @@ void ieee802_1x_receive(
     struct ieee802_1x_hdr *hdr;
     char SNAP_802_1H[] = {0xaa, 0xaa, 0x03, 0x00, 0x00, 0x00};
     u16 datalen;
+    int id = -1;
 
     DBGPRINT(RT_DEBUG_TRACE,"IEEE802_1X_RECEIVE : from Supplicant\n");
 
-    sta = Ap_get_sta(rtapd, sa, apidx, ethertype, SockNum);
-    if (!sta)
+    if (len < sizeof(*hdr))
     {
+        DBGPRINT(RT_DEBUG_ERROR,"Frame too short for an IEEE 802.1X header\n");
         return;
     }
     if (RTMPCompareMemory(buf, SNAP_802_1H, 6) == 0)
@@ -619,6 +751,38 @@ void ieee802_1x_receive(
     hdr = (struct ieee802_1x_hdr *) buf;
     datalen = ntohs(hdr->length);
 
+    sta = Ap_find_sta(rtapd, sa);
+    if (!ieee802_1x_admit(rtapd, sta, sa, *apidx, hdr->type))
+        return;
+
+    if (sta == NULL)
+    {
+        if (hdr->type == IEEE802_1X_TYPE_EAPOL_START)
+        {
+            DBGPRINT(RT_DEBUG_TRACE,"Handle EAPOL_START from unknown " MACSTR "\n", MAC2STR(sa));
+            ieee802_1x_send_identity_request(rtapd, sa, *apidx, ethertype, SockNum,
+                                             ieee802_1x_cookie(rtapd, sa, *apidx, ieee802_1x_cookie_period()));
+            rtapd->cookie_requests++;
+            return;
+        }
+
+        if (hdr->type != IEEE802_1X_TYPE_EAP_PACKET || datalen > len - sizeof(*hdr))
+            return;
+        id = ieee802_1x_cookie_check(rtapd, sa, *apidx, buf + LENGTH_8021X_HDR, datalen);
+        if (id < 0)
+        {
+            DBGPRINT(RT_DEBUG_INFO,"Drop EAP packet from unknown " MACSTR "\n", MAC2STR(sa));
+            return;
+        }
+        rtapd->cookie_accepts++;
+    }
+
+    sta = Ap_get_sta(rtapd, sa, apidx, ethertype, SockNum);
+    if (!sta)
+    {
+        return;
+    }
+
     if (len - sizeof(*hdr) < datalen)
     {
         DBGPRINT(RT_DEBUG_ERROR,"Frame too short for this IEEE 802.1X packet\n");
@@ -629,12 +793,10 @@ void ieee802_1x_receive(
     {
     }
 
-    if (!sta->eapol_sm)
-    {
-        sta->eapol_sm = eapol_sm_alloc(rtapd, sta);
-        if (!sta->eapol_sm)
-            return;
-    }
+    if (!sta->eapol_sm.in_use)
+        eapol_sm_init(rtapd, sta);
+    if (id >= 0)
+        eapol_sm_connecting(rtapd, &sta->eapol_sm, id);
 
     /* Check protocol type */
     if ((ethertype != ETH_P_PAE) && (ethertype != ETH_P_PRE_AUTH))
@@ -659,13 +821,11 @@ void ieee802_1x_receive(
 
         case IEEE802_1X_TYPE_EAPOL_START:
             DBGPRINT(RT_DEBUG_TRACE,"Handle EAPOL_START from %s%d\n", rtapd->prefix_wlan_name, sta->ApIdx);
-            sta->eapol_sm->auth_pae.eapStart = TRUE;
-            eapol_sm_step(sta->eapol_sm);
+            sta->eapol_sm.auth_pae.eapStart = TRUE;
             break;
 
         case IEEE802_1X_TYPE_EAPOL_LOGOFF:
-            sta->eapol_sm->auth_pae.eapLogoff = TRUE;
-            eapol_sm_step(sta->eapol_sm);
+            sta->eapol_sm.auth_pae.eapLogoff = TRUE;
             break;
 
         case IEEE802_1X_TYPE_EAPOL_ENCAPSULATED_ASF_ALERT:
@@ -678,21 +838,20 @@ void ieee802_1x_receive(
             break;
     }
 
-    eapol_sm_step(sta->eapol_sm);
+    eapol_sm_schedule_step(&sta->eapol_sm);
 }
 
 void ieee802_1x_new_station(rtapd *rtapd, struct sta_info *sta)
 {
-    if (sta->eapol_sm)
+    if (sta->eapol_sm.in_use)
     {
-        sta->eapol_sm->portEnabled = TRUE;
-        eapol_sm_step(sta->eapol_sm);
+        sta->eapol_sm.portEnabled = TRUE;
+        eapol_sm_schedule_step(&sta->eapol_sm);
         return;
     }
 
-    sta->eapol_sm = eapol_sm_alloc(rtapd, sta);
-    if (sta->eapol_sm)
-        sta->eapol_sm->portEnabled = TRUE;
+    eapol_sm_init(rtapd, sta);
+    sta->eapol_sm.portEnabled = TRUE;
 }
 
 void ieee802_1x_free_station(struct sta_info *sta)
@@ -704,13 +863,13 @@ void ieee802_1x_free_station(struct sta_info *sta)
         sta->last_recv_radius = NULL;
     }
 
-    free(sta->last_eap_supp);
+    Pool_buf_free(sta->last_eap_supp, sta->last_eap_supp_size);
     sta->last_eap_supp = NULL;
 
-    free(sta->last_eap_radius);
+    Pool_buf_free(sta->last_eap_radius, sta->last_eap_radius_size);
     sta->last_eap_radius = NULL;
 
-    free(sta->identity);
+    Pool_buf_free(sta->identity, sta->identity_size);
     sta->identity = NULL;
 
     free(sta->eapol_key_sign);
@@ -719,8 +878,7 @@ void ieee802_1x_free_station(struct sta_info *sta)
     free(sta->eapol_key_crypt);
     sta->eapol_key_crypt = NULL;
 
-    eapol_sm_free(sta->eapol_sm);
-    sta->eapol_sm = NULL;
+    eapol_sm_deinit(&sta->eapol_sm);
 }
 
 static void ieee802_1x_decapsulate_radius(struct sta_info *sta)
@@ -735,34 +893,35 @@ static void ieee802_1x_decapsulate_radius(struct sta_info *sta)
         return;
 
     msg = sta->last_recv_radius;
-    eap = Radius_msg_get_eap(msg, &len);
-    if (eap == NULL)
+    len = Radius_msg_copy_eap(msg, NULL, 0);
+    if (len == 0)
     {
         /* draft-aboba-radius-rfc2869bis-20.txt, Chap. 2.6.3:
          * RADIUS server SHOULD NOT send Access-Reject/no EAP-Message
          * attribute */
-        free(sta->last_eap_radius);
+        Pool_buf_free(sta->last_eap_radius, sta->last_eap_radius_size);
         sta->last_eap_radius = NULL;
         sta->last_eap_radius_len = 0;
         return;
     }
 
     if (len < sizeof(*hdr))
-    {
-        free(eap);
         return;
-    }
+
+    /* reuse the buffer of the previous round */
+    eap = Pool_buf_resize(sta->last_eap_radius, &sta->last_eap_radius_size, len);
+    sta->last_eap_radius = eap;
+    sta->last_eap_radius_len = 0;
+    if (eap == NULL)
+        return;
+    Radius_msg_copy_eap(msg, eap, len);
 
     if (len > sizeof(*hdr))
         eap_type = eap[sizeof(*hdr)];
 
     hdr = (struct eap_hdr *) eap;
 
-    sta->eapol_sm->be_auth.idFromServer = hdr->identifier;
-
-    if (sta->last_eap_radius)
-        free(sta->last_eap_radius);
-    sta->last_eap_radius = eap;
+    sta->eapol_sm.be_auth.idFromServer = hdr->identifier;
     sta->last_eap_radius_len = len;
 }
 
@@ -846,7 +1005,7 @@ static void ieee802_1x_get_keys(rtapd *rtapd, struct sta_info *sta,
             sta->eapol_key_sign_len = keys->send_len;
             sta->eapol_key_crypt = keys->recv;
             sta->eapol_key_crypt_len = keys->recv_len;
-            sta->eapol_sm->keyAvailable = TRUE;
+            sta->eapol_sm.keyAvailable = TRUE;
         }
         else
         {
@@ -860,16 +1019,17 @@ static void ieee802_1x_get_keys(rtapd *rtapd, struct sta_info *sta,
 /* Process the RADIUS frames from Authentication Server */
 static RadiusRxResult
 ieee802_1x_receive_auth(rtapd *rtapd, struct radius_msg *msg, struct radius_msg *req,
-                        u8 *shared_secret, size_t shared_secret_len, void *data)
+                        u8 *shared_secret, size_t shared_secret_len, void *owner, void *data)
 {
-    struct sta_info *sta;
+    struct sta_info *sta = owner;
     u32 session_timeout = 0, idle_timeout = 0, termination_action;
     int session_timeout_set, idle_timeout_set;
     int free_flag = 0;
 
     DBGPRINT(RT_DEBUG_TRACE,"Receive IEEE802_1X Response Packet From Radius Server. \n");
 
-    sta = Ap_get_sta_radius_identifier(rtapd, msg->hdr->identifier);
+    /* Radius_client_release() clears the owner of a superseded request, so
+     * this answers the station's current one */
     if (sta == NULL)
     {
         return RADIUS_RX_UNKNOWN;
@@ -896,8 +1056,6 @@ ieee802_1x_receive_auth(rtapd *rtapd, struct radius_msg *msg, struct radius_msg
         return RADIUS_RX_UNKNOWN;
     }
 
-    sta->radius_identifier = -1;
-
     if (sta->last_recv_radius)
     {
         Radius_msg_free(sta->last_recv_radius);
@@ -923,7 +1081,7 @@ ieee802_1x_receive_auth(rtapd *rtapd, struct radius_msg *msg, struct radius_msg
             if (session_timeout_set && termination_action == RADIUS_TERMINATION_ACTION_RADIUS_REQUEST)
             {
                 DBGPRINT(RT_DEBUG_TRACE,"AP_REAUTH_TIMEOUT %d seconds \n", session_timeout);
-                sta->eapol_sm->reauth_timer.reAuthPeriod =  session_timeout;
+                sta->eapol_sm.reauth_timer.reAuthPeriod =  session_timeout;
             }
             else if (session_timeout_set && (rtapd->conf->session_timeout_set == 1))   // 1 1
             {
@@ -939,7 +1097,7 @@ ieee802_1x_receive_auth(rtapd *rtapd, struct radius_msg *msg, struct radius_msg
             }
             else  // 0 0
                 free_flag = 1;
-            sta->eapol_sm->be_auth.aSuccess = TRUE;
+            sta->eapol_sm.be_auth.aSuccess = TRUE;
 
             /* Set idle timeout */
             if (idle_timeout_set)
@@ -950,7 +1108,7 @@ ieee802_1x_receive_auth(rtapd *rtapd, struct radius_msg *msg, struct radius_msg
 
         case RADIUS_CODE_ACCESS_REJECT:
             DBGPRINT(RT_DEBUG_WARN, "AS send RADIUS_CODE_ACCESS_REJECT\n");
-            sta->eapol_sm->be_auth.aFail = TRUE;
+            sta->eapol_sm.be_auth.aFail = TRUE;
             break;
 
         case RADIUS_CODE_ACCESS_CHALLENGE:
@@ -958,18 +1116,22 @@ ieee802_1x_receive_auth(rtapd *rtapd, struct radius_msg *msg, struct radius_msg
             {
                 /* RFC 2869, Ch. 2.3.2
                  * draft-congdon-radius-8021x-22.txt, Ch. 3.17 */
-                sta->eapol_sm->be_auth.suppTimeout = session_timeout;
+                sta->eapol_sm.be_auth.suppTimeout = session_timeout;
             }
-            sta->eapol_sm->be_auth.aReq = TRUE;
+            sta->eapol_sm.be_auth.aReq = TRUE;
             break;
     }
 
     ieee802_1x_decapsulate_radius(sta);
-    eapol_sm_step(sta->eapol_sm);
-
 
+    /* the station is freed right away, so step it now */
     if (free_flag == 1)
+    {
+        eapol_sm_step(rtapd, &sta->eapol_sm);
         Ap_free_sta(rtapd, sta);
+    }
+    else
+        eapol_sm_schedule_step(&sta->eapol_sm);
     return RADIUS_RX_QUEUED;
 }
 
@@ -150,9 +150,10 @@ void ieee802_1x_free_station(struct sta_info *sta);
 void ieee802_1x_request_identity(rtapd *apd, struct sta_info *sta, u8 id);
 void ieee802_1x_tx_canned_eap(rtapd *apd, struct sta_info *sta, u8 id, int success);
 void ieee802_1x_tx_req(rtapd *apd, struct sta_info *sta, u8 id);
-void ieee802_1x_tx_key(rtapd *hapd, struct sta_info *sta, u8 id);
+int ieee802_1x_tx_key(rtapd *hapd, struct sta_info *sta, u8 id);
 void ieee802_1x_send_resp_to_server(rtapd *apd, struct sta_info *sta);
 void ieee802_1x_set_sta_authorized(rtapd *rtapd, struct sta_info *sta, int authorized);
+int ieee802_1x_reinstall_sta(rtapd *rtapd, struct sta_info *sta);
 int ieee802_1x_init(rtapd *apd);
 void ieee802_1x_new_auth_session(rtapd *apd, struct sta_info *sta);
 
@@ -0,0 +1,210 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "rtdot1x.h"
+#include "pool.h"
+
+struct pool_chunk
+{
+    struct pool_chunk *next;
+    struct sta_info sta[POOL_STA_CHUNK];
+};
+
+static struct pool_chunk *sta_chunks;
+static struct sta_info *sta_free; /* linked through sta->next */
+static u8 *buf_free[POOL_BUF_CLASSES]; /* linked through the first bytes */
+static void *timeout_free; /* linked through the first bytes */
+static struct pool_stats stats;
+
+struct sta_info *Pool_sta_alloc(void)
+{
+    struct pool_chunk *chunk;
+    struct sta_info *sta;
+    int i;
+
+    if (sta_free == NULL)
+    {
+        chunk = (struct pool_chunk *) malloc(sizeof(*chunk));
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = sta_chunks;
+        sta_chunks = chunk;
+        stats.sta_chunks++;
+
+        for (i = POOL_STA_CHUNK - 1; i >= 0; i--)
+        {
+            chunk->sta[i].next = sta_free;
+            sta_free = &chunk->sta[i];
+        }
+    }
+
+    sta = sta_free;
+    sta_free = sta->next;
+    memset(sta, 0, sizeof(*sta));
+    stats.sta_in_use++;
+    stats.sta_allocs++;
+
+    return sta;
+}
+
+void Pool_sta_free(struct sta_info *sta)
+{
+    sta->next = sta_free;
+    sta_free = sta;
+    stats.sta_in_use--;
+}
+
+static int Pool_buf_class(size_t size)
+{
+    size_t class_size = POOL_BUF_MIN_SIZE;
+    int i;
+
+    for (i = 0; i < POOL_BUF_CLASSES; i++, class_size *= 4)
+    {
+        if (size <= class_size)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Returns a buffer of at least len bytes; its real size is stored in *size
+ * and must be given back to Pool_buf_free() */
+u8 *Pool_buf_alloc(size_t len, size_t *size)
+{
+    int class = Pool_buf_class(len);
+    u8 *buf;
+
+    if (class < 0)
+    {
+        buf = (u8 *) malloc(len);
+        if (buf)
+            stats.buf_oversize++;
+        *size = buf ? len : 0;
+        return buf;
+    }
+
+    stats.buf_allocs[class]++;
+    *size = (size_t) POOL_BUF_MIN_SIZE << (2 * class);
+
+    buf = buf_free[class];
+    if (buf)
+    {
+        buf_free[class] = *(u8 **) buf;
+        stats.buf_free[class]--;
+        stats.buf_reused[class]++;
+        return buf;
+    }
+
+    buf = (u8 *) malloc(*size);
+    if (buf == NULL)
+    {
+        *size = 0;
+        return NULL;
+    }
+    stats.buf_mallocs[class]++;
+
+    return buf;
+}
+
+void Pool_buf_free(u8 *buf, size_t size)
+{
+    int class = Pool_buf_class(size);
+
+    if (buf == NULL)
+        return;
+
+    if (class < 0 || size != (size_t) POOL_BUF_MIN_SIZE << (2 * class) ||
+        stats.buf_free[class] >= POOL_BUF_FREE_MAX)
+    {
+        free(buf);
+        return;
+    }
+
+    *(u8 **) buf = buf_free[class];
+    buf_free[class] = buf;
+    stats.buf_free[class]++;
+}
+
+/* Makes buf hold at least len bytes, keeping it if it is large enough.
+ * The contents are not preserved. Returns NULL (with *size 0) on failure. */
+u8 *Pool_buf_resize(u8 *buf, size_t *size, size_t len)
+{
+    if (buf && *size >= len)
+        return buf;
+
+    Pool_buf_free(buf, *size);
+    return Pool_buf_alloc(len, size);
+}
+
+/* size is the same on every call, eloop.c owns the layout */
+void *Pool_timeout_alloc(size_t size)
+{
+    void *timeout = timeout_free;
+
+    if (timeout)
+    {
+        timeout_free = *(void **) timeout;
+        stats.timeout_free--;
+    }
+    else
+    {
+        timeout = malloc(size < sizeof(void *) ? sizeof(void *) : size);
+        if (timeout == NULL)
+            return NULL;
+        stats.timeout_mallocs++;
+    }
+
+    stats.timeout_allocs++;
+    stats.timeout_in_use++;
+    return timeout;
+}
+
+void Pool_timeout_free(void *timeout)
+{
+    *(void **) timeout = timeout_free;
+    timeout_free = timeout;
+    stats.timeout_free++;
+    stats.timeout_in_use--;
+}
+
+void Pool_get_stats(struct pool_stats *s)
+{
+    memcpy(s, &stats, sizeof(*s));
+}
+
+void Pool_deinit(void)
+{
+    struct pool_chunk *chunk;
+    u8 *buf;
+    int i;
+
+    while ((chunk = sta_chunks) != NULL)
+    {
+        sta_chunks = chunk->next;
+        free(chunk);
+    }
+    sta_free = NULL;
+    stats.sta_chunks = 0;
+    stats.sta_in_use = 0;
+
+    for (i = 0; i < POOL_BUF_CLASSES; i++)
+    {
+        while ((buf = buf_free[i]) != NULL)
+        {
+            buf_free[i] = *(u8 **) buf;
+            free(buf);
+        }
+        stats.buf_free[i] = 0;
+    }
+
+    while ((buf = timeout_free) != NULL)
+    {
+        timeout_free = *(void **) buf;
+        free(buf);
+    }
+    stats.timeout_free = 0;
+}
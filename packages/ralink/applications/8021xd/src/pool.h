@@ -0,0 +1,49 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Station entries are carved from chunks that are kept for the lifetime of
+ * the daemon; Ap_get_sta() bounds how many are in use */
+#define POOL_STA_CHUNK          16
+
+/* Per-station EAP buffers come in a few size classes and go back to a
+ * free list when they are released, so that steady state EAP rounds do not
+ * touch the heap; longer buffers are malloc'ed as they are */
+#define POOL_BUF_CLASSES        4
+#define POOL_BUF_MIN_SIZE       64      /* classes 64, 256, 1024, 4096 */
+#define POOL_BUF_FREE_MAX       64      /* free buffers kept per class */
+
+/* Event loop timeouts are recycled through a free list too, kept for the
+ * lifetime of the daemon like the stations; packets waiting in the eloop
+ * send queues are copied into buffers of the classes above */
+
+struct pool_stats
+{
+    unsigned long sta_chunks;
+    unsigned long sta_in_use;
+    unsigned long sta_allocs;
+
+    unsigned long buf_allocs[POOL_BUF_CLASSES];
+    unsigned long buf_reused[POOL_BUF_CLASSES]; /* taken from the free list */
+    unsigned long buf_mallocs[POOL_BUF_CLASSES];
+    unsigned long buf_free[POOL_BUF_CLASSES]; /* on the free list now */
+    unsigned long buf_oversize;
+
+    unsigned long timeout_in_use;
+    unsigned long timeout_allocs;
+    unsigned long timeout_mallocs;
+    unsigned long timeout_free; /* on the free list now */
+};
+
+struct sta_info;
+
+struct sta_info *Pool_sta_alloc(void);
+void Pool_sta_free(struct sta_info *sta);
+u8 *Pool_buf_alloc(size_t len, size_t *size);
+void Pool_buf_free(u8 *buf, size_t size);
+u8 *Pool_buf_resize(u8 *buf, size_t *size, size_t len);
+void *Pool_timeout_alloc(size_t size);
+void Pool_timeout_free(void *timeout);
+void Pool_get_stats(struct pool_stats *stats);
+void Pool_deinit(void);
+
+#endif /* POOL_H */
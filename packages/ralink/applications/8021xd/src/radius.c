@@ -120,6 +120,25 @@ void Radius_msg_finish(struct radius_msg *msg, u8 *secret, size_t secret_len)
     }
 }
 
+/* Give a finished message another identifier, e.g. to send it from another
+ * socket; the Message-Authenticator is recalculated over the new header */
+void Radius_msg_set_id(struct radius_msg *msg, u8 identifier, u8 *secret, size_t secret_len)
+{
+    size_t i;
+
+    msg->hdr->identifier = identifier;
+    for (i = 0; secret && i < msg->attr_used; i++)
+    {
+        struct radius_attr_hdr *attr = msg->attrs[i];
+
+        if (attr->type != RADIUS_ATTR_MESSAGE_AUTHENTICATOR || attr->length != sizeof(*attr) + MD5_MAC_LEN)
+            continue;
+        memset(attr + 1, 0, MD5_MAC_LEN);
+        hmac_md5(secret, secret_len, msg->buf, msg->buf_used, (u8 *) (attr + 1));
+        break;
+    }
+}
+
 static int Radius_msg_add_attr_to_array(struct radius_msg *msg, struct radius_attr_hdr *attr)
 {
     if (msg->attr_used >= msg->attr_size)
@@ -281,14 +300,16 @@ int Radius_msg_add_eap(struct radius_msg *msg, u8 *data, size_t data_len)
     return 1;
 }
 
-u8 *Radius_msg_get_eap(struct radius_msg *msg, size_t *eap_len)
+/* Returns the length of the EAP message in msg; it is copied to buf only if
+ * it fits in size bytes */
+size_t Radius_msg_copy_eap(struct radius_msg *msg, u8 *buf, size_t size)
 {
-    u8 *eap, *pos;
+    u8 *pos;
     size_t len;
     int i;
 
     if (msg == NULL)
-        return NULL;
+        return 0;
 
     len = 0;
     for (i = 0; i < msg->attr_used; i++)
@@ -297,14 +318,10 @@ u8 *Radius_msg_get_eap(struct radius_msg *msg, size_t *eap_len)
             len += msg->attrs[i]->length - sizeof(struct radius_attr_hdr);
     }
 
-    if (len == 0)
-        return NULL;
+    if (len == 0 || buf == NULL || len > size)
+        return len;
 
-    eap = (u8 *) malloc(len);
-    if (eap == NULL)
-        return NULL;
-
-    pos = eap;
+    pos = buf;
     for (i = 0; i < msg->attr_used; i++)
     {
         if (msg->attrs[i]->type == RADIUS_ATTR_EAP_MESSAGE)
@@ -316,6 +333,23 @@ u8 *Radius_msg_get_eap(struct radius_msg *msg, size_t *eap_len)
         }
     }
 
+    return len;
+}
+
+u8 *Radius_msg_get_eap(struct radius_msg *msg, size_t *eap_len)
+{
+    u8 *eap;
+    size_t len;
+
+    len = Radius_msg_copy_eap(msg, NULL, 0);
+    if (len == 0)
+        return NULL;
+
+    eap = (u8 *) malloc(len);
+    if (eap == NULL)
+        return NULL;
+
+    Radius_msg_copy_eap(msg, eap, len);
     if (eap_len)
         *eap_len = len;
 
@@ -38,6 +38,7 @@ enum { RADIUS_ATTR_USER_NAME = 1,
        RADIUS_ATTR_NAS_PORT = 5,
        RADIUS_ATTR_FRAMED_MTU = 12,
        RADIUS_ATTR_STATE = 24,
+       RADIUS_ATTR_CLASS = 25,
        RADIUS_ATTR_VENDOR_SPECIFIC = 26,
        RADIUS_ATTR_SESSION_TIMEOUT = 27,
        RADIUS_ATTR_IDLE_TIMEOUT = 28,
@@ -127,11 +128,13 @@ int Radius_msg_initialize(struct radius_msg *msg, size_t init_len);
 void Radius_msg_set_hdr(struct radius_msg *msg, u8 code, u8 identifier);
 void Radius_msg_free(struct radius_msg *msg);
 void Radius_msg_finish(struct radius_msg *msg, u8 *secret, size_t secret_len);
+void Radius_msg_set_id(struct radius_msg *msg, u8 identifier, u8 *secret, size_t secret_len);
 struct radius_attr_hdr *Radius_msg_add_attr(struct radius_msg *msg, u8 type,
         u8 *data, size_t data_len);
 struct radius_msg *Radius_msg_parse(const u8 *data, size_t len);
 int Radius_msg_add_eap(struct radius_msg *msg, u8 *data, size_t data_len);
 u8 *Radius_msg_get_eap(struct radius_msg *msg, size_t *len);
+size_t Radius_msg_copy_eap(struct radius_msg *msg, u8 *buf, size_t size);
 int Radius_msg_verify(struct radius_msg *msg, u8 *secret, size_t secret_len,
                       struct radius_msg *sent_msg);
 int Radius_msg_verify_acct(struct radius_msg *msg, u8 *secret,
@@ -19,14 +19,15 @@
 #define RADIUS_CLIENT_MAX_WAIT 120 /* seconds */
 #define RADIUS_CLIENT_MAX_RETRIES 10 /* maximum number of retransmit attempts
                       * before entry is removed from retransmit list */
-#define RADIUS_CLIENT_MAX_ENTRIES 30 /* maximum number of entries in retransmit
+#define RADIUS_CLIENT_MAX_ENTRIES 2048 /* maximum number of entries in retransmit
                       * list (oldest will be removed, if this limit is exceeded) */
 #define RADIUS_CLIENT_NUM_FAILOVER 4 /* try to change RADIUS server after this
                       * many failed retry attempts */
+#define RADIUS_CLIENT_TIMER_SLACK 250 /* milliseconds; retransmit timer may be
+                      * delayed to share a wakeup with other timeouts */
 
-static int
-Radius_change_server(rtapd *rtapd, struct hostapd_radius_server *nserv,
-                     struct hostapd_radius_server *oserv, int sock, int auth);
+static void Radius_client_receive(int sock, void *eloop_ctx, void *sock_ctx);
+static void Radius_client_timer(void *eloop_ctx, void *timeout_ctx);
 
 static void Radius_client_msg_free(struct radius_msg_list *req)
 {
@@ -35,9 +36,290 @@ static void Radius_client_msg_free(struct radius_msg_list *req)
     free(req);
 }
 
+static struct hostapd_radius_server *Radius_client_server(struct rtapd_config *conf, int apidx)
+{
+#if MULTIPLE_RADIUS
+    return conf->mbss_auth_server[apidx];
+#else
+    return conf->auth_server;
+#endif
+}
+
+static int Radius_client_handle(struct radius_msg_list *entry)
+{
+    return (entry->port->slot << 8) | entry->msg->hdr->identifier;
+}
+
+/* Remove an entry from the retransmit list and the identifier index */
+static void Radius_client_list_del(struct radius_client_data *radius, struct radius_msg_list *entry)
+{
+    struct radius_port *port = entry->port;
+
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        radius->msgs = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        radius->msgs_tail = entry->prev;
+
+    port->pending[entry->msg->hdr->identifier] = NULL;
+    port->num_pending--;
+    radius->num_msgs--;
+
+    if (entry->owner_handle)
+        *entry->owner_handle = -1;
+}
+
+static void Radius_port_close(rtapd *rtapd, struct radius_port *port)
+{
+    struct radius_msg_list *entry;
+    int i;
+
+    for (i = 0; i < 256 && port->num_pending; i++)
+    {
+        entry = port->pending[i];
+        if (entry)
+        {
+            Radius_client_list_del(rtapd->radius, entry);
+            Radius_client_msg_free(entry);
+        }
+    }
+
+    eloop_unregister_read_sock(port->sock);
+    close(port->sock);
+    rtapd->radius->ports[port->slot] = NULL;
+    free(port);
+}
+
+static struct radius_port *Radius_port_open(rtapd *rtapd, struct radius_pool *pool)
+{
+    struct radius_client_data *radius = rtapd->radius;
+    struct radius_port *port;
+    struct sockaddr_in serv;
+    int slot;
+
+    for (slot = 0; slot < RADIUS_CLIENT_MAX_PORTS && radius->ports[slot]; slot++)
+        ;
+    if (slot == RADIUS_CLIENT_MAX_PORTS || pool->num_ports == RADIUS_POOL_MAX_PORTS)
+        return NULL;
+
+    port = malloc(sizeof(*port));
+    if (port == NULL)
+        return NULL;
+    memset(port, 0, sizeof(*port));
+    port->pool = pool;
+    port->slot = slot;
+
+    port->sock = socket(PF_INET, SOCK_DGRAM, 0);
+    if (port->sock < 0)
+    {
+        perror("socket[PF_INET,SOCK_DGRAM]");
+        free(port);
+        return NULL;
+    }
+
+    /* the kernel picks the source port; connected, so only the server's
+     * replies come in */
+    memset(&serv, 0, sizeof(serv));
+    serv.sin_family = AF_INET;
+    serv.sin_addr.s_addr = pool->addr.s_addr;
+    serv.sin_port = htons(pool->port);
+    if (connect(port->sock, (struct sockaddr *) &serv, sizeof(serv)) < 0)
+    {
+        perror("connect[radius]");
+        close(port->sock);
+        free(port);
+        return NULL;
+    }
+
+    /* replies complete pending authentications, serve them before new
+     * supplicant traffic */
+    if (eloop_register_read_sock_prio(port->sock, ELOOP_PRIO_HIGH, Radius_client_receive, rtapd, port))
+    {
+        DBGPRINT(RT_DEBUG_ERROR,"Could not register read socket for authentication server\n");
+        close(port->sock);
+        free(port);
+        return NULL;
+    }
+
+    radius->ports[slot] = port;
+    pool->ports[pool->num_ports++] = port;
+    DBGPRINT(RT_DEBUG_TRACE, "Radius_port_open :: port %d to Radius Server(%s:%d), sock %d\n",
+             pool->num_ports, inet_ntoa(pool->addr), pool->port, port->sock);
+    return port;
+}
+
+/* Take a reference to the pool of serv, setting one up if no other BSS
+ * uses that server */
+static struct radius_pool *Radius_pool_get(rtapd *rtapd, struct hostapd_radius_server *serv)
+{
+    struct radius_pool *pool;
+
+    for (pool = rtapd->radius->pools; pool; pool = pool->next)
+    {
+        if (pool->addr.s_addr == serv->addr.s_addr && pool->port == serv->port &&
+            pool->shared_secret_len == serv->shared_secret_len &&
+            memcmp(pool->shared_secret, serv->shared_secret, serv->shared_secret_len) == 0)
+        {
+            pool->users++;
+            return pool;
+        }
+    }
+
+    if (serv->addr.s_addr == 0)
+    {
+        DBGPRINT(RT_DEBUG_WARN, "Radius_pool_get: can't create auth RADIUS socket (it's invalid IP)\n");
+        return NULL;
+    }
+
+    pool = malloc(sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    memset(pool, 0, sizeof(*pool));
+    pool->addr = serv->addr;
+    pool->port = serv->port;
+    pool->shared_secret = malloc(serv->shared_secret_len + 1);
+    if (pool->shared_secret == NULL)
+    {
+        free(pool);
+        return NULL;
+    }
+    memcpy(pool->shared_secret, serv->shared_secret, serv->shared_secret_len);
+    pool->shared_secret_len = serv->shared_secret_len;
+
+    if (Radius_port_open(rtapd, pool) == NULL)
+    {
+        free(pool->shared_secret);
+        free(pool);
+        return NULL;
+    }
+
+    pool->users = 1;
+    pool->next = rtapd->radius->pools;
+    rtapd->radius->pools = pool;
+    return pool;
+}
+
+/* Drop a reference; the last one closes the ports and their requests */
+static void Radius_pool_put(rtapd *rtapd, struct radius_pool *pool)
+{
+    struct radius_pool **prev;
+
+    if (--pool->users > 0)
+        return;
+
+    for (prev = &rtapd->radius->pools; *prev != pool; prev = &(*prev)->next)
+        ;
+    *prev = pool->next;
+
+    while (pool->num_ports > 0)
+        Radius_port_close(rtapd, pool->ports[--pool->num_ports]);
+    free(pool->shared_secret);
+    free(pool);
+}
+
+/* A port of the pool with a free identifier, opening another port when
+ * all of them are in use; NULL if the pool cannot grow any more */
+static struct radius_port *Radius_pool_port(rtapd *rtapd, struct radius_pool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->num_ports; i++)
+    {
+        if (pool->ports[i]->num_pending < 256)
+            return pool->ports[i];
+    }
+
+    return Radius_port_open(rtapd, pool);
+}
+
+static u8 Radius_port_id(struct radius_port *port)
+{
+    while (port->pending[port->next_id])
+        port->next_id++;
+
+    return port->next_id++;
+}
+
+/* Send a pending request to another pool, with the same shared secret */
+static int Radius_client_move(rtapd *rtapd, struct radius_msg_list *entry, struct radius_pool *pool)
+{
+    struct radius_port *port;
+    u8 id;
+
+    if (pool->shared_secret_len != entry->shared_secret_len ||
+        memcmp(pool->shared_secret, entry->shared_secret, pool->shared_secret_len) != 0)
+        return -1;
+
+    port = Radius_pool_port(rtapd, pool);
+    if (port == NULL)
+        return -1;
+
+    entry->port->pending[entry->msg->hdr->identifier] = NULL;
+    entry->port->num_pending--;
+
+    id = Radius_port_id(port);
+    Radius_msg_set_id(entry->msg, id, pool->shared_secret, pool->shared_secret_len);
+    port->pending[id] = entry;
+    port->num_pending++;
+    entry->port = port;
+    entry->shared_secret = pool->shared_secret;
+    /* the owner releases the request by its handle */
+    if (entry->owner_handle)
+        *entry->owner_handle = Radius_client_handle(entry);
+
+    /* Reset retry counters for the new server */
+    entry->next_try = entry->first_try + RADIUS_CLIENT_FIRST_WAIT * ELOOP_NSEC_PER_SEC;
+    entry->attempts = 0;
+    entry->next_wait = RADIUS_CLIENT_FIRST_WAIT * 2;
+    return 0;
+}
+
+/* Switch a BSS to another server. Its pending requests follow it if the
+ * shared secret is the same; they would need new User-Passwords etc.
+ * otherwise, so they are dropped. */
+static void Radius_client_set_server(rtapd *rtapd, int apidx, struct hostapd_radius_server *nserv)
+{
+    struct radius_client_data *radius = rtapd->radius;
+    struct radius_pool *opool = radius->bss_pool[apidx], *pool;
+    struct radius_msg_list *entry, *next;
+
+    pool = Radius_pool_get(rtapd, nserv);
+    if (pool == NULL)
+    {
+        DBGPRINT(RT_DEBUG_ERROR, "Radius_client_set_server :: %s%d stays on its server\n", rtapd->prefix_wlan_name, apidx);
+        return;
+    }
+    radius->bss_pool[apidx] = pool;
+
+    for (entry = radius->msgs; entry; entry = next)
+    {
+        next = entry->next;
+        if (entry->ApIdx != apidx || entry->port->pool == pool)
+            continue;
+        if (Radius_client_move(rtapd, entry, pool))
+        {
+            Radius_client_list_del(radius, entry);
+            Radius_client_msg_free(entry);
+        }
+    }
+
+    if (opool)
+        Radius_pool_put(rtapd, opool);
+
+    if (radius->msgs)
+        eloop_register_timeout_ref(RADIUS_CLIENT_FIRST_WAIT, 0, RADIUS_CLIENT_TIMER_SLACK, Radius_client_timer, rtapd, NULL, &radius->msgs_timeout);
+    else
+        eloop_cancel_timeout_ref(&radius->msgs_timeout);
+    DBGPRINT(RT_DEBUG_TRACE, "Radius_client_set_server :: %s%d uses Radius Server(%s)\n",
+             rtapd->prefix_wlan_name, apidx, inet_ntoa(nserv->addr));
+}
+
 int Radius_client_register(rtapd *apd, RadiusType msg_type,
                            RadiusRxResult (*handler)(rtapd *apd, struct radius_msg *msg, struct radius_msg *req,
-                                   u8 *shared_secret, size_t shared_secret_len, void *data), void *data)
+                                   u8 *shared_secret, size_t shared_secret_len, void *owner, void *data), void *data)
 {
     struct radius_rx_handler **handlers, *newh;
     size_t *num;
@@ -58,22 +340,15 @@ int Radius_client_register(rtapd *apd, RadiusType msg_type,
     return 0;
 }
 
-static int Radius_client_retransmit(rtapd *rtapd, struct radius_msg_list *entry, time_t now)
+static int Radius_client_retransmit(rtapd *rtapd, struct radius_msg_list *entry, eloop_time_t now)
 {
-    int s;
-
-#if MULTIPLE_RADIUS
-    s = rtapd->radius->mbss_auth_serv_sock[entry->ApIdx];
-#else
-    s = rtapd->radius->auth_serv_sock;
-#endif
     /* retransmit; remove entry if too many attempts */
     entry->attempts++;
 
-    if (send(s, entry->msg->buf, entry->msg->buf_used, 0) < 0)
+    if (eloop_send(entry->port->sock, entry->msg->buf, entry->msg->buf_used) < 0)
         perror("send[RADIUS]");
 
-    entry->next_try = now + entry->next_wait;
+    entry->next_try = now + entry->next_wait * ELOOP_NSEC_PER_SEC;
     entry->next_wait *= 2;
     if (entry->next_wait > RADIUS_CLIENT_MAX_WAIT)
         entry->next_wait = RADIUS_CLIENT_MAX_WAIT;
@@ -89,13 +364,13 @@ static int Radius_client_retransmit(rtapd *rtapd, struct radius_msg_list *entry,
 static void Radius_client_timer(void *eloop_ctx, void *timeout_ctx)
 {
     rtapd *rtapd = eloop_ctx;
-    time_t now, first;
-    struct radius_msg_list *entry, *prev, *tmp;
+    eloop_time_t now, first;
+    struct radius_msg_list *entry, *tmp;
 #if MULTIPLE_RADIUS
     int i;
     int mbss_auth_failover[MAX_MBSSID_NUM];
 #else
-    int auth_failover = 0;
+    int i, auth_failover = 0;
 #endif
 
 #if MULTIPLE_RADIUS
@@ -107,23 +382,17 @@ static void Radius_client_timer(void *eloop_ctx, void *timeout_ctx)
     if (!entry)
         return;
 
-    time(&now);
+    now = eloop_now();
     first = 0;
 
-    prev = NULL;
     while (entry)
     {
         if (now >= entry->next_try && Radius_client_retransmit(rtapd, entry, now))
         {
-            if (prev)
-                prev->next = entry->next;
-            else
-                rtapd->radius->msgs = entry->next;
-
             tmp = entry;
             entry = entry->next;
+            Radius_client_list_del(rtapd->radius, tmp);
             Radius_client_msg_free(tmp);
-            rtapd->radius->num_msgs--;
             continue;
         }
 
@@ -143,7 +412,6 @@ static void Radius_client_timer(void *eloop_ctx, void *timeout_ctx)
         if (first == 0 || entry->next_try < first)
             first = entry->next_try;
 
-        prev = entry;
         entry = entry->next;
     }
 
@@ -151,7 +419,9 @@ static void Radius_client_timer(void *eloop_ctx, void *timeout_ctx)
     {
         if (first < now)
             first = now;
-        eloop_register_timeout(first - now, 0, Radius_client_timer, rtapd, NULL);
+        eloop_register_timeout_ref((first - now) / ELOOP_NSEC_PER_SEC,
+                                   (first - now) % ELOOP_NSEC_PER_SEC / ELOOP_NSEC_PER_USEC,
+                                   RADIUS_CLIENT_TIMER_SLACK, Radius_client_timer, rtapd, NULL, &rtapd->radius->msgs_timeout);
     }
 #if MULTIPLE_RADIUS
     for (i = 0; i < rtapd->conf->SsidNum; i++)
@@ -165,7 +435,7 @@ static void Radius_client_timer(void *eloop_ctx, void *timeout_ctx)
             if (next > &(rtapd->conf->mbss_auth_servers[i][rtapd->conf->mbss_num_auth_servers[i]- 1]))
                 next = rtapd->conf->mbss_auth_servers[i];
             rtapd->conf->mbss_auth_server[i] = next;
-            Radius_change_server(rtapd, next, old, rtapd->radius->mbss_auth_serv_sock[i], 1);
+            Radius_client_set_server(rtapd, i, next);
             DBGPRINT(RT_DEBUG_WARN, "Radius_client_timer : ready to change RADIUS server for %s%d\n", rtapd->prefix_wlan_name, i);
         }
     }
@@ -179,16 +449,18 @@ static void Radius_client_timer(void *eloop_ctx, void *timeout_ctx)
         if (next > &(rtapd->conf->auth_servers[rtapd->conf->num_auth_servers - 1]))
             next = rtapd->conf->auth_servers;
         rtapd->conf->auth_server = next;
-        Radius_change_server(rtapd, next, old, rtapd->radius->auth_serv_sock, 1);
+        for (i = 0; i < rtapd->conf->SsidNum; i++)
+            Radius_client_set_server(rtapd, i, next);
         DBGPRINT(RT_DEBUG_WARN, "==> Radius_client_timer : ready to change RADIUS server \n");
     }
 #endif
 }
 
-static void Radius_client_list_add(rtapd *rtapd, struct radius_msg *msg,
-                                   RadiusType msg_type, u8 *shared_secret, size_t shared_secret_len, u8 ApIdx)
+static int Radius_client_list_add(rtapd *rtapd, struct radius_msg *msg, RadiusType msg_type,
+                                  struct radius_port *port, u8 ApIdx, void *owner, int *handle)
 {
-    struct radius_msg_list *entry, *prev;
+    struct radius_client_data *radius = rtapd->radius;
+    struct radius_msg_list *entry, *old;
 
     if (eloop_terminated())
     {
@@ -197,7 +469,7 @@ static void Radius_client_list_add(rtapd *rtapd, struct radius_msg *msg,
         DBGPRINT(RT_DEBUG_TRACE,"eloop_terminate \n");
         Radius_msg_free(msg);
         free(msg);
-        return;
+        return -1;
     }
 
     entry = malloc(sizeof(*entry));
@@ -206,89 +478,109 @@ static void Radius_client_list_add(rtapd *rtapd, struct radius_msg *msg,
         DBGPRINT(RT_DEBUG_TRACE,"Failed to add RADIUS packet into retransmit list\n");
         Radius_msg_free(msg);
         free(msg);
-        return;
+        return -1;
     }
 
     memset(entry, 0, sizeof(*entry));
     entry->msg = msg;
     entry->msg_type = msg_type;
-    entry->shared_secret = shared_secret;
-    entry->shared_secret_len = shared_secret_len;
+    entry->shared_secret = port->pool->shared_secret;
+    entry->shared_secret_len = port->pool->shared_secret_len;
     entry->ApIdx = ApIdx;
-    time(&entry->first_try);
-    entry->next_try = entry->first_try + RADIUS_CLIENT_FIRST_WAIT;
+    entry->owner = owner;
+    entry->owner_handle = handle;
+    entry->port = port;
+    entry->first_try = eloop_now();
+    entry->next_try = entry->first_try + RADIUS_CLIENT_FIRST_WAIT * ELOOP_NSEC_PER_SEC;
     entry->attempts = 1;
     entry->next_wait = RADIUS_CLIENT_FIRST_WAIT * 2;
 
     if (!rtapd->radius->msgs)
     {
-        eloop_register_timeout(RADIUS_CLIENT_FIRST_WAIT, 0, Radius_client_timer, rtapd, NULL);
+        eloop_register_timeout_ref(RADIUS_CLIENT_FIRST_WAIT, 0, RADIUS_CLIENT_TIMER_SLACK, Radius_client_timer, rtapd, NULL, &rtapd->radius->msgs_timeout);
     }
 
-    entry->next = rtapd->radius->msgs;
-    rtapd->radius->msgs = entry;
-
-    if (rtapd->radius->num_msgs >= RADIUS_CLIENT_MAX_ENTRIES)
+    if (radius->num_msgs >= RADIUS_CLIENT_MAX_ENTRIES)
     {
         DBGPRINT(RT_DEBUG_TRACE,"Removing the oldest un-ACKed RADIUS packet due to retransmit list limits.\n");
-        prev = NULL;
-        while (entry->next)
-        {
-            prev = entry;
-            entry = entry->next;
-        }
-        if (prev)
-        {
-            prev->next = NULL;
-            Radius_client_msg_free(entry);
-        }
+        old = radius->msgs_tail;
+        Radius_client_list_del(radius, old);
+        Radius_client_msg_free(old);
     }
+
+    entry->prev = NULL;
+    entry->next = radius->msgs;
+    if (radius->msgs)
+        radius->msgs->prev = entry;
     else
-        rtapd->radius->num_msgs++;
+        radius->msgs_tail = entry;
+    radius->msgs = entry;
+    port->pending[msg->hdr->identifier] = entry;
+    port->num_pending++;
+    radius->num_msgs++;
+
+    *handle = Radius_client_handle(entry);
+    return 0;
 }
 
-int Radius_client_send(rtapd *rtapd, struct radius_msg *msg, RadiusType msg_type, u8 ApIdx)
+/* The identifier of msg is set here, from a port of the BSS's server.
+ * *handle is for Radius_client_release(); it is kept up to date while the
+ * request is pending, and set to -1 when the request is gone. */
+int Radius_client_send(rtapd *rtapd, struct radius_msg *msg, RadiusType msg_type, u8 ApIdx,
+                       void *owner, int *handle)
 {
-    u8 *shared_secret;
-    size_t shared_secret_len;
-    char *name;
-    int s, res = 0;
+    struct radius_pool *pool = rtapd->radius->bss_pool[ApIdx];
+    struct radius_port *port;
+    struct radius_msg_list *old;
+    u8 id;
 
-#if MULTIPLE_RADIUS
-    shared_secret = rtapd->conf->mbss_auth_server[ApIdx]->shared_secret;
-    shared_secret_len = rtapd->conf->mbss_auth_server[ApIdx]->shared_secret_len;
-    s = rtapd->radius->mbss_auth_serv_sock[ApIdx];
-    DBGPRINT(RT_DEBUG_TRACE, "Send packet to server (%s)\n",
-             inet_ntoa(rtapd->conf->mbss_auth_server[ApIdx]->addr));
-#else
-    shared_secret = rtapd->conf->auth_server->shared_secret;
-    shared_secret_len = rtapd->conf->auth_server->shared_secret_len;
-    s = rtapd->radius->auth_serv_sock;
-#endif
-    Radius_msg_finish(msg, shared_secret, shared_secret_len);
-    name = "authentication";
+    *handle = -1;
+    if (pool == NULL)
+    {
+        DBGPRINT(RT_DEBUG_ERROR, "No RADIUS server for %s%d\n", rtapd->prefix_wlan_name, ApIdx);
+        Radius_msg_free(msg);
+        free(msg);
+        return -1;
+    }
 
-    res = send(s, msg->buf, msg->buf_used, 0);
-    if (res < 0)
-        perror("send[RADIUS]");
+    port = Radius_pool_port(rtapd, pool);
+    if (port == NULL)
+    {
+        /* remove entry with matching id from retransmit list to avoid
+         * using new reply from the RADIUS server with an old request */
+        DBGPRINT(RT_DEBUG_WARN, "All %d ports to RADIUS server %s are full\n", pool->num_ports, inet_ntoa(pool->addr));
+        port = pool->ports[0];
+        old = port->pending[port->next_id];
+        Radius_client_list_del(rtapd->radius, old);
+        Radius_client_msg_free(old);
+        pool->ids_reused++;
+    }
+
+    id = Radius_port_id(port);
+    msg->hdr->identifier = id;
+    Radius_msg_finish(msg, pool->shared_secret, pool->shared_secret_len);
+    DBGPRINT(RT_DEBUG_TRACE, "Send packet to server (%s), id %d on sock %d\n",
+             inet_ntoa(pool->addr), id, port->sock);
 
-    Radius_client_list_add(rtapd, msg, msg_type, shared_secret, shared_secret_len, ApIdx);
+    if (eloop_send(port->sock, msg->buf, msg->buf_used) < 0)
+        perror("send[RADIUS]");
+    pool->requests++;
 
-    return res;
+    return Radius_client_list_add(rtapd, msg, msg_type, port, ApIdx, owner, handle);
 }
 
 static void Radius_client_receive(int sock, void *eloop_ctx, void *sock_ctx)
 {
     rtapd *rtapd = eloop_ctx;
-    RadiusType msg_type = (RadiusType) sock_ctx;
+    struct radius_port *port = sock_ctx;
     int len, i,len_80211hdr=24;
     unsigned char buf[3000];
     struct radius_msg *msg;
     struct radius_rx_handler *handlers;
     size_t num_handlers;
-    struct radius_msg_list *req, *prev_req;
+    struct radius_msg_list *req;
 
-    DBGPRINT(RT_DEBUG_TRACE, "RADIUS_CLIENT_RECEIVE : msg_type= %d \n", msg_type);
+    DBGPRINT(RT_DEBUG_TRACE, "RADIUS_CLIENT_RECEIVE : sock= %d \n", sock);
     len = recv(sock, buf, sizeof(buf), 0);
     if (len < 0)
     {
@@ -320,35 +612,21 @@ static void Radius_client_receive(int sock, void *eloop_ctx, void *sock_ctx)
     handlers = rtapd->radius->auth_handlers;
     num_handlers = rtapd->radius->num_auth_handlers;
 
-    prev_req = NULL;
-    req = rtapd->radius->msgs;
-    while (req)
-    {
-        /* TODO: also match by src addr:port of the packet when using
-         * alternative RADIUS servers (?) */
-        if (req->msg_type == msg_type && req->msg->hdr->identifier == msg->hdr->identifier)
-            break;
-
-        prev_req = req;
-        req = req->next;
-    }
-
+    /* the socket is connected, so the reply comes from the server the
+     * request went to */
+    req = port->pending[msg->hdr->identifier];
     if (req == NULL)
     {
         goto fail;
     }
 
     /* Remove ACKed RADIUS packet from retransmit list */
-    if (prev_req)
-        prev_req->next = req->next;
-    else
-        rtapd->radius->msgs = req->next;
-    rtapd->radius->num_msgs--;
+    Radius_client_list_del(rtapd->radius, req);
 
     for (i = 0; i < num_handlers; i++)
     {
         RadiusRxResult res;
-        res = handlers[i].handler(rtapd, msg, req->msg, req->shared_secret, req->shared_secret_len, handlers[i].data);
+        res = handlers[i].handler(rtapd, msg, req->msg, req->shared_secret, req->shared_secret_len, req->owner, handlers[i].data);
         switch (res)
         {
             case RADIUS_RX_PROCESSED:
@@ -365,7 +643,7 @@ static void Radius_client_receive(int sock, void *eloop_ctx, void *sock_ctx)
     }
 
     DBGPRINT(RT_DEBUG_ERROR,"No RADIUS RX handler found (type=%d code=%d id=%d) - dropping "
-             "packet\n", msg_type, msg->hdr->code, msg->hdr->identifier);
+             "packet\n", req->msg_type, msg->hdr->code, msg->hdr->identifier);
     Radius_client_msg_free(req);
 
 fail:
@@ -373,202 +651,154 @@ fail:
     free(msg);
 }
 
-u8 Radius_client_get_id(rtapd *rtapd)
+/* The owner of a pending request is going away; keep retransmitting the
+ * request, but do not hand its reply to the owner */
+void Radius_client_release(rtapd *rtapd, int handle, void *owner)
 {
-    struct radius_msg_list *entry, *prev, *remove;
-    u8 id = rtapd->radius->next_radius_identifier++;
+    struct radius_port *port;
+    struct radius_msg_list *entry;
 
-    /* remove entries with matching id from retransmit list to avoid
-     * using new reply from the RADIUS server with an old request */
-    entry = rtapd->radius->msgs;
-    prev = NULL;
-    while (entry)
-    {
-        if (entry->msg->hdr->identifier == id)
-        {
-            if (prev)
-                prev->next = entry->next;
-            else
-                rtapd->radius->msgs = entry->next;
-            remove = entry;
-        }
-        else
-            remove = NULL;
-        prev = entry;
-        entry = entry->next;
+    if (!rtapd->radius || handle < 0)
+        return;
 
-        if (remove)
-            Radius_client_msg_free(remove);
+    port = rtapd->radius->ports[handle >> 8];
+    entry = port ? port->pending[handle & 0xff] : NULL;
+    if (entry && entry->owner == owner)
+    {
+        entry->owner = NULL;
+        entry->owner_handle = NULL;
     }
-
-    return id;
 }
 
 void Radius_client_flush(rtapd *rtapd)
 {
-    struct radius_msg_list *entry, *prev;
+    struct radius_msg_list *entry;
 
     if (!rtapd->radius)
         return;
 
-    eloop_cancel_timeout(Radius_client_timer, rtapd, NULL);
+    eloop_cancel_timeout_ref(&rtapd->radius->msgs_timeout);
 
-    entry = rtapd->radius->msgs;
-    rtapd->radius->msgs = NULL;
-    rtapd->radius->num_msgs = 0;
-    while (entry)
+    while ((entry = rtapd->radius->msgs) != NULL)
     {
-        prev = entry;
-        entry = entry->next;
-        Radius_client_msg_free(prev);
+        Radius_client_list_del(rtapd->radius, entry);
+        Radius_client_msg_free(entry);
     }
 }
 
-static int
-Radius_change_server(rtapd *rtapd, struct hostapd_radius_server *nserv,
-                     struct hostapd_radius_server *oserv, int sock, int auth)
+/* The server of the new list at the position oserv had in the old list, if
+ * it is the same server; NULL otherwise */
+static struct hostapd_radius_server *
+Radius_client_same_server(struct hostapd_radius_server *servs, int num_servs,
+                          struct hostapd_radius_server *oservs, struct hostapd_radius_server *oserv)
 {
-    struct sockaddr_in serv;
-    if (!oserv || nserv->shared_secret_len != oserv->shared_secret_len ||
+    struct hostapd_radius_server *nserv;
+
+    if (servs == NULL || oserv == NULL || oserv - oservs >= num_servs)
+        return NULL;
+
+    nserv = &servs[oserv - oservs];
+    if (nserv->addr.s_addr != oserv->addr.s_addr || nserv->port != oserv->port ||
+        nserv->shared_secret_len != oserv->shared_secret_len ||
         memcmp(nserv->shared_secret, oserv->shared_secret, nserv->shared_secret_len) != 0)
+        return NULL;
+
+    return nserv;
+}
+
+/* Called on reload after rtapd->conf has been replaced, while oconf is
+ * still valid. The BSSs marked in bss_changed, or whose server went away,
+ * drop their requests and let go of their pool; call Radius_client_init()
+ * to set them up again. The others keep going on the same sockets. */
+void Radius_client_reconfig(rtapd *rtapd, struct rtapd_config *oconf, const int *bss_changed)
+{
+    struct rtapd_config *conf = rtapd->conf;
+    struct radius_client_data *radius = rtapd->radius;
+    struct radius_msg_list *entry, *next;
+    struct hostapd_radius_server *serv;
+    int i, drop[MAX_MBSSID_NUM];
+
+    if (!radius)
+        return;
+
+#if !MULTIPLE_RADIUS
+    serv = Radius_client_same_server(conf->auth_servers, conf->num_auth_servers,
+                                     oconf->auth_servers, oconf->auth_server);
+    if (serv)
+        conf->auth_server = serv; /* stay on the server the sockets are connected to */
+#endif
+    for (i = 0; i < MAX_MBSSID_NUM; i++)
     {
-        /* Pending RADIUS packets used different shared
-         * secret, so they would need to be modified. Could
-         * update all message authenticators and
-         * User-Passwords, etc. and retry with new server. For
-         * now, just drop all pending packets. */
-        Radius_client_flush(rtapd);
+#if MULTIPLE_RADIUS
+        serv = Radius_client_same_server(conf->mbss_auth_servers[i], conf->mbss_num_auth_servers[i],
+                                         oconf->mbss_auth_servers[i], oconf->mbss_auth_server[i]);
+        if (serv && !bss_changed[i])
+            conf->mbss_auth_server[i] = serv;
+#endif
+        drop[i] = bss_changed[i] || (radius->bss_pool[i] && serv == NULL);
     }
-    else
+
+    /* requests of a BSS that is gone are dropped even if it still had no
+     * pool; Radius_client_release() only orphaned them */
+    for (entry = radius->msgs; entry; entry = next)
     {
-        /* Reset retry counters for the new server */
-        struct radius_msg_list *entry;
-        entry = rtapd->radius->msgs;
-        while (entry)
-        {
-            entry->next_try = entry->first_try + RADIUS_CLIENT_FIRST_WAIT;
-            entry->attempts = 0;
-            entry->next_wait = RADIUS_CLIENT_FIRST_WAIT * 2;
-            entry = entry->next;
-        }
-        if (rtapd->radius->msgs)
+        next = entry->next;
+        if (entry->ApIdx >= conf->SsidNum || drop[entry->ApIdx])
         {
-            eloop_cancel_timeout(Radius_client_timer, rtapd, NULL);
-            eloop_register_timeout(RADIUS_CLIENT_FIRST_WAIT, 0, Radius_client_timer, rtapd, NULL);
+            Radius_client_list_del(radius, entry);
+            Radius_client_msg_free(entry);
         }
     }
-    // bind before connect to assign local port
-    /*Comment by rory
-        memset(&serv, 0, sizeof(serv));
-        port = 2048;
-        serv.sin_family = AF_INET;
-        //serv.sin_addr.s_addr = inet_addr("192.168.1.138");
-        serv.sin_addr.s_addr = rtapd->conf->own_ip_addr.s_addr;
-        serv.sin_port = htons(port);
-        if (bind(sock, (struct sockaddr *) &serv, sizeof(serv)) < 0)
-        {
-            perror("bind");
-            return -1;
-        }*/
-    memset(&serv, 0, sizeof(serv));
-    serv.sin_family = AF_INET;
-    serv.sin_addr.s_addr = nserv->addr.s_addr;
-    serv.sin_port = htons(nserv->port);
-    if (connect(sock, (struct sockaddr *) &serv, sizeof(serv)) < 0)
+
+    for (i = 0; i < MAX_MBSSID_NUM; i++)
     {
-        perror("connect[radius]");
-        return -1;
+        if (drop[i] && radius->bss_pool[i])
+        {
+            Radius_pool_put(rtapd, radius->bss_pool[i]);
+            radius->bss_pool[i] = NULL;
+        }
     }
-    DBGPRINT(RT_DEBUG_TRACE, "Radius_change_server :: Connect to Radius Server(%s)\n", inet_ntoa(nserv->addr));
-    return 0;
+
+    if (radius->msgs == NULL)
+        eloop_cancel_timeout_ref(&radius->msgs_timeout);
 }
 
 static void Radius_retry_primary_timer(void *eloop_ctx, void *timeout_ctx)
 {
     rtapd *rtapd = eloop_ctx;
-    struct hostapd_radius_server *oserv;
+    int i;
 
     DBGPRINT(RT_DEBUG_TRACE, "RUN Radius_retry_primary_timer.....\n");
 #if MULTIPLE_RADIUS
-    int i;
-
     for (i = 0; i < rtapd->conf->SsidNum; i++)
     {
-        if (rtapd->radius->mbss_auth_serv_sock[i] >= 0 && rtapd->conf->mbss_auth_servers[i] &&
+        if (rtapd->radius->bss_pool[i] && rtapd->conf->mbss_auth_servers[i] &&
             rtapd->conf->mbss_auth_server[i] != rtapd->conf->mbss_auth_servers[i])
         {
-            oserv = rtapd->conf->mbss_auth_server[i];
             rtapd->conf->mbss_auth_server[i] = rtapd->conf->mbss_auth_servers[i];
-            Radius_change_server(rtapd, rtapd->conf->mbss_auth_server[i], oserv, rtapd->radius->mbss_auth_serv_sock[i], 1);
+            Radius_client_set_server(rtapd, i, rtapd->conf->mbss_auth_server[i]);
         }
     }
 #else
-    if (rtapd->radius->auth_serv_sock >= 0 && rtapd->conf->auth_servers &&
-        rtapd->conf->auth_server != rtapd->conf->auth_servers)
+    if (rtapd->conf->auth_servers && rtapd->conf->auth_server != rtapd->conf->auth_servers)
     {
-        oserv = rtapd->conf->auth_server;
         rtapd->conf->auth_server = rtapd->conf->auth_servers;
-        Radius_change_server(rtapd, rtapd->conf->auth_server, oserv, rtapd->radius->auth_serv_sock, 1);
+        for (i = 0; i < rtapd->conf->SsidNum; i++)
+        {
+            if (rtapd->radius->bss_pool[i])
+                Radius_client_set_server(rtapd, i, rtapd->conf->auth_server);
+        }
     }
 #endif
 
     if (rtapd->conf->radius_retry_primary_interval)
-        eloop_register_timeout(rtapd->conf->radius_retry_primary_interval, 0, Radius_retry_primary_timer, rtapd, NULL);
+        eloop_register_timeout(rtapd->conf->radius_retry_primary_interval, 0, 0, Radius_retry_primary_timer, rtapd, NULL);
 }
 
-#if MULTIPLE_RADIUS
-static int Radius_client_init_auth(rtapd *rtapd, int apidx)
-{
-    if (rtapd->conf->mbss_auth_server[apidx]->addr.s_addr == 0)
-    {
-        DBGPRINT(RT_DEBUG_WARN, "Radius_client_init_auth: can't create auth RADIUS socket for %s%d (it's invalid IP)\n", rtapd->prefix_wlan_name, apidx);
-        return -1;
-    }
-
-    rtapd->radius->mbss_auth_serv_sock[apidx] = socket(PF_INET, SOCK_DGRAM, 0);
-    if (rtapd->radius->mbss_auth_serv_sock[apidx] < 0)
-    {
-        perror("socket[PF_INET,SOCK_DGRAM]");
-        return -1;
-    }
-
-    if (Radius_change_server(rtapd, rtapd->conf->mbss_auth_server[apidx], NULL, rtapd->radius->mbss_auth_serv_sock[apidx], 1))
-        return -1;
-
-    if (eloop_register_read_sock(rtapd->radius->mbss_auth_serv_sock[apidx], Radius_client_receive, rtapd, (void *) RADIUS_AUTH))
-    {
-        DBGPRINT(RT_DEBUG_ERROR,"Could not register read socket for authentication server - iface-%d\n", apidx);
-        return -1;
-    }
-    return 0;
-}
-#else
-static int Radius_client_init_auth(rtapd *rtapd)
-{
-    rtapd->radius->auth_serv_sock = socket(PF_INET, SOCK_DGRAM, 0);
-    if (rtapd->radius->auth_serv_sock < 0)
-    {
-        perror("socket[PF_INET,SOCK_DGRAM]");
-        return -1;
-    }
-
-    Radius_change_server(rtapd, rtapd->conf->auth_server, NULL, rtapd->radius->auth_serv_sock, 1);
-
-    if (eloop_register_read_sock(rtapd->radius->auth_serv_sock, Radius_client_receive, rtapd, (void *) RADIUS_AUTH))
-    {
-        DBGPRINT(RT_DEBUG_ERROR,"Could not register read socket for authentication server\n");
-        return -1;
-    }
-    return 0;
-}
-#endif
-
-
 int Radius_client_init(rtapd *rtapd)
 {
-#if MULTIPLE_RADIUS
+    struct hostapd_radius_server *serv;
     int i, ready_sock_count = 0, bReInit = 1;
-#endif
 
     if (rtapd->radius == NULL)
     {
@@ -577,30 +807,20 @@ int Radius_client_init(rtapd *rtapd)
             return -1;
 
         memset(rtapd->radius, 0, sizeof(struct radius_client_data));
-
-#if MULTIPLE_RADIUS
-        for (i = 0; i < MAX_MBSSID_NUM; i++)
-            rtapd->radius->mbss_auth_serv_sock[i] = -1;
-
         bReInit= 0;
-#else
-        rtapd->radius->auth_serv_sock = -1;
-#endif
     }
 
-#if MULTIPLE_RADIUS
-    // Create socket for auth RADIUS
+    // Create sockets for auth RADIUS, shared by the BSSs using the same server
     for (i = 0; i < rtapd->conf->SsidNum; i++)
     {
-        if (rtapd->radius->mbss_auth_serv_sock[i] < 0)
-        {
-            if (rtapd->conf->mbss_auth_server[i] && (!Radius_client_init_auth(rtapd, i)))
-                ready_sock_count++;
-        }
-        else
+        serv = Radius_client_server(rtapd->conf, i);
+        if (rtapd->radius->bss_pool[i] == NULL && serv)
+            rtapd->radius->bss_pool[i] = Radius_pool_get(rtapd, serv);
+        if (rtapd->radius->bss_pool[i])
             ready_sock_count++;
     }
 
+#if MULTIPLE_RADIUS
     if (ready_sock_count == 0)
     {
         DBGPRINT(RT_DEBUG_ERROR, "Radius_client_init : no any auth RADIUS socket ready \n");
@@ -608,31 +828,53 @@ int Radius_client_init(rtapd *rtapd)
     }
     else
         DBGPRINT(RT_DEBUG_TRACE, "Radius_client_init : ready_sock_count %d \n", ready_sock_count);
+#else
+    if (rtapd->conf->auth_server && ready_sock_count == 0)
+        return -1;
+#endif
 
     if (rtapd->conf->radius_retry_primary_interval && !bReInit && ready_sock_count > 0)
-        eloop_register_timeout(rtapd->conf->radius_retry_primary_interval, 0, Radius_retry_primary_timer, rtapd, NULL);
-#else
-    if( rtapd->radius->auth_serv_sock < 0)
+        eloop_register_timeout(rtapd->conf->radius_retry_primary_interval, 0, 0, Radius_retry_primary_timer, rtapd, NULL);
+    return 0;
+}
+
+void Radius_client_dump(rtapd *rtapd)
+{
+    struct radius_pool *pool;
+    int i, in_use;
+
+    if (!rtapd->radius)
+        return;
+
+    DBGPRINT(RT_DEBUG_OFF, "radius: %lu requests pending (max %d)\n",
+             (unsigned long) rtapd->radius->num_msgs, RADIUS_CLIENT_MAX_ENTRIES);
+    for (pool = rtapd->radius->pools; pool; pool = pool->next)
     {
-        if (rtapd->conf->auth_server && Radius_client_init_auth(rtapd))
-            return -1;
-        if (rtapd->conf->radius_retry_primary_interval)
-            eloop_register_timeout(rtapd->conf->radius_retry_primary_interval, 0, Radius_retry_primary_timer, rtapd, NULL);
+        for (i = 0, in_use = 0; i < pool->num_ports; i++)
+            in_use += pool->ports[i]->num_pending;
+        DBGPRINT(RT_DEBUG_OFF, "radius: %s:%d for %d BSSs, %d/%d ports, %d/%d identifiers in use, "
+                 "%lu requests, %lu identifiers reused\n",
+                 inet_ntoa(pool->addr), pool->port, pool->users, pool->num_ports, RADIUS_POOL_MAX_PORTS,
+                 in_use, pool->num_ports * 256, pool->requests, pool->ids_reused);
     }
-#endif
-    return 0;
 }
 
 void Radius_client_deinit(rtapd *rtapd)
 {
+    int i;
+
     if (!rtapd->radius)
         return;
 
     eloop_cancel_timeout(Radius_retry_primary_timer, rtapd, NULL);
 
     Radius_client_flush(rtapd);
+    for (i = 0; i < MAX_MBSSID_NUM; i++)
+    {
+        if (rtapd->radius->bss_pool[i])
+            Radius_pool_put(rtapd, rtapd->radius->bss_pool[i]);
+    }
     free(rtapd->radius->auth_handlers);
     free(rtapd->radius);
     rtapd->radius = NULL;
 }
-
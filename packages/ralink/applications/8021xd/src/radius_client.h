@@ -1,28 +1,69 @@
 #ifndef RADIUS_CLIENT_H
 #define RADIUS_CLIENT_H
 
+#include "eloop.h"
+
 typedef enum
 {
     RADIUS_AUTH
 } RadiusType;
 
+struct radius_port;
+
 /* RADIUS message retransmit list */
 struct radius_msg_list
 {
     struct radius_msg *msg;
     RadiusType msg_type;
-    time_t first_try;
-    time_t next_try;
+    eloop_time_t first_try; /* eloop clock */
+    eloop_time_t next_try;
     int attempts;
     int next_wait;
 
-    u8 *shared_secret;
+    u8 *shared_secret; /* of the pool the request is sent from */
     size_t shared_secret_len;
 
     u8  ApIdx;  // Multiple SSID interface
     /* TODO: server config with failover to backup server(s) */
 
-    struct radius_msg_list *next;
+    void *owner; /* handed back to the RX handler with the reply */
+    int *owner_handle; /* the owner's copy of the handle, -1 once the entry is gone */
+    struct radius_port *port;
+
+    struct radius_msg_list *next, *prev;
+};
+
+#define RADIUS_POOL_MAX_PORTS       8   /* source ports per server, 256 identifiers each */
+#define RADIUS_CLIENT_MAX_PORTS     ((MAX_MBSSID_NUM + 1) * RADIUS_POOL_MAX_PORTS)
+
+/* One source port towards a server. Identifiers only have to be unique per
+ * port, so every port adds 256 requests that can be outstanding. */
+struct radius_port
+{
+    int sock;
+    int slot; /* in radius_client_data.ports[] */
+    struct radius_pool *pool;
+    struct radius_msg_list *pending[256]; /* by RADIUS identifier */
+    int num_pending;
+    u8 next_id;
+};
+
+/* The ports shared by all BSSs that use the same server and shared secret */
+struct radius_pool
+{
+    struct in_addr addr;
+    int port;
+    u8 *shared_secret;
+    size_t shared_secret_len;
+
+    int users; /* BSSs sending to the pool */
+    struct radius_port *ports[RADIUS_POOL_MAX_PORTS];
+    int num_ports;
+
+    unsigned long requests;
+    unsigned long ids_reused; /* every port was full */
+
+    struct radius_pool *next;
 };
 
 
@@ -36,36 +77,35 @@ typedef enum
 struct radius_rx_handler
 {
     RadiusRxResult (*handler)(rtapd *apd, struct radius_msg *msg, struct radius_msg *req,
-                              u8 *shared_secret, size_t shared_secret_len, void *data);
+                              u8 *shared_secret, size_t shared_secret_len, void *owner, void *data);
     void *data;
 };
 
 struct radius_client_data
 {
 
-#if MULTIPLE_RADIUS
-    int mbss_auth_serv_sock[MAX_MBSSID_NUM]; /* socket for authentication RADIUS messages */
-#else
-    int auth_serv_sock; /* socket for authentication RADIUS messages */
-#endif
+    struct radius_pool *pools;
+    struct radius_pool *bss_pool[MAX_MBSSID_NUM]; /* the pool of the current server */
+    struct radius_port *ports[RADIUS_CLIENT_MAX_PORTS]; /* by request handle >> 8 */
 
     struct radius_rx_handler *auth_handlers;
     size_t num_auth_handlers;
 
-    struct radius_msg_list *msgs;
+    struct radius_msg_list *msgs, *msgs_tail; /* newest first */
     size_t num_msgs;
-
-    u8 next_radius_identifier;
-
+    struct eloop_timeout *msgs_timeout; /* retransmit timer for msgs */
 };
 
 int Radius_client_register(rtapd *apd, RadiusType msg_type,
                            RadiusRxResult (*handler) (rtapd *apd,  struct radius_msg *msg, struct radius_msg *req,
-                                   u8 *shared_secret, size_t shared_secret_len, void *data),  void *data);
-int Radius_client_send(rtapd *rtapd, struct radius_msg *msg, RadiusType msg_type, u8 ApIdx);
-u8 Radius_client_get_id(rtapd *rtapd);
+                                   u8 *shared_secret, size_t shared_secret_len, void *owner, void *data),  void *data);
+int Radius_client_send(rtapd *rtapd, struct radius_msg *msg, RadiusType msg_type, u8 ApIdx,
+                       void *owner, int *handle);
+void Radius_client_release(rtapd *rtapd, int handle, void *owner);
 void Radius_client_flush(rtapd *rtapd);
+void Radius_client_reconfig(rtapd *rtapd, struct rtapd_config *oconf, const int *bss_changed);
 int Radius_client_init(rtapd *rtapd);
+void Radius_client_dump(rtapd *rtapd);
 void Radius_client_deinit(rtapd *rtapd);
 
 #endif /* RADIUS_CLIENT_H */
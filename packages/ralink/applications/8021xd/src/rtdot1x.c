@@ -28,6 +28,9 @@
 #include "sta_info.h"
 #include "radius_client.h"
 #include "config.h"
+#include "md5.h"
+#include "pool.h"
+#include "checkpoint.h"
 
 //#define RT2860AP_SYSTEM_PATH   "/etc/Wireless/RT2860AP/RT2860AP.dat"
 
@@ -137,10 +140,9 @@ void dot1x_set_IdleTimeoutAction(
 static void Handle_reload_config(
     rtapd   *rtapd)
 {
-    struct rtapd_config *newconf;
-#if MULTIPLE_RADIUS
+    struct rtapd_config *newconf, *oldconf;
+    int bss_changed[MAX_MBSSID_NUM];
     int i;
-#endif // MULTIPLE_RADIUS //
 
     DBGPRINT(RT_DEBUG_TRACE, "Reloading configuration\n");
 
@@ -152,13 +154,26 @@ static void Handle_reload_config(
         return;
     }
 
-    /* TODO: update dynamic data based on changed configuration
-     * items (e.g., open/close sockets, remove stations added to
-     * deny list, etc.) */
-    Radius_client_flush(rtapd);
-    Config_free(rtapd->conf);
+    /* only the BSSs whose settings changed start over; stations and
+     * pending RADIUS requests of the others are kept */
+    oldconf = rtapd->conf;
+    for (i = 0; i < MAX_MBSSID_NUM; i++)
+    {
+        bss_changed[i] = Config_bss_changed(oldconf, newconf, i);
+        if (bss_changed[i])
+        {
+            DBGPRINT(RT_DEBUG_TRACE, "%s%d: configuration changed, removing %d stations\n",
+                     rtapd->prefix_wlan_name, i, rtapd->bss_num_sta[i]);
+            Apd_free_bss_stas(rtapd, i);
+        }
+    }
+
+    /* the checkpoint must not keep digests of the old settings, or
+     * stations of a changed BSS would be taken over after a restart */
     rtapd->conf = newconf;
-    Apd_free_stas(rtapd);
+    Checkpoint_reconfig(rtapd);
+    Radius_client_reconfig(rtapd, oldconf, bss_changed);
+    Config_free(oldconf);
 
     /* when reStartAP, no need to reallocate sock
     for (i = 0; i < rtapd->conf->SsidNum; i++)
@@ -174,24 +189,11 @@ static void Handle_reload_config(
         }
     }*/
 
-#if MULTIPLE_RADIUS
-    for (i = 0; i < MAX_MBSSID_NUM; i++)
-        rtapd->radius->mbss_auth_serv_sock[i] = -1;
-#else
-    rtapd->radius->auth_serv_sock = -1;
-#endif
-
     if (Radius_client_init(rtapd))
     {
         DBGPRINT(RT_DEBUG_ERROR,"RADIUS client initialization failed.\n");
         return;
     }
-#if MULTIPLE_RADIUS
-    for (i = 0; i < rtapd->conf->SsidNum; i++)
-        DBGPRINT(RT_DEBUG_TRACE, "auth_serv_sock[%d] = %d\n", i, rtapd->radius->mbss_auth_serv_sock[i]);
-#else
-    DBGPRINT(RT_DEBUG_TRACE,"rtapd->radius->auth_serv_sock = %d\n",rtapd->radius->auth_serv_sock);
-#endif
 
 }
 
@@ -301,9 +303,7 @@ static void Handle_read(int sock, void *eloop_ctx, void *sock_ctx)
             {
                 struct sta_info *s;
 
-                s = rtapd->sta_hash[STA_HASH(sa)];
-                while (s != NULL && memcmp(s->addr, sa, 6) != 0)
-                    s = s->hnext;
+                s = Ap_find_sta(rtapd, sa);
 
                 DBGPRINT(RT_DEBUG_TRACE, "Receive discard-notification form wireless driver.\n");
                 if (s)
@@ -319,7 +319,7 @@ static void Handle_read(int sock, void *eloop_ctx, void *sock_ctx)
             break;
 
             case DOT1X_RELOAD_CONFIG:
-                Handle_reload_config(rtapd);
+                eloop_reload();
                 break;
 
             default:
@@ -485,10 +485,6 @@ static void Apd_cleanup(rtapd *rtapd)
 
 static int Apd_setup_interface(rtapd *rtapd)
 {
-#if MULTIPLE_RADIUS
-    int     i;
-#endif
-
     if (Apd_init_sockets(rtapd))
         return -1;
 
@@ -503,12 +499,6 @@ static int Apd_setup_interface(rtapd *rtapd)
         DBGPRINT(RT_DEBUG_ERROR,"IEEE 802.1X initialization failed.\n");
         return -1;
     }
-#if MULTIPLE_RADIUS
-    for (i = 0; i < rtapd->conf->SsidNum; i++)
-        DBGPRINT(RT_DEBUG_TRACE,"auth_serv_sock[%d] = %d\n", i, rtapd->radius->mbss_auth_serv_sock[i]);
-#else
-    DBGPRINT(RT_DEBUG_TRACE,"rtapd->radius->auth_serv_sock = %d\n",rtapd->radius->auth_serv_sock);
-#endif
 
     return 0;
 }
@@ -519,11 +509,14 @@ static void usage(void)
     DBGPRINT(RT_DEBUG_OFF, "[optional command] : \n");
     DBGPRINT(RT_DEBUG_OFF, "-i <card_number> : indicate which card is used\n");
     DBGPRINT(RT_DEBUG_OFF, "-d <debug_level> : set debug level\n");
+    DBGPRINT(RT_DEBUG_OFF, "-m <max_stations> : station table size (default %d)\n", MAX_STA_COUNT);
+    DBGPRINT(RT_DEBUG_OFF, "-t <min>:<max> : EAP-Request/Identity retransmission timeout bounds in seconds (default %d:%d)\n",
+             EAP_RTO_DEFAULT_MIN, EAP_RTO_DEFAULT_MAX);
 
     exit(1);
 }
 
-static rtapd * Apd_init(const char *prefix_name)
+static rtapd * Apd_init(const char *prefix_name, int max_sta, int rto_min, int rto_max)
 {
     rtapd *rtapd;
     int     i;
@@ -536,7 +529,17 @@ static rtapd * Apd_init(const char *prefix_name)
     }
     memset(rtapd, 0, sizeof(*rtapd));
 
+    if (hostapd_get_rand(rtapd->cookie_secret, sizeof(rtapd->cookie_secret)) ||
+        hostapd_get_rand((u8 *) &rtapd->sta_hash_seed, sizeof(rtapd->sta_hash_seed)))
+    {
+        DBGPRINT(RT_DEBUG_ERROR,"Could not generate the EAP identifier and hash secrets\n");
+        goto fail;
+    }
+
     rtapd->prefix_wlan_name = strdup(prefix_name);
+    rtapd->max_sta = max_sta;
+    rtapd->eap_rto_min = rto_min;
+    rtapd->eap_rto_max = rto_max;
     if (rtapd->prefix_wlan_name == NULL)
     {
         DBGPRINT(RT_DEBUG_ERROR,"Could not allocate memory for prefix_wlan_name\n");
@@ -583,62 +586,116 @@ fail:
 }
 
 static void Handle_usr1(int sig, void *eloop_ctx, void *signal_ctx)
+{
+    eloop_reload();
+}
+
+static void Handle_reload(void *eloop_ctx, void *user_data)
 {
     struct hapd_interfaces *rtapds = (struct hapd_interfaces *) eloop_ctx;
-    struct rtapd_config *newconf;
     int i;
 
-    DBGPRINT(RT_DEBUG_TRACE,"Reloading configuration\n");
     for (i = 0; i < rtapds->count; i++)
     {
-        rtapd *rtapd = rtapds->rtapd[i];
-        newconf = Config_read(rtapd->ioctl_sock, rtapd->prefix_wlan_name);
-        if (newconf == NULL)
-        {
-            DBGPRINT(RT_DEBUG_ERROR,"Failed to read new configuration file - continuing with old.\n");
-            continue;
-        }
+        if (rtapds->rtapd[i])
+            Handle_reload_config(rtapds->rtapd[i]);
+    }
+}
 
-        /* TODO: update dynamic data based on changed configuration
-         * items (e.g., open/close sockets, remove stations added to
-         * deny list, etc.) */
-        Radius_client_flush(rtapd);
-        Config_free(rtapd->conf);
-        rtapd->conf = newconf;
-        Apd_free_stas(rtapd);
+#if ELOOP_PROFILE && defined(DBG)
+static void Handle_dump_profile(void)
+{
+    const struct eloop_loop_profile *loop = eloop_get_loop_profile();
+    const struct eloop_handler_profile *prof;
+    char hist[ELOOP_PROFILE_BUCKETS * 16], *pos;
+    int i, j;
 
-        /* when reStartAP, no need to reallocate sock
-                for (i = 0; i < rtapd->conf->SsidNum; i++)
-                {
-                    if (rtapd->sock[i] >= 0)
-                        close(rtapd->sock[i]);
+    DBGPRINT(RT_DEBUG_OFF, "eloop: %lu iterations, idle %llu ms, busy %llu ms, ready fds 0:%lu 1:%lu 2-3:%lu 4-7:%lu 8+:%lu\n",
+             loop->iterations, loop->idle_us / 1000, loop->busy_us / 1000,
+             loop->ready_hist[0], loop->ready_hist[1], loop->ready_hist[2],
+             loop->ready_hist[3], loop->ready_hist[4]);
 
-                    rtapd->sock[i] = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
-                    if (rtapd->sock[i] < 0)
-                    {
-                        perror("socket[PF_PACKET,SOCK_RAW]");
-                        return;
-                    }
-                }*/
+    for (i = 0; (prof = eloop_get_handler_profile(i)) != NULL; i++)
+    {
+        /* non-empty buckets as <upper bound in us>:count */
+        pos = hist;
+        for (j = 0; j < ELOOP_PROFILE_BUCKETS; j++)
+        {
+            if (prof->hist[j] == 0)
+                continue;
+            if (j == ELOOP_PROFILE_BUCKETS - 1)
+                pos += sprintf(pos, " >=%lu:%lu", 1UL << (j - 1), prof->hist[j]);
+            else
+                pos += sprintf(pos, " <%lu:%lu", 1UL << j, prof->hist[j]);
+        }
 
-#if MULTIPLE_RADIUS
-        for (i = 0; i < MAX_MBSSID_NUM; i++)
-            rtapd->radius->mbss_auth_serv_sock[i] = -1;
-#else
-        rtapd->radius->auth_serv_sock = -1;
+        DBGPRINT(RT_DEBUG_OFF, "eloop: %-8s %p calls %lu avg %llu us max %lu us,%s\n",
+                 prof->type, prof->handler, prof->calls,
+                 prof->total_us / prof->calls, prof->max_us, hist);
+    }
+}
 #endif
 
-        if (Radius_client_init(rtapd))
-        {
-            DBGPRINT(RT_DEBUG_ERROR,"RADIUS client initialization failed.\n");
-            return;
-        }
-#if MULTIPLE_RADIUS
-        for (i = 0; i < rtapd->conf->SsidNum; i++)
-            DBGPRINT(RT_DEBUG_TRACE, "auth_serv_sock[%d] = %d\n", i, rtapd->radius->mbss_auth_serv_sock[i]);
-#else
-        DBGPRINT(RT_DEBUG_TRACE,"rtapd->radius->auth_serv_sock = %d\n",rtapd->radius->auth_serv_sock);
+static void Handle_usr2(int sig, void *eloop_ctx, void *signal_ctx)
+{
+    struct hapd_interfaces *rtapds = (struct hapd_interfaces *) eloop_ctx;
+    struct eloop_stats stats;
+    struct pool_stats pool;
+    int i, j;
+
+    eloop_get_stats(&stats);
+    Pool_get_stats(&pool);
+
+    DBGPRINT(RT_DEBUG_OFF, "eloop: timeouts fired %lu in %lu passes (max %lu per pass, budget hit %lu)\n",
+             stats.timeouts_fired, stats.timeout_batches, stats.timeout_batch_max, stats.timeout_budget_hits);
+    DBGPRINT(RT_DEBUG_OFF, "eloop: timeout lag avg %lu us, max %lu us, <1ms %lu, <10ms %lu, <100ms %lu, <1s %lu, >=1s %lu\n",
+             stats.timeouts_fired ? (unsigned long) (stats.timeout_lag_total_us / stats.timeouts_fired) : 0,
+             stats.timeout_lag_max_us, stats.timeout_lag_hist[0], stats.timeout_lag_hist[1],
+             stats.timeout_lag_hist[2], stats.timeout_lag_hist[3], stats.timeout_lag_hist[4]);
+    DBGPRINT(RT_DEBUG_OFF, "eloop: %lu slack-rounded timeouts shared a pass with another (%lu.%02lu/s)\n",
+             stats.timeouts_slack_shared,
+             stats.uptime_secs ? stats.timeouts_slack_shared / stats.uptime_secs : stats.timeouts_slack_shared,
+             stats.uptime_secs ? stats.timeouts_slack_shared * 100 / stats.uptime_secs % 100 : 0);
+    DBGPRINT(RT_DEBUG_OFF, "eloop: send queued %lu, queue depth %lu (max %lu), dropped %lu, errors %lu\n",
+             stats.send_queued, stats.send_queue_depth, stats.send_queue_max,
+             stats.send_drops, stats.send_errors);
+    DBGPRINT(RT_DEBUG_OFF, "eloop: deferred work run %lu, merged %lu\n",
+             stats.deferred_run, stats.deferred_merged);
+    DBGPRINT(RT_DEBUG_OFF, "eloop: reads high %lu (budget hit %lu), normal %lu (budget hit %lu)\n",
+             stats.prio_reads[ELOOP_PRIO_HIGH], stats.prio_budget_hits[ELOOP_PRIO_HIGH],
+             stats.prio_reads[ELOOP_PRIO_NORMAL], stats.prio_budget_hits[ELOOP_PRIO_NORMAL]);
+    DBGPRINT(RT_DEBUG_OFF, "eapol: reauthentications deferred by rate limit %lu\n",
+             eapol_sm_reauth_deferred());
+    DBGPRINT(RT_DEBUG_OFF, "pool: stations %lu in use, %lu allocated from %lu chunks of %d\n",
+             pool.sta_in_use, pool.sta_allocs, pool.sta_chunks, POOL_STA_CHUNK);
+    for (i = 0; i < POOL_BUF_CLASSES; i++)
+    {
+        DBGPRINT(RT_DEBUG_OFF, "pool: %d byte buffers: %lu allocated, %lu reused, %lu malloc'ed, %lu free\n",
+                 POOL_BUF_MIN_SIZE << (2 * i), pool.buf_allocs[i], pool.buf_reused[i],
+                 pool.buf_mallocs[i], pool.buf_free[i]);
+    }
+    DBGPRINT(RT_DEBUG_OFF, "pool: oversize buffers %lu\n", pool.buf_oversize);
+    DBGPRINT(RT_DEBUG_OFF, "pool: eloop timeouts: %lu in use, %lu allocated, %lu malloc'ed, %lu free\n",
+             pool.timeout_in_use, pool.timeout_allocs, pool.timeout_mallocs, pool.timeout_free);
+
+#if ELOOP_PROFILE && defined(DBG)
+    Handle_dump_profile();
 #endif
+
+    for (i = 0; i < rtapds->count; i++)
+    {
+        rtapd *rtapd = rtapds->rtapd[i];
+
+        if (rtapd == NULL)
+            continue;
+        DBGPRINT(RT_DEBUG_OFF, "%s: %d/%d stations, %lu evicted, EAPOL frames dropped per-MAC %lu, per-BSS %lu\n",
+                 rtapd->prefix_wlan_name, rtapd->num_sta, rtapd->max_sta, rtapd->sta_evictions,
+                 rtapd->admit_mac_drops, rtapd->admit_bss_drops);
+        DBGPRINT(RT_DEBUG_OFF, "%s: stateless Request-Identity sent %lu, answered %lu\n",
+                 rtapd->prefix_wlan_name, rtapd->cookie_requests, rtapd->cookie_accepts);
+        for (j = 0; j < rtapd->conf->SsidNum && j < MAX_MBSSID_NUM; j++)
+            DBGPRINT(RT_DEBUG_OFF, "%s%d: %d stations\n", rtapd->prefix_wlan_name, j, rtapd->bss_num_sta[j]);
+        Radius_client_dump(rtapd);
     }
 }
 
@@ -741,6 +798,10 @@ int main(int argc, char *argv[])
     int ret = 1, i;
     int c;
     pid_t auth_pid;
+    unsigned int seed;
+    int max_sta = MAX_STA_COUNT;
+    int rto_min = EAP_RTO_DEFAULT_MIN, rto_max = EAP_RTO_DEFAULT_MAX;
+    char *pos;
     char prefix_name[IFNAMSIZ+1];
 
     printf("program name = '%s'\n", argv[0]);
@@ -758,7 +819,7 @@ int main(int argc, char *argv[])
 
     for (;;)
     {
-        c = getopt(argc, argv, "d:i:h");
+        c = getopt(argc, argv, "d:i:m:t:h");
         if (c < 0)
             break;
 
@@ -786,6 +847,21 @@ int main(int argc, char *argv[])
                 sprintf(prefix_name, "%s%02d_", prefix_name, ((int)strtol(optarg, 0, 10) - 1));
                 break;
 #endif
+            case 'm':
+                // Size of the station table
+                max_sta = (int)strtol(optarg, 0, 10);
+                if (max_sta <= 0)
+                    usage();
+                break;
+            case 't':
+                // Bounds of the adaptive EAP retransmission timeout
+                rto_min = (int)strtol(optarg, &pos, 10);
+                if (*pos != ':')
+                    usage();
+                rto_max = (int)strtol(pos + 1, &pos, 10);
+                if (*pos != '\0' || rto_min < 1 || rto_max < rto_min || rto_max > 0xffff)
+                    usage();
+                break;
             case 'h':
             default:
                 usage();
@@ -804,6 +880,12 @@ int main(int argc, char *argv[])
         DBGPRINT(RT_DEBUG_TRACE, "Porcess ID = %d\n",auth_pid);
 
         openlog("rtdot1xd",0,LOG_DAEMON);
+
+        // reauthentication jitter must not repeat across restarts
+        if (hostapd_get_rand((u8 *) &seed, sizeof(seed)))
+            seed = auth_pid;
+        srandom(seed);
+
         // set number of configuration file 1
         interfaces.count = 1;
         interfaces.rtapd = malloc(sizeof(rtapd *));
@@ -812,24 +894,30 @@ int main(int argc, char *argv[])
             DBGPRINT(RT_DEBUG_ERROR,"malloc failed\n");
             exit(1);
         }
+        interfaces.rtapd[0] = NULL;
 
         eloop_init(&interfaces);
         eloop_register_signal(SIGINT, Handle_term, NULL);
         eloop_register_signal(SIGTERM, Handle_term, NULL);
         eloop_register_signal(SIGUSR1, Handle_usr1, NULL);
         eloop_register_signal(SIGHUP, Handle_usr1, NULL);
+        eloop_register_signal(SIGUSR2, Handle_usr2, NULL);
+        eloop_register_reload(Handle_reload, NULL);
 
-        interfaces.rtapd[0] = Apd_init(prefix_name);
+        interfaces.rtapd[0] = Apd_init(prefix_name, max_sta, rto_min, rto_max);
         if (!interfaces.rtapd[0])
             goto out;
         if (Apd_setup_interface(interfaces.rtapd[0]))
             goto out;
+        if (Checkpoint_open(interfaces.rtapd[0]))
+            DBGPRINT(RT_DEBUG_ERROR, "Station checkpoint is not available\n");
 
         // Notify driver about PID
         RT_ioctl(interfaces.rtapd[0]->ioctl_sock, RT_PRIV_IOCTL, (char *)&auth_pid, sizeof(int), prefix_name, 0, RT_SET_APD_PID | OID_GET_SET_TOGGLE);
 
         eloop_run();
 
+        Checkpoint_close(interfaces.rtapd[0]);
         Apd_free_stas(interfaces.rtapd[0]);
         ret = 0;
 
@@ -844,7 +932,8 @@ int main(int argc, char *argv[])
         }
 
         free(interfaces.rtapd);
-        eloop_destroy();
+        eloop_destroy(); /* gives its timeouts and buffers back first */
+        Pool_deinit();
         closelog();
         return ret;
     }
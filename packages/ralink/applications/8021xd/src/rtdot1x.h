@@ -80,6 +80,27 @@
 #define REAUTH_TIMER_DEFAULT_reAuthPeriod 3600
 #define AUTH_PAE_DEFAULT_quietPeriod        60
 #define DEFAULT_IDLE_INTERVAL               60
+#define EAP_RTO_DEFAULT_MIN                 1
+#define EAP_RTO_DEFAULT_MAX                 30
+
+/* EAPOL admission control: frames that would create a station or restart
+ * its authentication (EAPOL-Start) take a token from the bucket of their
+ * source MAC address and from the bucket of their BSS */
+#define ADMIT_MAC_BUCKETS                   256
+#define ADMIT_MAC_RATE                      1   /* per second */
+#define ADMIT_MAC_BURST                     5
+#define ADMIT_BSS_RATE                      50  /* per second */
+#define ADMIT_BSS_BURST                     100
+
+/* lifetime in seconds of a stateless Request-Identity identifier; the
+ * identifier of the previous period is accepted as well */
+#define COOKIE_PERIOD                       10
+
+struct admit_bucket
+{
+    eloop_time_t stamp;
+    unsigned int tokens;
+};
 
 
 #ifdef DBG
@@ -114,8 +135,19 @@ typedef struct apd_data
     u8 own_addr[MAX_MBSSID_NUM][MAC_ADDR_LEN];      /* indicate the wireless MAC address */
 
     int num_sta; /* number of entries in sta_list */
-    struct sta_info *sta_list; /* STA info list head */
-    struct sta_info *sta_hash[STA_HASH_SIZE];
+    int max_sta;
+    int eap_rto_min, eap_rto_max; /* seconds, bounds of the adaptive txPeriod */
+    unsigned long sta_evictions;
+    struct sta_info *sta_list; /* STA info list head, most recently active first */
+    struct sta_info *sta_tail;
+    struct sta_info *evict_list; /* the unauthorized ones, eviction candidates last */
+    struct sta_info *evict_tail;
+    struct sta_info *bss_sta_list[MAX_MBSSID_NUM]; /* STAs of each ApIdx */
+    int bss_num_sta[MAX_MBSSID_NUM];
+    struct sta_info **sta_hash; /* open addressing, linear probing */
+    unsigned int sta_hash_size; /* power of 2, 0 until the first station */
+    unsigned int sta_hash_used;
+    u32 sta_hash_seed;
 
     /* pointers to STA info; based on allocated AID or NULL if AID free
      * AID is in the range 1-2007, so sta_aid[0] corresponders to AID 1
@@ -125,6 +157,18 @@ typedef struct apd_data
 
     struct radius_client_data *radius;
 
+    struct admit_bucket admit_mac[ADMIT_MAC_BUCKETS];
+    struct admit_bucket admit_bss[MAX_MBSSID_NUM];
+    unsigned long admit_mac_drops;
+    unsigned long admit_bss_drops;
+
+    /* key of the stateless Request-Identity identifiers */
+    u8 cookie_secret[16];
+    unsigned long cookie_requests;
+    unsigned long cookie_accepts;
+
+    struct checkpoint *ckpt; /* NULL when not checkpointing */
+
 } rtapd;
 
 typedef struct recv_from_ra
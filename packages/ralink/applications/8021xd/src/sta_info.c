@@ -15,33 +15,204 @@
 #include "eloop.h"
 #include "ieee802_1x.h"
 #include "radius.h"
+#include "radius_client.h"
+#include "pool.h"
+#include "checkpoint.h"
+
+/* Station hash over the whole address, keyed with a random seed so that
+ * neither sequential vendor addresses nor crafted ones pile up in one run */
+u32 Ap_sta_hash(rtapd *apd, const u8 *addr)
+{
+    u32 h = apd->sta_hash_seed;
+    int i;
+
+    for (i = 0; i < ETH_ALEN; i++)
+    {
+        h ^= addr[i];
+        h *= 0x01000193;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+
+    return h;
+}
+
+static int Ap_sta_hash_resize(rtapd *apd, unsigned int size)
+{
+    struct sta_info **old = apd->sta_hash, **table;
+    unsigned int old_size = apd->sta_hash_size, i, j;
+
+    table = (struct sta_info **) malloc(size * sizeof(*table));
+    if (table == NULL)
+        return -1;
+    memset(table, 0, size * sizeof(*table));
+
+    for (i = 0; i < old_size; i++)
+    {
+        if (old[i] == NULL)
+            continue;
+        j = Ap_sta_hash(apd, old[i]->addr) & (size - 1);
+        while (table[j] != NULL)
+            j = (j + 1) & (size - 1);
+        table[j] = old[i];
+    }
+
+    free(old);
+    apd->sta_hash = table;
+    apd->sta_hash_size = size;
+    return 0;
+}
+
+static int Ap_sta_evictable(rtapd *apd, struct sta_info *sta)
+{
+    return sta->evict_prev != NULL || apd->evict_list == sta;
+}
+
+static void Ap_sta_evict_add(rtapd *apd, struct sta_info *sta)
+{
+    sta->evict_prev = NULL;
+    sta->evict_next = apd->evict_list;
+    if (sta->evict_next)
+        sta->evict_next->evict_prev = sta;
+    else
+        apd->evict_tail = sta;
+    apd->evict_list = sta;
+}
+
+static void Ap_sta_evict_del(rtapd *apd, struct sta_info *sta)
+{
+    if (sta->evict_prev)
+        sta->evict_prev->evict_next = sta->evict_next;
+    else
+        apd->evict_list = sta->evict_next;
+    if (sta->evict_next)
+        sta->evict_next->evict_prev = sta->evict_prev;
+    else
+        apd->evict_tail = sta->evict_prev;
+    sta->evict_next = sta->evict_prev = NULL;
+}
+
+/* sta_list is kept in most recently active first order. evict_list holds
+ * only the stations whose port is not authorized, in the same order except
+ * that a station losing its authorization counts as just active. */
+static void Ap_sta_list_add(rtapd *apd, struct sta_info *sta)
+{
+    sta->prev = NULL;
+    sta->next = apd->sta_list;
+    if (sta->next)
+        sta->next->prev = sta;
+    else
+        apd->sta_tail = sta;
+    apd->sta_list = sta;
+
+    sta->bss_prev = NULL;
+    sta->bss_next = apd->bss_sta_list[sta->ApIdx];
+    if (sta->bss_next)
+        sta->bss_next->bss_prev = sta;
+    apd->bss_sta_list[sta->ApIdx] = sta;
+
+    if (sta->eapol_sm.portStatus != Authorized)
+        Ap_sta_evict_add(apd, sta);
+
+    apd->num_sta++;
+    apd->bss_num_sta[sta->ApIdx]++;
+}
+
+/* Called whenever the port status of a station may have changed */
+void Ap_sta_port_changed(rtapd *apd, struct sta_info *sta)
+{
+    int evictable = sta->eapol_sm.portStatus != Authorized;
+
+    if (evictable == Ap_sta_evictable(apd, sta))
+        return;
+
+    /* the station was just active, so it goes to the head */
+    if (evictable)
+        Ap_sta_evict_add(apd, sta);
+    else
+        Ap_sta_evict_del(apd, sta);
+}
+
+struct sta_info* Ap_find_sta(rtapd *apd, u8 *sa)
+{
+    unsigned int mask = apd->sta_hash_size - 1, i;
+    struct sta_info *s;
+
+    if (apd->sta_hash_size == 0)
+        return NULL;
+
+    for (i = Ap_sta_hash(apd, sa) & mask; (s = apd->sta_hash[i]) != NULL; i = (i + 1) & mask)
+    {
+        if (memcmp(s->addr, sa, ETH_ALEN) == 0)
+            return s;
+    }
+
+    return NULL;
+}
+
+static void Ap_sta_touch(rtapd *apd, struct sta_info *sta)
+{
+    if (Ap_sta_evictable(apd, sta) && sta != apd->evict_list)
+    {
+        Ap_sta_evict_del(apd, sta);
+        Ap_sta_evict_add(apd, sta);
+    }
+
+    if (sta == apd->sta_list)
+        return;
+
+    sta->prev->next = sta->next;
+    if (sta->next)
+        sta->next->prev = sta->prev;
+    else
+        apd->sta_tail = sta->prev;
+
+    sta->prev = NULL;
+    sta->next = apd->sta_list;
+    apd->sta_list->prev = sta;
+    apd->sta_list = sta;
+}
+
+/* Make room for a new station by dropping the least recently active one
+ * that is not authorized. Authorized stations send no EAPOL frames between
+ * reauthentications and the driver does not tell us about their data
+ * traffic, so there is no telling an idle one from a busy one; they stay. */
+static int Ap_sta_evict(rtapd *apd)
+{
+    struct sta_info *s = apd->evict_tail;
+
+    if (s == NULL)
+        return -1;
+
+    DBGPRINT(RT_DEBUG_TRACE,"Evicting STA " MACSTR " to make room\n", MAC2STR(s->addr));
+    apd->sta_evictions++;
+    Ap_free_sta(apd, s);
+    return 0;
+}
 
 struct sta_info* Ap_get_sta(rtapd *apd, u8 *sa, u8 *apidx, u16 ethertype, int sock)
 {
     struct sta_info *s;
 
-    s = apd->sta_hash[STA_HASH(sa)];
-    while (s != NULL && memcmp(s->addr, sa, 6) != 0)
-        s = s->hnext;
+    s = Ap_find_sta(apd, sa);
 
     if (s == NULL)
     {
-        if (apd->num_sta >= MAX_STA_COUNT)
+        if (apd->num_sta >= apd->max_sta && Ap_sta_evict(apd))
         {
-            /* FIX: might try to remove some old STAs first? */
-            DBGPRINT(RT_DEBUG_ERROR,"No more room for new STAs (%d/%d)\n", apd->num_sta, MAX_STA_COUNT);
+            DBGPRINT(RT_DEBUG_ERROR,"No more room for new STAs (%d/%d)\n", apd->num_sta, apd->max_sta);
             return NULL;
         }
 
-        s = (struct sta_info *) malloc(sizeof(struct sta_info));
+        s = Pool_sta_alloc();
         if (s == NULL)
         {
             DBGPRINT(RT_DEBUG_ERROR,"Malloc failed\n");
             return NULL;
         }
 
-        memset(s, 0, sizeof(struct sta_info));
-        s->radius_identifier = -1;
+        s->radius_request = -1;
 
         s->ethertype = ethertype;
         if (apd->conf->SsidNum > 1)
@@ -53,82 +224,101 @@ struct sta_info* Ap_get_sta(rtapd *apd, u8 *sa, u8 *apidx, u16 ethertype, int so
 
         s->SockNum = sock;
         memcpy(s->addr, sa, ETH_ALEN);
-        s->next = apd->sta_list;
-        apd->sta_list = s;
-        apd->num_sta++;
-        Ap_sta_hash_add(apd, s);
+        if (Ap_sta_hash_add(apd, s))
+        {
+            DBGPRINT(RT_DEBUG_ERROR,"Could not add STA to hash table\n");
+            Pool_sta_free(s);
+            return NULL;
+        }
+        Ap_sta_list_add(apd, s);
         ieee802_1x_new_station(apd, s);
         return s;
     }
     else
     {
         DBGPRINT(RT_DEBUG_TRACE,"A STA has existed(in %s%d)\n", apd->prefix_wlan_name, s->ApIdx);
+        Ap_sta_touch(apd, s);
     }
 
     return s;
 }
 
-struct sta_info* Ap_get_sta_radius_identifier(rtapd *apd, u8 radius_identifier)
-{
-    struct sta_info *s;
-
-    s = apd->sta_list;
-
-    while (s)
-    {
-        if (s->radius_identifier >= 0 && s->radius_identifier == radius_identifier)
-            return s;
-        s = s->next;
-    }
-
-    return NULL;
-}
-
 static void Ap_sta_list_del(rtapd *apd, struct sta_info *sta)
 {
-    struct sta_info *tmp;
-
-    if (apd->sta_list == sta)
-    {
+    if (sta->prev)
+        sta->prev->next = sta->next;
+    else
         apd->sta_list = sta->next;
-        return;
-    }
+    if (sta->next)
+        sta->next->prev = sta->prev;
+    else
+        apd->sta_tail = sta->prev;
 
-    tmp = apd->sta_list;
-    while (tmp != NULL && tmp->next != sta)
-        tmp = tmp->next;
-    if (tmp == NULL)
-    {
-        DBGPRINT(RT_DEBUG_ERROR,"Could not remove STA " MACSTR " from list.\n", MAC2STR(sta->addr));
-    }
+    if (sta->bss_prev)
+        sta->bss_prev->bss_next = sta->bss_next;
     else
-        tmp->next = sta->next;
+        apd->bss_sta_list[sta->ApIdx] = sta->bss_next;
+    if (sta->bss_next)
+        sta->bss_next->bss_prev = sta->bss_prev;
+
+    if (Ap_sta_evictable(apd, sta))
+        Ap_sta_evict_del(apd, sta);
+
+    apd->num_sta--;
+    apd->bss_num_sta[sta->ApIdx]--;
 }
 
-void Ap_sta_hash_add(rtapd *apd, struct sta_info *sta)
+int Ap_sta_hash_add(rtapd *apd, struct sta_info *sta)
 {
-    sta->hnext = apd->sta_hash[STA_HASH(sta->addr)];
-    apd->sta_hash[STA_HASH(sta->addr)] = sta;
+    unsigned int mask, i;
+
+    /* keep the load at most 1/2; a failed resize is fine while there is
+     * still a free slot */
+    if ((apd->sta_hash_used + 1) * 2 > apd->sta_hash_size &&
+        Ap_sta_hash_resize(apd, apd->sta_hash_size ? apd->sta_hash_size * 2 : STA_HASH_MIN_SIZE) &&
+        apd->sta_hash_used + 1 >= apd->sta_hash_size)
+        return -1;
+
+    mask = apd->sta_hash_size - 1;
+    for (i = Ap_sta_hash(apd, sta->addr) & mask; apd->sta_hash[i] != NULL; i = (i + 1) & mask)
+        ;
+    apd->sta_hash[i] = sta;
+    apd->sta_hash_used++;
+    return 0;
 }
 
 static void Ap_sta_hash_del(rtapd *apd, struct sta_info *sta)
 {
-    struct sta_info *s;
+    unsigned int mask = apd->sta_hash_size - 1, i, j, k;
 
-    s = apd->sta_hash[STA_HASH(sta->addr)];
-    if (s == NULL) return;
-    if (memcmp(s->addr, sta->addr, 6) == 0)
-    {
-        apd->sta_hash[STA_HASH(sta->addr)] = s->hnext;
+    if (apd->sta_hash_size == 0)
         return;
+
+    for (i = Ap_sta_hash(apd, sta->addr) & mask; apd->sta_hash[i] != sta; i = (i + 1) & mask)
+    {
+        if (apd->sta_hash[i] == NULL)
+        {
+            DBGPRINT(RT_DEBUG_ERROR,"AP: could not remove STA " MACSTR " from hash table\n", MAC2STR(sta->addr));
+            return;
+        }
     }
 
-    while (s->hnext != NULL && memcmp(s->hnext->addr, sta->addr, 6) != 0)
-        s = s->hnext;
-    if (s->hnext != NULL)
-        s->hnext = s->hnext->hnext;
-    else
-        DBGPRINT(RT_DEBUG_ERROR,"AP: could not remove STA " MACSTR " from hash table\n", MAC2STR(sta->addr));
+    /* backward shift: move up every following entry of the run that may
+     * live in the freed slot, so that lookups need no tombstones */
+    for (j = (i + 1) & mask; apd->sta_hash[j] != NULL; j = (j + 1) & mask)
+    {
+        k = Ap_sta_hash(apd, apd->sta_hash[j]->addr) & mask;
+        if (((j - k) & mask) >= ((j - i) & mask))
+        {
+            apd->sta_hash[i] = apd->sta_hash[j];
+            i = j;
+        }
+    }
+    apd->sta_hash[i] = NULL;
+    apd->sta_hash_used--;
+
+    if (apd->sta_hash_size > STA_HASH_MIN_SIZE && apd->sta_hash_used * 8 < apd->sta_hash_size)
+        Ap_sta_hash_resize(apd, apd->sta_hash_size / 2);
 }
 
 /*
@@ -146,18 +336,20 @@ void Ap_free_sta(rtapd *apd, struct sta_info *sta)
 
     Ap_sta_hash_del(apd, sta);
     Ap_sta_list_del(apd, sta);
+    Checkpoint_sta_drop(apd, sta);
 
     if (sta->aid > 0)
         apd->sta_aid[sta->aid - 1] = NULL;
 
-    apd->num_sta--;
-
+    Ap_sta_no_session_timeout(apd, sta);
+    if (sta->radius_request >= 0)
+        Radius_client_release(apd, sta->radius_request, sta);
     ieee802_1x_free_station(sta);
 
     if (sta->last_assoc_req)
         free(sta->last_assoc_req);
 
-    free(sta);
+    Pool_sta_free(sta);
 }
 
 /*
@@ -179,17 +371,40 @@ void Apd_free_stas(rtapd *apd)
         DBGPRINT(RT_DEBUG_ERROR,"Removing station " MACSTR "\n", MAC2STR(prev->addr));
         Ap_free_sta(apd, prev);
     }
+
+    free(apd->sta_hash);
+    apd->sta_hash = NULL;
+    apd->sta_hash_size = 0;
+    apd->sta_hash_used = 0;
 }
 
-void Ap_handle_session_timer(void *eloop_ctx, void *timeout_ctx)
+/*
+    ========================================================================
+    Description:
+        remove all stations of one BSS, leaving the others alone.
+    ========================================================================
+*/
+void Apd_free_bss_stas(rtapd *apd, int apidx)
+{
+    struct sta_info *sta, *prev;
+
+    sta = apd->bss_sta_list[apidx];
+    DBGPRINT(RT_DEBUG_TRACE,"Apd_free_bss_stas(%s%d)\n", apd->prefix_wlan_name, apidx);
+    while (sta)
+    {
+        prev = sta;
+        sta = sta->bss_next;
+        DBGPRINT(RT_DEBUG_ERROR,"Removing station " MACSTR "\n", MAC2STR(prev->addr));
+        Ap_free_sta(apd, prev);
+    }
+}
+
+static void Ap_sta_deauth(rtapd *apd, struct sta_info *sta)
 {
     char *buf;
-    rtapd *apd = eloop_ctx;
     size_t len;
     struct ieee8023_hdr *hdr3;
-    struct sta_info *sta = timeout_ctx;
 
-    DBGPRINT(RT_DEBUG_TRACE,"AP_HANDLE_SESSION_TIMER \n");
     len = sizeof(*hdr3) + 2;
     buf = (char *) malloc(len);
     if (buf == NULL)
@@ -203,16 +418,26 @@ void Ap_handle_session_timer(void *eloop_ctx, void *timeout_ctx)
     memcpy(hdr3->dAddr, sta->addr, ETH_ALEN);
     memcpy(hdr3->sAddr, apd->own_addr[sta->ApIdx], ETH_ALEN);
     // send deauth
-    DBGPRINT(RT_DEBUG_TRACE,"AP_HANDLE_SESSION_TIMER : Send Deauth \n");
+    DBGPRINT(RT_DEBUG_TRACE,"Send Deauth to " MACSTR "\n", MAC2STR(sta->addr));
     if (RT_ioctl(apd->ioctl_sock,
                  RT_PRIV_IOCTL, buf, len,
                  apd->prefix_wlan_name, sta->ApIdx,
                  RT_OID_802_DOT1X_RADIUS_DATA))
     {
         DBGPRINT(RT_DEBUG_ERROR," ioctl \n");
+        free(buf);
         return;
     }
     free(buf);
+}
+
+void Ap_handle_session_timer(void *eloop_ctx, void *timeout_ctx)
+{
+    rtapd *apd = eloop_ctx;
+    struct sta_info *sta = timeout_ctx;
+
+    DBGPRINT(RT_DEBUG_TRACE,"AP_HANDLE_SESSION_TIMER \n");
+    Ap_sta_deauth(apd, sta);
 
 //  Ap_free_sta(apd, sta);
 }
@@ -220,11 +445,12 @@ void Ap_handle_session_timer(void *eloop_ctx, void *timeout_ctx)
 void Ap_sta_session_timeout(rtapd *apd, struct sta_info *sta, u32 session_timeout)
 {
     DBGPRINT(RT_DEBUG_TRACE,"AP_STA_SESSION_TIMEOUT %d seconds \n",session_timeout);
-    eloop_cancel_timeout(Ap_handle_session_timer, apd, sta);
-    eloop_register_timeout(session_timeout, 0, Ap_handle_session_timer, apd, sta);
+    sta->session_deadline = eloop_now() + (eloop_time_t) session_timeout * ELOOP_NSEC_PER_SEC;
+    eloop_register_timeout_ref(session_timeout, 0, 0, Ap_handle_session_timer, apd, sta, &sta->session_timeout);
 }
 
 void Ap_sta_no_session_timeout(rtapd *apd, struct sta_info *sta)
 {
-    eloop_cancel_timeout(Ap_handle_session_timer, apd, sta);
+    eloop_cancel_timeout_ref(&sta->session_timeout);
+    sta->session_deadline = 0;
 }